@@ -0,0 +1,88 @@
+#include <algorithm>
+
+#include "deal_reorder.hpp"
+
+void DealReorderBuffer::push(int week, PendingDeal d) {
+  d.seq = nextSeq++;
+  partitions[week].push(std::move(d));
+  count++;
+}
+
+void DealReorderBuffer::merge(int week, PendingDeal d) {
+  auto& users = merged[week];
+  auto m = users.find(d.id);
+  if (m == users.end()) {
+    d.seq = nextSeq++;
+    std::string id = d.id;
+    users.emplace(std::move(id), std::move(d));
+    mergedCount++;
+    return;
+  }
+  m->second.amount += d.amount;
+  m->second.at = std::max(m->second.at, d.at);
+}
+
+void DealReorderBuffer::release(int week, int64_t watermark, std::vector<PendingDeal>& out) {
+  auto p = partitions.find(week);
+  if (p != partitions.end()) {
+    Partition& q = p->second;
+    while (!q.empty() && q.top().at <= watermark) {
+      out.push_back(q.top());
+      q.pop();
+      count--;
+    }
+    if (q.empty())
+      partitions.erase(p);
+  }
+
+  auto m = merged.find(week);
+  if (m == merged.end())
+    return;
+  auto& users = m->second;
+  for (auto d = users.begin(); d != users.end(); ) {
+    if (d->second.at > watermark) {
+      ++d;
+      continue;
+    }
+    out.push_back(std::move(d->second));
+    d = users.erase(d);
+    mergedCount--;
+  }
+  if (users.empty())
+    merged.erase(m);
+}
+
+void DealReorderBuffer::releaseBefore(int week, std::vector<PendingDeal>& out) {
+  auto end = partitions.lower_bound(week);
+  for (auto p = partitions.begin(); p != end; ++p) {
+    Partition& q = p->second;
+    while (!q.empty()) {
+      out.push_back(q.top());
+      q.pop();
+      count--;
+    }
+  }
+  partitions.erase(partitions.begin(), end);
+
+  auto mergedEnd = merged.lower_bound(week);
+  for (auto m = merged.begin(); m != mergedEnd; ++m) {
+    for (auto& d : m->second)
+      out.push_back(std::move(d.second));
+    mergedCount -= m->second.size();
+  }
+  merged.erase(merged.begin(), mergedEnd);
+}
+
+void DealReorderBuffer::copyAll(std::vector<PendingDeal>& out) const {
+  for (const auto& p : partitions) {
+    Partition q = p.second;
+    while (!q.empty()) {
+      out.push_back(q.top());
+      q.pop();
+    }
+  }
+  for (const auto& m : merged) {
+    for (const auto& d : m.second)
+      out.push_back(d.second);
+  }
+}
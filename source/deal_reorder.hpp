@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using Rating = float;
+
+struct PendingDeal {
+  std::string id;
+  int64_t at = 0;        // event time, ns since epoch
+  Rating amount = 0;
+  uint64_t seq = 0;      // arrival order, breaks ties of equal event times
+};
+
+// Deals waiting to be applied in event-time order, one partition per week.
+//
+// The owner releases a partition up to its watermark once the week is the
+// active one, so deals stamped into the next week wait out the grace period
+// of the closing week here instead of landing in it. The buffer is bounded,
+// the owner decides what to do with deals that don't fit: those of a week
+// that isn't open yet can be merged into one deal per user, which takes no
+// room in the buffer.
+class DealReorderBuffer {
+public:
+  explicit DealReorderBuffer(size_t capacity = 100000) : capacity(capacity) {}
+
+  void setCapacity(size_t c) { capacity = c; }
+  size_t size() const { return count + mergedCount; }
+  bool full() const { return count >= capacity; }
+
+  void push(int week, PendingDeal d);
+
+  // Adds [d] to the merged deal of its user in [week]. The merged deal
+  // keeps the sum of the amounts and the latest event time, and is
+  // released after the deals of the week made before it
+  void merge(int week, PendingDeal d);
+
+  // Appends the deals of [week] made at or before [watermark], oldest
+  // first and the merged ones last
+  void release(int week, int64_t watermark, std::vector<PendingDeal>& out);
+
+  // Appends every deal of the weeks before [week], oldest first and the
+  // merged ones last
+  void releaseBefore(int week, std::vector<PendingDeal>& out);
+
+  // Appends a copy of every deal waiting, merged ones included
+  void copyAll(std::vector<PendingDeal>& out) const;
+
+private:
+  struct Later {
+    bool operator()(const PendingDeal& a, const PendingDeal& b) const {
+      return a.at > b.at || (a.at == b.at && a.seq > b.seq);
+    }
+  };
+  using Partition = std::priority_queue<PendingDeal, std::vector<PendingDeal>, Later>;
+
+  std::map<int, Partition> partitions;
+  std::map<int, std::unordered_map<std::string, PendingDeal>> merged;
+  size_t capacity;
+  size_t count = 0;
+  size_t mergedCount = 0;
+  uint64_t nextSeq = 0;
+};
@@ -26,6 +26,7 @@
 
 #include "basic_controller.hpp"
 #include "network_utils.hpp"
+#include "startup_report.hpp"
 
 namespace cfx {
     BasicController::BasicController() {
@@ -40,12 +41,17 @@ namespace cfx {
         uri_builder endpointBuilder;
 
         endpointBuilder.set_scheme(endpointURI.scheme());
-        if (endpointURI.host() == "host_auto_ip4") {
-            endpointBuilder.set_host(NetworkUtils::hostIP4());        
+        std::string host = endpointURI.host();
+        if (host == "host_auto_ip4") {
+            host = NetworkUtils::hostIP4();
         }
-        else if (endpointURI.host() == "host_auto_ip6") {
-            endpointBuilder.set_host(NetworkUtils::hostIP6());
+        else if (host == "host_auto_ip6") {
+            host = NetworkUtils::hostIP6();
         }
+        if (host.empty()) {
+            throw std::runtime_error("no address found for " + endpointURI.host() + "!");
+        }
+        endpointBuilder.set_host(host);
         endpointBuilder.set_port(endpointURI.port());
         endpointBuilder.set_path(endpointURI.path());
 
@@ -69,4 +75,54 @@ namespace cfx {
         auto relativePath = uri::decode(message.relative_uri().path());
         return uri::split_path(relativePath);        
     }
+
+    void BasicController::support(const http::method & method, const std::function<void(http_request)> & handler) {
+        _listener.support(method, [=](http_request message) {
+            // the route is the method and the first two path segments, the
+            // user the "id" of the query if there is one
+            auto relative = message.relative_uri();
+            const auto & path = relative.path();
+            size_t end = 0;
+            for (int segments = 0; segments < 2 && end != std::string::npos; segments++)
+                end = path.find('/', end + 1);
+            TraceScope scope(RequestTrace::start(method + " " + path.substr(0, end)));
+            auto query = uri::split_query(relative.query());
+            auto id = query.find("id");
+            if (id != query.end())
+                RequestTrace::setUser(id->second);
+            handler(message);
+        });
+    }
+
+    void BasicController::replyReadiness(const http_request & message) {
+        std::vector<json::value> stages;
+        for (const auto & s : StartupReport::stages()) {
+            json::value v;
+            v["name"] = json::value::string(s.name);
+            v["start_ms"] = s.startUs / 1000.0;
+            v["elapsed_ms"] = s.elapsedUs / 1000.0;
+            if (!s.detail.empty())
+                v["detail"] = json::value::string(s.detail);
+            stages.push_back(v);
+        }
+        json::value response;
+        response["serving_after_ms"] = StartupReport::readyUs() / 1000.0;
+        response["stages"] = json::value::array(stages);
+        reply(message, status_codes::OK, response);
+    }
+
+    pplx::task<void> BasicController::traced(const SpanHandle & span, pplx::task<void> sent) {
+        if (!span)
+            return sent;
+        return sent.then([span](pplx::task<void> t) {
+            bool ok = true;
+            try {
+                t.get();
+            }
+            catch(...) {
+                ok = false;
+            }
+            RequestTrace::finish(span, ok);
+        });
+    }
 }
\ No newline at end of file
@@ -0,0 +1,212 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+#include "cpu_placement.hpp"
+
+namespace cfx {
+
+    namespace {
+        const int mpolPreferred = 1;   // MPOL_PREFERRED of <numaif.h>
+        const size_t maxPlaced = 256;  // replication senders come and go
+
+        PlacementConfig current;
+        std::mutex placedMutex;
+        std::vector<std::string> placed;
+
+        std::string envString(const char * name) {
+            const char * v = std::getenv(name);
+            return v ? v : "";
+        }
+
+        int envInt(const char * name, int fallback) {
+            std::string v = envString(name);
+            if (v.empty())
+                return fallback;
+            try {
+                return std::stoi(v);
+            }
+            catch (std::exception & e) {
+                std::cout << "Bad " << name << " value: " << e.what() << '\n';
+                return fallback;
+            }
+        }
+
+        bool pinCurrentThread(const std::vector<int> & cpus) {
+            if (cpus.empty())
+                return false;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int c : cpus) {
+                if (c >= 0 && c < CPU_SETSIZE)
+                    CPU_SET(c, &set);
+            }
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+        }
+
+        // Pages first touched by the calling thread come from [node] while
+        // it has free memory, so the user table lands next to its handlers
+        bool preferNode(int node) {
+            if (node < 0 || node >= int(sizeof(unsigned long) * 8))
+                return false;
+            unsigned long mask = 1UL << node;
+            return syscall(SYS_set_mempolicy, mpolPreferred, &mask, sizeof(mask) * 8) == 0;
+        }
+
+        std::vector<int> effectiveCpus() {
+            std::vector<int> res;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+                return res;
+            for (int c = 0; c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &set))
+                    res.push_back(c);
+            }
+            return res;
+        }
+    }
+
+    PlacementConfig PlacementConfig::fromEnvironment() {
+        PlacementConfig c;
+        c.handlerThreads = std::max(0, envInt("EXEC_THREADS", 0));
+        c.ioThreads = std::max(0, envInt("EXEC_IO_THREADS", 0));
+        c.ioCpus = CpuPlacement::parseCpuList(envString("EXEC_IO_CPUS"));
+        c.handlerCpus = CpuPlacement::parseCpuList(envString("EXEC_HANDLER_CPUS"));
+        c.backgroundCpu = envInt("EXEC_BACKGROUND_CPU", -1);
+        c.numaNode = envInt("EXEC_NUMA_NODE", -1);
+        if (c.numaNode < 0 && !c.handlerCpus.empty())
+            c.numaNode = CpuPlacement::nodeOfCpu(c.handlerCpus.front());
+        return c;
+    }
+
+    void CpuPlacement::configure(const PlacementConfig & config) {
+        current = config;
+        // the main thread is left unpinned (every thread it starts inherits
+        // its mask) but allocates from the data's node like the handlers
+        preferNode(current.numaNode);
+        record("main", false);
+    }
+
+    const PlacementConfig & CpuPlacement::config() {
+        return current;
+    }
+
+    void CpuPlacement::placeIoThread() {
+        thread_local bool done = false;
+        if (done)
+            return;
+        done = true;
+        record("io", pinCurrentThread(current.ioCpus));
+    }
+
+    void CpuPlacement::placeHandlerThread(unsigned index) {
+        const auto & cpus = current.handlerCpus;
+        bool pinned;
+        if (cpus.size() >= current.handlerThreads && !cpus.empty())
+            pinned = pinCurrentThread({cpus[index % cpus.size()]});
+        else
+            pinned = pinCurrentThread(cpus);
+        preferNode(current.numaNode);
+        record("handler " + std::to_string(index), pinned);
+    }
+
+    void CpuPlacement::placeBackgroundThread(const std::string & name) {
+        bool pinned = false;
+        if (current.backgroundCpu >= 0)
+            pinned = pinCurrentThread({current.backgroundCpu});
+        preferNode(current.numaNode);
+        record(name, pinned);
+    }
+
+    void CpuPlacement::record(const std::string & name, bool pinned) {
+        std::ostringstream line;
+        line << name << ": cpus " << formatCpuList(effectiveCpus())
+             << (pinned ? " (pinned)" : " (unpinned)");
+        std::unique_lock<std::mutex> lock { placedMutex };
+        if (placed.size() < maxPlaced)
+            placed.push_back(line.str());
+    }
+
+    std::string CpuPlacement::report() {
+        std::ostringstream out;
+        out << "=== Placement:\n";
+        out << "handler threads: " << current.handlerThreads
+            << (current.handlerThreads ? "" : " (cpprest pool)") << '\n';
+        out << "io cpus: " << (current.ioCpus.empty() ? "any" : formatCpuList(current.ioCpus))
+            << " (pinned on first request)\n";
+        out << "numa node: ";
+        if (current.numaNode >= 0)
+            out << current.numaNode << " preferred\n";
+        else
+            out << "default policy\n";
+        std::unique_lock<std::mutex> lock { placedMutex };
+        for (const auto & p : placed)
+            out << p << '\n';
+        out << "=== EOF Placement";
+        return out.str();
+    }
+
+    std::vector<int> CpuPlacement::parseCpuList(const std::string & list) {
+        std::vector<int> res;
+        std::istringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            if (range.empty())
+                continue;
+            auto dash = range.find('-');
+            try {
+                int from = std::stoi(range.substr(0, dash));
+                int to = dash == std::string::npos ? from : std::stoi(range.substr(dash + 1));
+                for (int c = from; c <= to; c++)
+                    res.push_back(c);
+            }
+            catch (std::exception & e) {
+                std::cout << "Bad CPU list '" << list << "': " << e.what() << '\n';
+                return std::vector<int>();
+            }
+        }
+        return res;
+    }
+
+    std::string CpuPlacement::formatCpuList(const std::vector<int> & cpus) {
+        std::ostringstream out;
+        for (size_t i = 0; i < cpus.size(); ) {
+            size_t j = i;
+            while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+                j++;
+            if (i)
+                out << ',';
+            out << cpus[i];
+            if (j > i)
+                out << '-' << cpus[j];
+            i = j + 1;
+        }
+        return out.str();
+    }
+
+    int CpuPlacement::nodeOfCpu(int cpu) {
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        DIR * d = ::opendir(dir.c_str());
+        if (!d)
+            return -1;
+        int node = -1;
+        while (dirent * e = ::readdir(d)) {
+            if (std::strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+                node = std::atoi(e->d_name + 4);
+                break;
+            }
+        }
+        ::closedir(d);
+        return node;
+    }
+}
@@ -0,0 +1,73 @@
+#include "handler_executor.hpp"
+#include "cpu_placement.hpp"
+
+namespace cfx {
+
+    namespace {
+        std::shared_ptr<HandlerExecutor> shared;
+    }
+
+    HandlerExecutor::HandlerExecutor(unsigned threads) {
+        for (unsigned i = 0; i < threads; i++) {
+            _threads.emplace_back([this, i] { run(i); });
+        }
+        std::unique_lock<std::mutex> lock { _mutex };
+        _cond.wait(lock, [this, threads] { return _started == threads; });
+    }
+
+    HandlerExecutor::~HandlerExecutor() {
+        {
+            std::unique_lock<std::mutex> lock { _mutex };
+            _stop = true;
+        }
+        _cond.notify_all();
+        for (auto & t : _threads) {
+            t.join();
+        }
+    }
+
+    void HandlerExecutor::schedule(pplx::TaskProc_t proc, void * param) {
+        {
+            std::unique_lock<std::mutex> lock { _mutex };
+            _queue.emplace_back(proc, param);
+        }
+        _cond.notify_one();
+    }
+
+    void HandlerExecutor::run(unsigned index) {
+        CpuPlacement::placeHandlerThread(index);
+        {
+            std::unique_lock<std::mutex> lock { _mutex };
+            _started++;
+        }
+        _cond.notify_all();
+
+        for (;;) {
+            std::pair<pplx::TaskProc_t, void *> job;
+            {
+                std::unique_lock<std::mutex> lock { _mutex };
+                _cond.wait(lock, [this] { return _stop || !_queue.empty(); });
+                if (_queue.empty())
+                    return;
+                job = _queue.front();
+                _queue.pop_front();
+            }
+            job.first(job.second);
+        }
+    }
+
+    void HandlerExecutor::start(unsigned threads) {
+        if (threads)
+            shared = std::make_shared<HandlerExecutor>(threads);
+    }
+
+    bool HandlerExecutor::started() {
+        return shared != nullptr;
+    }
+
+    pplx::task_options HandlerExecutor::options() {
+        if (shared)
+            return pplx::task_options(pplx::scheduler_ptr(shared));
+        return pplx::task_options();
+    }
+}
@@ -30,6 +30,7 @@
 #include <cpprest/http_listener.h>
 #include <pplx/pplxtasks.h>
 #include "controller.hpp"
+#include "request_trace.hpp"
 
 using namespace web;
 using namespace http::experimental::listener;
@@ -53,5 +54,32 @@ namespace cfx {
         }
 
         std::vector<utility::string_t> requestPath(const http_request & message);
+
+        // Replies to [message] and closes the span of the request bound to
+        // the calling thread (see TraceScope)
+        template <typename... Body>
+        static pplx::task<void> reply(const http_request & message, http::status_code status, Body &&... body) {
+            auto span = RequestTrace::current();
+            RequestTrace::replying(span, status);
+            return traced(span, message.reply(status, std::forward<Body>(body)...));
+        }
+
+        static pplx::task<void> reply(const http_request & message, http_response response) {
+            auto span = RequestTrace::current();
+            RequestTrace::replying(span, response.status_code());
+            return traced(span, message.reply(response));
+        }
+
+    protected:
+        // Registers [handler] for [method] on the listener, every request
+        // gets a span from its arrival on
+        void support(const http::method & method, const std::function<void(http_request)> & handler);
+
+        // Answers GET /service/ready with the startup stages; the listener
+        // only opens once they are done, so any answer means serving
+        static void replyReadiness(const http_request & message);
+
+    private:
+        static pplx::task<void> traced(const SpanHandle & span, pplx::task<void> sent);
     };
 }
\ No newline at end of file
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace cfx {
+
+    // Thread placement of the service, read from the environment:
+    //
+    //   EXEC_THREADS         handler threads running request continuations
+    //                        (0, the default, keeps them on cpprest's pool)
+    //   EXEC_IO_THREADS      size of cpprest's I/O pool (default: its own)
+    //   EXEC_IO_CPUS         CPU list for I/O threads, e.g. "0-3,8"
+    //   EXEC_HANDLER_CPUS    CPU list for handler threads
+    //   EXEC_BACKGROUND_CPU  CPU for background jobs (timers, archiving, ...)
+    //   EXEC_NUMA_NODE       node user data is allocated from (default: the
+    //                        node of the first handler CPU, if any)
+    //
+    // Empty lists leave threads wherever the scheduler puts them.
+    struct PlacementConfig {
+        unsigned handlerThreads = 0;
+        unsigned ioThreads = 0;
+        std::vector<int> ioCpus;
+        std::vector<int> handlerCpus;
+        int backgroundCpu = -1;
+        int numaNode = -1;
+
+        static PlacementConfig fromEnvironment();
+    };
+
+    class CpuPlacement {
+    public:
+        // Applies [config] to the calling (main) thread, must run before
+        // any other thread of the service starts
+        static void configure(const PlacementConfig & config);
+        static const PlacementConfig & config();
+
+        // Pins the calling cpprest thread, cheap after the first call
+        static void placeIoThread();
+        // Pins handler thread [index] (one CPU of the list per thread while
+        // there are enough of them, the whole list otherwise)
+        static void placeHandlerThread(unsigned index);
+        static void placeBackgroundThread(const std::string & name);
+
+        // Effective placement of every thread placed so far
+        static std::string report();
+
+        // "0-3,8" -> {0, 1, 2, 3, 8}
+        static std::vector<int> parseCpuList(const std::string & list);
+        static std::string formatCpuList(const std::vector<int> & cpus);
+        // -1 when the node is unknown
+        static int nodeOfCpu(int cpu);
+
+    private:
+        static void record(const std::string & name, bool pinned);
+    };
+}
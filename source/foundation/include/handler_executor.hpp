@@ -0,0 +1,42 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+namespace cfx {
+
+    // Fixed pool of placed threads running request continuations, so that
+    // handlers touch the user table from the CPUs and NUMA node chosen at
+    // startup instead of wherever cpprest's pool happens to run.
+    class HandlerExecutor : public pplx::scheduler_interface {
+    public:
+        explicit HandlerExecutor(unsigned threads);
+        ~HandlerExecutor();
+
+        void schedule(pplx::TaskProc_t proc, void * param) override;
+
+        // Starts the shared executor, returns once all its threads are placed
+        static void start(unsigned threads);
+        static bool started();
+        // Options running a task on the shared executor, or wherever pplx
+        // chooses when none was started
+        static pplx::task_options options();
+
+    private:
+        void run(unsigned index);
+
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::deque<std::pair<pplx::TaskProc_t, void *>> _queue;
+        unsigned _started = 0;
+        bool _stop = false;
+        std::vector<std::thread> _threads;
+    };
+}
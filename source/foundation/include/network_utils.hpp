@@ -33,12 +33,12 @@ using namespace boost::asio;
 using namespace boost::asio::ip;
 
 namespace cfx {
-   
-   using HostInetInfo = tcp::resolver::iterator;
 
    class NetworkUtils {
    private:
-      static HostInetInfo queryHostInetInfo();
+      // First address of [family] on an interface that is up, loopback
+      // only if there is nothing else, empty if there is none at all. The
+      // interfaces are listed by the kernel, no name lookup is involved.
       static std::string hostIP(unsigned short family);
    public:
       // gets the host IP4 string formatted
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace cfx {
+
+    // Contention figures of one operation, i.e. one tagged lock call site
+    struct LockOpStats {
+        static const int buckets = 40;   // [i]: [2^i, 2^(i+1)) ns, [0] also holds 0
+
+        std::string op;
+        uint64_t acquisitions = 0;
+        uint64_t contended = 0;          // acquisitions that had to wait
+        uint64_t waitNs = 0;
+        uint64_t holdNs = 0;
+        uint64_t maxWaitNs = 0;
+        uint64_t maxHoldNs = 0;
+        std::vector<uint64_t> waitHistogram;
+        std::vector<uint64_t> holdHistogram;
+
+        // Upper bound of the bucket holding percentile [p] (0..100)
+        static uint64_t percentile(const std::vector<uint64_t> & histogram, double p);
+    };
+
+    // Time [waiter] spent blocked while [holder] had the lock
+    struct LockBlocking {
+        std::string waiter;
+        std::string holder;
+        uint64_t count = 0;
+        uint64_t waitNs = 0;
+    };
+
+    struct LockProfile {
+        bool enabled = false;
+        uint64_t elapsedMs = 0;          // since profiling was last enabled or reset
+        std::vector<LockOpStats> ops;
+        std::vector<LockBlocking> blocking;   // worst first
+    };
+
+    // std::mutex replacement that can profile its own contention.
+    //
+    // Every acquisition is attributed to the operation the calling thread
+    // named last through as():
+    //
+    //   std::unique_lock<ProfiledMutex> lock { mutex.as("deal") };
+    //
+    // While profiling is off lock() and unlock() add a relaxed load and a
+    // plain store to the std::mutex calls, and lock() tries first so only
+    // contended waits are timed (for threadWaitNs()). While it is on, holds
+    // are timed as well, and both go into per-operation log2 histograms
+    // plus a waiter x holder blocking matrix.
+    class ProfiledMutex {
+    public:
+        static const int maxOps = 32;    // the last slot collects the overflow
+
+        ProfiledMutex();
+        ProfiledMutex(const ProfiledMutex &) = delete;
+        ProfiledMutex & operator=(const ProfiledMutex &) = delete;
+
+        // Tags the following acquisitions of the calling thread with [op],
+        // which has to outlive the mutex (a string literal)
+        ProfiledMutex & as(const char * op);
+
+        void lock();
+        bool try_lock();
+        void unlock();
+
+        void enable(bool on);
+        bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+        void reset();
+
+        LockProfile profile(size_t topBlocking) const;
+
+        // Time the calling thread spent blocked on any ProfiledMutex so far,
+        // kept whether profiling is on or not
+        static uint64_t threadWaitNs();
+
+    private:
+        struct OpSlot {
+            std::atomic<const char *> name;
+            std::atomic<uint64_t> acquisitions;
+            std::atomic<uint64_t> contended;
+            std::atomic<uint64_t> waitNs;
+            std::atomic<uint64_t> holdNs;
+            std::atomic<uint64_t> maxWaitNs;
+            std::atomic<uint64_t> maxHoldNs;
+            std::atomic<uint64_t> wait[LockOpStats::buckets];
+            std::atomic<uint64_t> hold[LockOpStats::buckets];
+        };
+
+        struct BlockingCell {
+            std::atomic<uint64_t> count;
+            std::atomic<uint64_t> waitNs;
+        };
+
+        int opIndex(const char * op);
+        void acquired(int op, bool contended, int holder, uint64_t wait, uint64_t now);
+        void released(int op, uint64_t hold);
+
+        std::mutex _m;
+        std::atomic<bool> _enabled;
+        std::atomic<int64_t> _since;
+
+        // written by the owner only
+        uint64_t _acquiredAt = 0;        // 0: acquisition not profiled
+        int _holderOp = -1;
+        // read by waiters to blame the holder
+        std::atomic<int> _holder;
+
+        OpSlot _ops[maxOps];
+        BlockingCell _blocking[maxOps][maxOps];
+    };
+}
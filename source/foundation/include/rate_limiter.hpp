@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace cfx {
+
+    struct RateLimitConfig {
+        double rate = 0;        // tokens per second, 0 disables the limiter
+        double burst = 0;       // bucket size
+        size_t slots = 16384;   // table size, rounded up to a power of two
+
+        // <PREFIX>_RATE, <PREFIX>_BURST and <PREFIX>_SLOTS override the defaults
+        static RateLimitConfig fromEnvironment(const std::string & prefix,
+                                               double rate, double burst);
+    };
+
+    // Token buckets keyed by a hash of an arbitrary key (user id, client
+    // address, ...) in a fixed table of cache-line sized slots.
+    //
+    // Nothing is locked or allocated per call: a key claims a free slot
+    // among the few probed for it with a CAS, and the bucket state (tokens
+    // and time of the last take) is one 64-bit word updated with a CAS. A
+    // refused call only reads, so a flood of refused requests for one key
+    // doesn't bounce its cache line between cores. When all probed slots
+    // are taken the least recently used of them is handed over, which may
+    // briefly credit the new key with the old one's tokens - buckets are a
+    // protection, not an accounting.
+    class RateLimiter {
+    public:
+        explicit RateLimiter(const RateLimitConfig & config);
+        ~RateLimiter();
+        RateLimiter(const RateLimiter &) = delete;
+        RateLimiter & operator=(const RateLimiter &) = delete;
+
+        bool enabled() const { return _rate > 0; }
+
+        // Takes a token for [key], false when its bucket is empty
+        bool allow(const char * key, size_t size);
+        bool allow(const std::string & key) {
+            return allow(key.data(), key.size());
+        }
+
+    private:
+        struct alignas(64) Slot {
+            std::atomic<uint64_t> key;
+            std::atomic<uint64_t> state;   // ms since start << tokenBits | milli-tokens
+        };
+
+        uint64_t nowMs() const;
+        bool take(Slot & slot, uint64_t now);
+
+        double _rate;         // milli-tokens per ms, i.e. tokens per second
+        uint64_t _burst;      // in milli-tokens
+        size_t _mask;
+        Slot * _slots = nullptr;
+        std::chrono::steady_clock::time_point _start;
+    };
+}
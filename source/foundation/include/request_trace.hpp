@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace cfx {
+
+    // Request tracing, read from the environment:
+    //
+    //   TRACE_RING_SPANS     spans kept per thread (default 4096, 0: off)
+    //   TRACE_FILE           Chrome trace-event file the flusher appends to
+    //                        (default empty: rings only, no file is written)
+    //   TRACE_SLOW_MS        requests at least that slow are all written
+    //                        (default 10)
+    //   TRACE_SAMPLE_EVERY   of the others every n-th is written (default
+    //                        1000, 0: none)
+    //   TRACE_FLUSH_MS       flusher period (default 1000)
+    //   TRACE_FILE_MAX_MB    the file is moved to <file>.1 past that size
+    //                        (default 256)
+    struct TraceConfig {
+        size_t ringSpans = 4096;
+        std::string file;
+        uint64_t slowNs = 10000000;
+        unsigned sampleEvery = 1000;
+        unsigned flushMs = 1000;
+        uint64_t fileMaxBytes = 256ULL << 20;
+
+        static TraceConfig fromEnvironment();
+    };
+
+    // What is kept of a finished request, all times in ns of the steady clock
+    struct Span {
+        static const size_t routeLen = 48;
+
+        char route[routeLen];   // "GET /rating/user", cut to fit
+        uint64_t userHash;      // 0 when the request named no user
+        uint64_t startNs;       // arrival at the controller
+        uint64_t queueNs;       // until the handler started
+        uint64_t lockWaitNs;    // blocked on the users database lock
+        uint64_t handlerNs;     // until the reply was handed over
+        uint64_t replyNs;       // until the reply was sent
+        uint32_t handlerTid;
+        uint16_t status;
+        bool sent;              // false if sending the reply failed
+    };
+
+    // A request in flight. Its threads take turns on it, except for lock
+    // waits, which a thread may still add while another one replies.
+    class RequestSpan {
+    public:
+        Span span;
+        uint64_t handlerStartNs = 0;
+        uint64_t repliedNs = 0;
+        std::atomic<uint64_t> lockWaitNs;
+        std::atomic<bool> replied;
+
+        RequestSpan() : span(), lockWaitNs(0), replied(false) { }
+    };
+
+    using SpanHandle = std::shared_ptr<RequestSpan>;
+
+    struct TraceStats {
+        uint64_t recorded = 0;  // spans put into the rings
+        uint64_t slow = 0;      // written for being slow
+        uint64_t sampled = 0;   // written as samples
+        uint64_t lost = 0;      // overwritten before the flusher got to them
+        size_t threads = 0;     // threads with a ring
+    };
+
+    // Every request gets a span that lands in a fixed-size ring of the thread
+    // that sent its reply, so recording takes neither locks nor allocations
+    // past the span itself. A flusher thread writes the slow ones and every
+    // n-th of the rest to TRACE_FILE; the rings themselves always hold the
+    // latest spans of every thread and can be dumped as a whole on demand.
+    //
+    // The file is a JSON array of trace events without the closing bracket,
+    // which chrome://tracing and Perfetto accept as is.
+    class RequestTrace {
+    public:
+        // Starts the flusher, must run before the first request
+        static void configure(const TraceConfig & config);
+        static const TraceConfig & config();
+
+        // Span of a request that just arrived, null while tracing is off
+        static SpanHandle start(const std::string & route);
+        // Span the calling thread works on (see TraceScope), may be null
+        static SpanHandle current();
+        static void setUser(const std::string & id);
+
+        // The handler hands its reply over, ends the handler time
+        static void replying(const SpanHandle & span, uint16_t status);
+        // The reply is out, the span goes into the calling thread's ring
+        static void finish(const SpanHandle & span, bool sent);
+
+        // Writes what the flusher hasn't written yet
+        static void flush();
+        // Stops the flusher, writes the rest and closes the file
+        static void shutdown();
+        // Writes every span still in the rings, returns their number
+        static size_t dump();
+        static TraceStats stats();
+    };
+
+    // Binds [span] to the calling thread while it works on the request, so
+    // replies and lock waits are attributed to it. [startsHandler] marks
+    // where the queue delay (executor hop, body read) ends.
+    class TraceScope {
+    public:
+        explicit TraceScope(const SpanHandle & span, bool startsHandler = false);
+        ~TraceScope();
+        TraceScope(const TraceScope &) = delete;
+        TraceScope & operator=(const TraceScope &) = delete;
+
+    private:
+        SpanHandle _span;
+        SpanHandle _previous;
+        uint64_t _previousMark;
+        bool _outermost;
+    };
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cfx {
+
+    struct StartupStageTiming {
+        std::string name;
+        uint64_t startUs = 0;    // since the process started
+        uint64_t elapsedUs = 0;
+        std::string detail;      // e.g. what was loaded, empty if nothing to say
+    };
+
+    // Timings of the stages the service goes through until it serves, so a
+    // slow start can be told apart into its stages (GET /service/ready)
+    class StartupReport {
+    public:
+        static void record(StartupStageTiming stage);
+
+        // The listener is open, stages after that are not startup anymore
+        static void ready();
+
+        // Time to serving, 0 until ready()
+        static uint64_t readyUs();
+        static std::vector<StartupStageTiming> stages();
+
+        // Microseconds since the process started
+        static uint64_t sinceStartUs();
+    };
+
+    // Times one stage from construction to destruction and prints it
+    class StartupStage {
+    public:
+        explicit StartupStage(const std::string & name);
+        ~StartupStage();
+        StartupStage(const StartupStage &) = delete;
+        StartupStage & operator=(const StartupStage &) = delete;
+
+        void detail(const std::string & text) { _stage.detail = text; }
+
+    private:
+        StartupStageTiming _stage;
+    };
+}
@@ -24,28 +24,47 @@
 // SOFTWARE.
 //
 
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+
 #include "network_utils.hpp"
 
 namespace cfx {
 
-   HostInetInfo NetworkUtils::queryHostInetInfo() {
-       io_service ios;
-       tcp::resolver resolver(ios);
-       tcp::resolver::query query(host_name(), "");
-       return resolver.resolve(query);
-   }
-
    std::string NetworkUtils::hostIP(unsigned short family) {
-       auto hostInetInfo = queryHostInetInfo();
-       tcp::resolver::iterator end;
-       while(hostInetInfo != end) {
-           tcp::endpoint ep = *hostInetInfo++;
-           sockaddr sa = *ep.data();
-           if (sa.sa_family == family) {
-               return ep.address().to_string();
+       ifaddrs * list = nullptr;
+       if (getifaddrs(&list) != 0) {
+           return std::string();
+       }
+       std::string found;
+       std::string loopback;
+       for (ifaddrs * i = list; i != nullptr && found.empty(); i = i->ifa_next) {
+           if (!i->ifa_addr || i->ifa_addr->sa_family != family || !(i->ifa_flags & IFF_UP)) {
+               continue;
+           }
+           char text[INET6_ADDRSTRLEN] = {0};
+           const void * addr = family == AF_INET ?
+               static_cast<const void *>(&reinterpret_cast<sockaddr_in *>(i->ifa_addr)->sin_addr) :
+               static_cast<const void *>(&reinterpret_cast<sockaddr_in6 *>(i->ifa_addr)->sin6_addr);
+           if (!inet_ntop(family, addr, text, sizeof(text))) {
+               continue;
+           }
+           // link-local addresses are no good without their interface
+           if (family == AF_INET6 &&
+               IN6_IS_ADDR_LINKLOCAL(&reinterpret_cast<sockaddr_in6 *>(i->ifa_addr)->sin6_addr)) {
+               continue;
+           }
+           if (i->ifa_flags & IFF_LOOPBACK) {
+               if (loopback.empty())
+                   loopback = text;
+           }
+           else {
+               found = text;
            }
        }
-       return nullptr;
+       freeifaddrs(list);
+       return found.empty() ? loopback : found;
    }
    
 }
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "profiled_mutex.hpp"
+
+namespace cfx {
+
+    namespace {
+        thread_local const char * currentOp = nullptr;
+        thread_local uint64_t waitedNs = 0;
+
+        const char * const untagged = "untagged";
+        const char * const overflow = "other";
+
+        uint64_t nowNs() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        int bucketOf(uint64_t ns) {
+            int b = ns ? 63 - __builtin_clzll(ns) : 0;
+            return std::min(b, LockOpStats::buckets - 1);
+        }
+
+        void storeMax(std::atomic<uint64_t> & slot, uint64_t v) {
+            uint64_t cur = slot.load(std::memory_order_relaxed);
+            while (v > cur && !slot.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {
+            }
+        }
+    }
+
+    uint64_t LockOpStats::percentile(const std::vector<uint64_t> & histogram, double p) {
+        uint64_t total = 0;
+        for (auto c : histogram)
+            total += c;
+        if (total == 0)
+            return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(total * p / 100.0 + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < histogram.size(); i++) {
+            seen += histogram[i];
+            if (seen >= rank)
+                return uint64_t(1) << (i + 1);
+        }
+        return uint64_t(1) << histogram.size();
+    }
+
+    ProfiledMutex::ProfiledMutex() : _enabled(false), _since(0), _holder(-1) {
+        for (auto & s : _ops)
+            s.name.store(nullptr, std::memory_order_relaxed);
+        reset();
+    }
+
+    ProfiledMutex & ProfiledMutex::as(const char * op) {
+        currentOp = op;
+        return *this;
+    }
+
+    void ProfiledMutex::lock() {
+        if (!enabled()) {
+            if (!_m.try_lock()) {
+                uint64_t start = nowNs();
+                _m.lock();
+                waitedNs += nowNs() - start;
+            }
+            _acquiredAt = 0;
+            return;
+        }
+        int op = opIndex(currentOp);
+        if (_m.try_lock()) {
+            acquired(op, false, -1, 0, nowNs());
+            return;
+        }
+        int holder = _holder.load(std::memory_order_relaxed);
+        uint64_t start = nowNs();
+        _m.lock();
+        uint64_t now = nowNs();
+        waitedNs += now - start;
+        acquired(op, true, holder, now - start, now);
+    }
+
+    uint64_t ProfiledMutex::threadWaitNs() {
+        return waitedNs;
+    }
+
+    bool ProfiledMutex::try_lock() {
+        if (!_m.try_lock())
+            return false;
+        if (enabled())
+            acquired(opIndex(currentOp), false, -1, 0, nowNs());
+        else
+            _acquiredAt = 0;
+        return true;
+    }
+
+    void ProfiledMutex::unlock() {
+        if (!_acquiredAt) {
+            _m.unlock();
+            return;
+        }
+        uint64_t hold = nowNs() - _acquiredAt;
+        int op = _holderOp;
+        _acquiredAt = 0;
+        _holder.store(-1, std::memory_order_relaxed);
+        _m.unlock();
+        // accounted after the release so it doesn't stretch the hold
+        released(op, hold);
+    }
+
+    void ProfiledMutex::acquired(int op, bool contended, int holder, uint64_t wait, uint64_t now) {
+        _acquiredAt = now;
+        _holderOp = op;
+        _holder.store(op, std::memory_order_relaxed);
+
+        OpSlot & s = _ops[op];
+        s.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        s.wait[bucketOf(wait)].fetch_add(1, std::memory_order_relaxed);
+        if (!contended)
+            return;
+        s.contended.fetch_add(1, std::memory_order_relaxed);
+        s.waitNs.fetch_add(wait, std::memory_order_relaxed);
+        storeMax(s.maxWaitNs, wait);
+        if (holder >= 0) {
+            BlockingCell & c = _blocking[op][holder];
+            c.count.fetch_add(1, std::memory_order_relaxed);
+            c.waitNs.fetch_add(wait, std::memory_order_relaxed);
+        }
+    }
+
+    void ProfiledMutex::released(int op, uint64_t hold) {
+        OpSlot & s = _ops[op];
+        s.holdNs.fetch_add(hold, std::memory_order_relaxed);
+        s.hold[bucketOf(hold)].fetch_add(1, std::memory_order_relaxed);
+        storeMax(s.maxHoldNs, hold);
+    }
+
+    // Operations are few and their names are literals, so a slot is found
+    // by pointer in the common case and claimed with a CAS the first time
+    int ProfiledMutex::opIndex(const char * op) {
+        if (!op)
+            op = untagged;
+        for (int i = 0; i < maxOps - 1; i++) {
+            const char * name = _ops[i].name.load(std::memory_order_acquire);
+            if (name == op || (name && std::strcmp(name, op) == 0))
+                return i;
+            if (!name) {
+                if (_ops[i].name.compare_exchange_strong(name, op, std::memory_order_acq_rel))
+                    return i;
+                if (std::strcmp(name, op) == 0)
+                    return i;
+            }
+        }
+        _ops[maxOps - 1].name.store(overflow, std::memory_order_relaxed);
+        return maxOps - 1;
+    }
+
+    void ProfiledMutex::enable(bool on) {
+        if (on && !enabled())
+            _since.store(nowNs(), std::memory_order_relaxed);
+        _enabled.store(on, std::memory_order_relaxed);
+    }
+
+    // Counters are cleared one by one, acquisitions racing with it may
+    // be counted partially
+    void ProfiledMutex::reset() {
+        for (auto & s : _ops) {
+            s.acquisitions.store(0, std::memory_order_relaxed);
+            s.contended.store(0, std::memory_order_relaxed);
+            s.waitNs.store(0, std::memory_order_relaxed);
+            s.holdNs.store(0, std::memory_order_relaxed);
+            s.maxWaitNs.store(0, std::memory_order_relaxed);
+            s.maxHoldNs.store(0, std::memory_order_relaxed);
+            for (auto & b : s.wait)
+                b.store(0, std::memory_order_relaxed);
+            for (auto & b : s.hold)
+                b.store(0, std::memory_order_relaxed);
+        }
+        for (auto & row : _blocking) {
+            for (auto & c : row) {
+                c.count.store(0, std::memory_order_relaxed);
+                c.waitNs.store(0, std::memory_order_relaxed);
+            }
+        }
+        _since.store(nowNs(), std::memory_order_relaxed);
+    }
+
+    LockProfile ProfiledMutex::profile(size_t topBlocking) const {
+        LockProfile p;
+        p.enabled = enabled();
+        p.elapsedMs = (nowNs() - _since.load(std::memory_order_relaxed)) / 1000000;
+
+        const char * names[maxOps];
+        for (int i = 0; i < maxOps; i++) {
+            names[i] = _ops[i].name.load(std::memory_order_acquire);
+            const OpSlot & s = _ops[i];
+            if (!names[i] || !s.acquisitions.load(std::memory_order_relaxed))
+                continue;
+            LockOpStats st;
+            st.op = names[i];
+            st.acquisitions = s.acquisitions.load(std::memory_order_relaxed);
+            st.contended = s.contended.load(std::memory_order_relaxed);
+            st.waitNs = s.waitNs.load(std::memory_order_relaxed);
+            st.holdNs = s.holdNs.load(std::memory_order_relaxed);
+            st.maxWaitNs = s.maxWaitNs.load(std::memory_order_relaxed);
+            st.maxHoldNs = s.maxHoldNs.load(std::memory_order_relaxed);
+            for (const auto & b : s.wait)
+                st.waitHistogram.push_back(b.load(std::memory_order_relaxed));
+            for (const auto & b : s.hold)
+                st.holdHistogram.push_back(b.load(std::memory_order_relaxed));
+            p.ops.push_back(std::move(st));
+        }
+        std::sort(p.ops.begin(), p.ops.end(),
+                  [](const LockOpStats & a, const LockOpStats & b) { return a.waitNs > b.waitNs; });
+
+        for (int w = 0; w < maxOps; w++) {
+            for (int h = 0; h < maxOps; h++) {
+                const BlockingCell & c = _blocking[w][h];
+                uint64_t count = c.count.load(std::memory_order_relaxed);
+                if (!count || !names[w] || !names[h])
+                    continue;
+                LockBlocking b;
+                b.waiter = names[w];
+                b.holder = names[h];
+                b.count = count;
+                b.waitNs = c.waitNs.load(std::memory_order_relaxed);
+                p.blocking.push_back(std::move(b));
+            }
+        }
+        std::sort(p.blocking.begin(), p.blocking.end(),
+                  [](const LockBlocking & a, const LockBlocking & b) { return a.waitNs > b.waitNs; });
+        if (p.blocking.size() > topBlocking)
+            p.blocking.resize(topBlocking);
+        return p;
+    }
+}
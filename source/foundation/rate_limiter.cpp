@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include "rate_limiter.hpp"
+
+namespace cfx {
+
+    namespace {
+        const int tokenBits = 24;
+        const uint64_t tokenMask = (uint64_t(1) << tokenBits) - 1;
+        const uint64_t oneToken = 1000;
+        const int probes = 4;
+
+        uint64_t hashKey(const char * data, size_t size) {
+            uint64_t h = 14695981039346656037ULL;
+            for (size_t i = 0; i < size; i++) {
+                h ^= static_cast<unsigned char>(data[i]);
+                h *= 1099511628211ULL;
+            }
+            return h ? h : 1;   // 0 marks a free slot
+        }
+
+        double envDouble(const std::string & name, double fallback) {
+            const char * v = std::getenv(name.c_str());
+            if (!v)
+                return fallback;
+            try {
+                return std::stod(v);
+            }
+            catch (std::exception & e) {
+                std::cout << "Bad " << name << " value: " << e.what() << '\n';
+                return fallback;
+            }
+        }
+    }
+
+    RateLimitConfig RateLimitConfig::fromEnvironment(const std::string & prefix,
+                                                     double rate, double burst) {
+        RateLimitConfig c;
+        c.rate = envDouble(prefix + "_RATE", rate);
+        c.burst = envDouble(prefix + "_BURST", burst);
+        c.slots = static_cast<size_t>(envDouble(prefix + "_SLOTS", c.slots));
+        return c;
+    }
+
+    RateLimiter::RateLimiter(const RateLimitConfig & config) :
+        _rate(std::max(0.0, config.rate)),
+        _start(std::chrono::steady_clock::now()) {
+        // the bucket has to fit the token bits of the state word
+        _burst = std::min<uint64_t>(std::max(1.0, config.burst) * oneToken, tokenMask);
+        size_t n = 1;
+        while (n < std::max<size_t>(config.slots, probes))
+            n <<= 1;
+        _mask = n - 1;
+        if (!enabled())
+            return;
+        // new doesn't honour the slot alignment before C++17
+        void * p = nullptr;
+        if (posix_memalign(&p, alignof(Slot), n * sizeof(Slot)) != 0)
+            throw std::bad_alloc();
+        _slots = static_cast<Slot *>(p);
+        for (size_t i = 0; i < n; i++) {
+            new (&_slots[i]) Slot();
+            _slots[i].key.store(0, std::memory_order_relaxed);
+            _slots[i].state.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    RateLimiter::~RateLimiter() {
+        std::free(_slots);
+    }
+
+    uint64_t RateLimiter::nowMs() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - _start).count();
+    }
+
+    bool RateLimiter::allow(const char * key, size_t size) {
+        if (!enabled())
+            return true;
+        uint64_t h = hashKey(key, size);
+        uint64_t now = nowMs();
+
+        Slot * oldest = nullptr;
+        uint64_t oldestTime = UINT64_MAX;
+        for (int i = 0; i < probes; i++) {
+            Slot & s = _slots[(h + i) & _mask];
+            uint64_t k = s.key.load(std::memory_order_acquire);
+            if (k == 0) {
+                uint64_t expected = 0;
+                if (s.key.compare_exchange_strong(expected, h, std::memory_order_acq_rel)) {
+                    s.state.store((now << tokenBits) | _burst, std::memory_order_relaxed);
+                    return take(s, now);
+                }
+                k = expected;
+            }
+            if (k == h)
+                return take(s, now);
+            uint64_t t = s.state.load(std::memory_order_relaxed) >> tokenBits;
+            if (t < oldestTime) {
+                oldestTime = t;
+                oldest = &s;
+            }
+        }
+
+        // every probed slot belongs to another key, reuse the idlest one
+        uint64_t k = oldest->key.load(std::memory_order_relaxed);
+        if (oldest->key.compare_exchange_strong(k, h, std::memory_order_acq_rel))
+            oldest->state.store((now << tokenBits) | _burst, std::memory_order_relaxed);
+        return take(*oldest, now);
+    }
+
+    bool RateLimiter::take(Slot & slot, uint64_t now) {
+        uint64_t st = slot.state.load(std::memory_order_relaxed);
+        for (;;) {
+            uint64_t last = st >> tokenBits;
+            uint64_t tokens = st & tokenMask;
+            if (now > last)
+                tokens = std::min<uint64_t>(_burst, tokens + static_cast<uint64_t>((now - last) * _rate));
+            if (tokens < oneToken)
+                return false;
+            uint64_t next = (std::max(now, last) << tokenBits) | (tokens - oneToken);
+            if (slot.state.compare_exchange_weak(st, next, std::memory_order_relaxed))
+                return true;
+        }
+    }
+}
@@ -0,0 +1,411 @@
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cpu_placement.hpp"
+#include "profiled_mutex.hpp"
+#include "request_trace.hpp"
+
+namespace cfx {
+
+    namespace {
+        struct Slot {
+            std::atomic<uint64_t> seq;   // 2 * position + 1 while written, + 2 after
+            Span span;
+        };
+
+        // Written by its thread only, read by the flusher
+        struct Ring {
+            Ring(size_t size, uint32_t tid) : slots(new Slot[size]), size(size), tid(tid), head(0) {
+                for (size_t i = 0; i < size; i++)
+                    slots[i].seq.store(0, std::memory_order_relaxed);
+            }
+
+            std::unique_ptr<Slot[]> slots;
+            const size_t size;
+            const uint32_t tid;
+            std::atomic<uint64_t> head;  // spans written so far
+            uint64_t flushed = 0;        // the flusher's, under writerMutex
+        };
+
+        TraceConfig traceConfig;
+
+        // rings outlive their threads, the spans they hold are still dumped
+        std::mutex ringsMutex;
+        std::vector<Ring *> rings;
+
+        thread_local Ring * threadRing = nullptr;
+        thread_local SpanHandle currentSpan;
+        thread_local uint64_t lockMark = 0;
+
+        std::mutex writerMutex;
+        std::ofstream out;
+        uint64_t written = 0;            // bytes in the current file
+        uint64_t eventId = 0;
+        uint64_t seen = 0;               // spans looked at for sampling
+
+        std::atomic<uint64_t> slowCount(0);
+        std::atomic<uint64_t> sampledCount(0);
+        std::atomic<uint64_t> lostCount(0);
+
+        std::mutex flusherMutex;
+        std::condition_variable flusherWake;
+        bool flusherStop = false;
+        std::thread flusher;
+
+        uint64_t nowNs() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        uint32_t threadId() {
+            thread_local uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+            return tid;
+        }
+
+        uint64_t hashId(const std::string & id) {
+            uint64_t h = 14695981039346656037ULL;
+            for (unsigned char c : id) {
+                h ^= c;
+                h *= 1099511628211ULL;
+            }
+            return h;
+        }
+
+        std::string envString(const char * name, const std::string & fallback) {
+            const char * v = std::getenv(name);
+            return v ? v : fallback;
+        }
+
+        uint64_t envNumber(const char * name, uint64_t fallback) {
+            const char * v = std::getenv(name);
+            if (!v || !*v)
+                return fallback;
+            try {
+                return std::stoull(v);
+            }
+            catch (std::exception & e) {
+                std::cout << "Bad " << name << " value: " << e.what() << '\n';
+                return fallback;
+            }
+        }
+
+        Ring * ringOfThread() {
+            if (!threadRing) {
+                threadRing = new Ring(traceConfig.ringSpans, threadId());
+                std::unique_lock<std::mutex> lock { ringsMutex };
+                rings.push_back(threadRing);
+            }
+            return threadRing;
+        }
+
+        std::vector<Ring *> allRings() {
+            std::unique_lock<std::mutex> lock { ringsMutex };
+            return rings;
+        }
+
+        // Copy of the span at [pos], false if it was overwritten meanwhile
+        bool readSlot(const Ring & r, uint64_t pos, Span & span) {
+            const Slot & slot = r.slots[pos % r.size];
+            uint64_t s1 = slot.seq.load(std::memory_order_acquire);
+            if (s1 != 2 * pos + 2)
+                return false;
+            span = slot.span;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return slot.seq.load(std::memory_order_relaxed) == s1;
+        }
+
+        void openFile() {
+            out.open(traceConfig.file, std::ios::out | std::ios::trunc);
+            if (!out) {
+                std::cout << "Cannot open trace file " << traceConfig.file << '\n';
+                return;
+            }
+            char line[128];
+            int n = std::snprintf(line, sizeof(line),
+                "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"microservice\"}},\n",
+                int(getpid()));
+            out.write(line, n);
+            written = n;
+        }
+
+        void appendEscaped(std::string & s, const char * text, size_t len) {
+            for (size_t i = 0; i < len && text[i]; i++) {
+                unsigned char c = text[i];
+                if (c == '"' || c == '\\') {
+                    s += '\\';
+                    s += char(c);
+                }
+                else if (c < 0x20) {
+                    char esc[8];
+                    std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    s += esc;
+                }
+                else {
+                    s += char(c);
+                }
+            }
+        }
+
+        // One begin/end pair of async events, nested under the request's own
+        void appendEvent(std::string & s, const char * name, size_t nameLen, char phase,
+                         uint64_t id, uint32_t tid, uint64_t tsNs, const char * args) {
+            s += "{\"name\":\"";
+            appendEscaped(s, name, nameLen);
+            char fields[128];
+            std::snprintf(fields, sizeof(fields),
+                "\",\"cat\":\"request\",\"ph\":\"%c\",\"id\":%llu,\"pid\":%d,\"tid\":%u,\"ts\":%.3f",
+                phase, static_cast<unsigned long long>(id), int(getpid()), tid, tsNs / 1000.0);
+            s += fields;
+            s += args;
+            s += "},\n";
+        }
+
+        void appendSpan(std::string & s, const Span & span, const char * reason) {
+            uint64_t id = ++eventId;
+            uint64_t t = span.startNs;
+            uint32_t tid = span.handlerTid;
+            char args[256];
+            std::snprintf(args, sizeof(args),
+                ",\"args\":{\"reason\":\"%s\",\"status\":%u,\"sent\":%s,\"user_hash\":\"%016llx\","
+                "\"queue_us\":%.3f,\"lock_wait_us\":%.3f,\"handler_us\":%.3f,\"reply_us\":%.3f}",
+                reason, unsigned(span.status), span.sent ? "true" : "false",
+                static_cast<unsigned long long>(span.userHash),
+                span.queueNs / 1000.0, span.lockWaitNs / 1000.0, span.handlerNs / 1000.0, span.replyNs / 1000.0);
+
+            size_t routeLen = strnlen(span.route, Span::routeLen);
+            appendEvent(s, span.route, routeLen, 'b', id, tid, t, args);
+            appendEvent(s, "queue", 5, 'b', id, tid, t, "");
+            t += span.queueNs;
+            appendEvent(s, "queue", 5, 'e', id, tid, t, "");
+            appendEvent(s, "handler", 7, 'b', id, tid, t, "");
+            t += span.handlerNs;
+            appendEvent(s, "handler", 7, 'e', id, tid, t, "");
+            appendEvent(s, "reply", 5, 'b', id, tid, t, "");
+            t += span.replyNs;
+            appendEvent(s, "reply", 5, 'e', id, tid, t, "");
+            appendEvent(s, span.route, routeLen, 'e', id, tid, t, "");
+        }
+
+        // Under writerMutex
+        void write(const std::string & events) {
+            if (!out || events.empty())
+                return;
+            out.write(events.data(), events.size());
+            out.flush();
+            written += events.size();
+            if (written < traceConfig.fileMaxBytes)
+                return;
+            out.close();
+            std::rename(traceConfig.file.c_str(), (traceConfig.file + ".1").c_str());
+            openFile();
+        }
+
+        void flusherLoop() {
+            CpuPlacement::placeBackgroundThread("trace flusher");
+            std::unique_lock<std::mutex> lock { flusherMutex };
+            while (!flusherWake.wait_for(lock, std::chrono::milliseconds(traceConfig.flushMs),
+                                         [] { return flusherStop; })) {
+                lock.unlock();
+                RequestTrace::flush();
+                lock.lock();
+            }
+        }
+
+        // A process leaving without RequestTrace::shutdown() still stops the
+        // flusher before the file it writes goes away
+        struct FlusherGuard {
+            ~FlusherGuard() {
+                RequestTrace::shutdown();
+            }
+        } flusherGuard;
+    }
+
+    TraceConfig TraceConfig::fromEnvironment() {
+        TraceConfig c;
+        c.ringSpans = envNumber("TRACE_RING_SPANS", c.ringSpans);
+        c.file = envString("TRACE_FILE", c.file);
+        c.slowNs = envNumber("TRACE_SLOW_MS", c.slowNs / 1000000) * 1000000;
+        c.sampleEvery = envNumber("TRACE_SAMPLE_EVERY", c.sampleEvery);
+        c.flushMs = std::max<uint64_t>(1, envNumber("TRACE_FLUSH_MS", c.flushMs));
+        c.fileMaxBytes = envNumber("TRACE_FILE_MAX_MB", c.fileMaxBytes >> 20) << 20;
+        return c;
+    }
+
+    void RequestTrace::configure(const TraceConfig & config) {
+        traceConfig = config;
+        if (!traceConfig.ringSpans || traceConfig.file.empty())
+            return;
+        openFile();
+        if (out)
+            flusher = std::thread(flusherLoop);
+    }
+
+    void RequestTrace::shutdown() {
+        if (flusher.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock { flusherMutex };
+                flusherStop = true;
+            }
+            flusherWake.notify_one();
+            flusher.join();
+        }
+        flush();
+        std::unique_lock<std::mutex> lock { writerMutex };
+        if (out.is_open())
+            out.close();
+    }
+
+    const TraceConfig & RequestTrace::config() {
+        return traceConfig;
+    }
+
+    SpanHandle RequestTrace::start(const std::string & route) {
+        if (!traceConfig.ringSpans)
+            return nullptr;
+        auto span = std::make_shared<RequestSpan>();
+        size_t len = std::min(route.size(), Span::routeLen - 1);
+        std::memcpy(span->span.route, route.data(), len);
+        span->span.route[len] = 0;
+        span->span.startNs = nowNs();
+        return span;
+    }
+
+    SpanHandle RequestTrace::current() {
+        return currentSpan;
+    }
+
+    void RequestTrace::setUser(const std::string & id) {
+        if (currentSpan && !id.empty())
+            currentSpan->span.userHash = hashId(id);
+    }
+
+    void RequestTrace::replying(const SpanHandle & span, uint16_t status) {
+        if (!span || span->replied.load(std::memory_order_relaxed))
+            return;
+        uint64_t now = nowNs();
+        if (span == currentSpan) {
+            uint64_t waited = ProfiledMutex::threadWaitNs();
+            span->lockWaitNs.fetch_add(waited - lockMark, std::memory_order_relaxed);
+            lockMark = waited;
+        }
+        if (!span->handlerStartNs)
+            span->handlerStartNs = span->span.startNs;
+        span->repliedNs = now;
+        span->span.status = status;
+        span->span.handlerTid = threadId();
+        span->replied.store(true, std::memory_order_release);
+    }
+
+    void RequestTrace::finish(const SpanHandle & span, bool sent) {
+        if (!span || !span->replied.load(std::memory_order_acquire))
+            return;
+        uint64_t now = nowNs();
+        Ring * r = ringOfThread();
+        uint64_t pos = r->head.load(std::memory_order_relaxed);
+        Slot & slot = r->slots[pos % r->size];
+
+        slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.span = span->span;
+        slot.span.queueNs = span->handlerStartNs - span->span.startNs;
+        slot.span.handlerNs = span->repliedNs - span->handlerStartNs;
+        slot.span.replyNs = now - span->repliedNs;
+        slot.span.lockWaitNs = span->lockWaitNs.load(std::memory_order_relaxed);
+        slot.span.sent = sent;
+        slot.seq.store(2 * pos + 2, std::memory_order_release);
+        r->head.store(pos + 1, std::memory_order_release);
+    }
+
+    void RequestTrace::flush() {
+        std::unique_lock<std::mutex> lock { writerMutex };
+        std::string events;
+        for (Ring * r : allRings()) {
+            uint64_t head = r->head.load(std::memory_order_acquire);
+            uint64_t from = std::max(r->flushed, head > r->size ? head - r->size : 0);
+            lostCount.fetch_add(from - r->flushed, std::memory_order_relaxed);
+            for (uint64_t pos = from; pos < head; pos++) {
+                Span span;
+                if (!readSlot(*r, pos, span)) {
+                    lostCount.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                uint64_t total = span.queueNs + span.handlerNs + span.replyNs;
+                if (total >= traceConfig.slowNs) {
+                    appendSpan(events, span, "slow");
+                    slowCount.fetch_add(1, std::memory_order_relaxed);
+                }
+                else if (traceConfig.sampleEvery && ++seen % traceConfig.sampleEvery == 0) {
+                    appendSpan(events, span, "sample");
+                    sampledCount.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            r->flushed = head;
+        }
+        write(events);
+    }
+
+    size_t RequestTrace::dump() {
+        std::unique_lock<std::mutex> lock { writerMutex };
+        if (!out)
+            return 0;
+        std::string events;
+        size_t n = 0;
+        for (Ring * r : allRings()) {
+            uint64_t head = r->head.load(std::memory_order_acquire);
+            for (uint64_t pos = head > r->size ? head - r->size : 0; pos < head; pos++) {
+                Span span;
+                if (readSlot(*r, pos, span)) {
+                    appendSpan(events, span, "dump");
+                    n++;
+                }
+            }
+        }
+        write(events);
+        return n;
+    }
+
+    TraceStats RequestTrace::stats() {
+        TraceStats s;
+        auto all = allRings();
+        for (Ring * r : all)
+            s.recorded += r->head.load(std::memory_order_relaxed);
+        s.threads = all.size();
+        s.slow = slowCount.load(std::memory_order_relaxed);
+        s.sampled = sampledCount.load(std::memory_order_relaxed);
+        s.lost = lostCount.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    TraceScope::TraceScope(const SpanHandle & span, bool startsHandler) :
+        _span(span), _previous(currentSpan), _previousMark(lockMark),
+        _outermost(span && span != currentSpan) {
+        currentSpan = span;
+        if (startsHandler && span && !span->handlerStartNs)
+            span->handlerStartNs = nowNs();
+        if (_outermost)
+            lockMark = ProfiledMutex::threadWaitNs();
+    }
+
+    TraceScope::~TraceScope() {
+        if (_outermost) {
+            uint64_t waited = ProfiledMutex::threadWaitNs() - lockMark;
+            // waits after the reply don't belong to the request anymore
+            if (waited && !_span->replied.load(std::memory_order_acquire))
+                _span->lockWaitNs.fetch_add(waited, std::memory_order_relaxed);
+        }
+        currentSpan = _previous;
+        lockMark = _previousMark;
+    }
+}
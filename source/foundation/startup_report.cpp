@@ -0,0 +1,60 @@
+#include <iostream>
+#include <mutex>
+
+#include "startup_report.hpp"
+
+namespace cfx {
+
+    namespace {
+        // as good as the start of the process: taken while statics are
+        // initialized, before main()
+        const std::chrono::steady_clock::time_point processStart = std::chrono::steady_clock::now();
+
+        std::mutex reportMutex;
+        std::vector<StartupStageTiming> recorded;
+        uint64_t readyAt = 0;
+    }
+
+    void StartupReport::record(StartupStageTiming stage) {
+        std::unique_lock<std::mutex> lock { reportMutex };
+        recorded.push_back(std::move(stage));
+    }
+
+    void StartupReport::ready() {
+        uint64_t now = sinceStartUs();
+        {
+            std::unique_lock<std::mutex> lock { reportMutex };
+            readyAt = now;
+        }
+        std::cout << "=== Serving " << now / 1000.0 << " ms after start" << std::endl;
+    }
+
+    uint64_t StartupReport::readyUs() {
+        std::unique_lock<std::mutex> lock { reportMutex };
+        return readyAt;
+    }
+
+    std::vector<StartupStageTiming> StartupReport::stages() {
+        std::unique_lock<std::mutex> lock { reportMutex };
+        return recorded;
+    }
+
+    uint64_t StartupReport::sinceStartUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - processStart).count();
+    }
+
+    StartupStage::StartupStage(const std::string & name) {
+        _stage.name = name;
+        _stage.startUs = StartupReport::sinceStartUs();
+    }
+
+    StartupStage::~StartupStage() {
+        _stage.elapsedUs = StartupReport::sinceStartUs() - _stage.startUs;
+        std::cout << "=== Startup: " << _stage.name << " took " << _stage.elapsedUs / 1000.0 << " ms";
+        if (!_stage.detail.empty())
+            std::cout << " (" << _stage.detail << ")";
+        std::cout << std::endl;
+        StartupReport::record(std::move(_stage));
+    }
+}
@@ -0,0 +1,472 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cpu_placement.hpp>
+#include "leaderboard_archive.hpp"
+
+namespace {
+    const char fileMagic[4] = {'L', 'B', 'C', '1'};
+    const double revenueScale = 1000.0;
+
+    struct WeekHeader {
+      char magic[4];
+      uint32_t week;
+      uint32_t rows;
+      uint32_t reserved;
+      uint64_t usersOffset;
+      uint64_t usersSize;
+      uint64_t revenueOffset;
+      uint64_t revenueSize;
+    };
+
+    void putVarint(std::string& out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back(static_cast<char>(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<char>(v));
+    }
+
+    // Decodes a varint at [pos], advancing it; throws on truncated input
+    uint64_t getVarint(const uint8_t* data, size_t size, size_t& pos) {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos >= size) {
+                throw LeaderboardArchiveException("truncated archive column!");
+            }
+            uint8_t b = data[pos++];
+            v |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+        throw LeaderboardArchiveException("corrupted archive column!");
+    }
+
+    uint64_t quantize(Rating r) {
+        return r > 0 ? static_cast<uint64_t>(std::llround(r * revenueScale)) : 0;
+    }
+
+    const WeekHeader& checkHeader(const MappedFile& f) {
+        if (f.size() < sizeof(WeekHeader)) {
+            throw LeaderboardArchiveException("bad archive file!");
+        }
+        const WeekHeader& h = *reinterpret_cast<const WeekHeader*>(f.data());
+        if (std::memcmp(h.magic, fileMagic, sizeof(fileMagic)) != 0 ||
+            h.usersOffset + h.usersSize > f.size() ||
+            h.revenueOffset + h.revenueSize > f.size()) {
+            throw LeaderboardArchiveException("bad archive file!");
+        }
+        return h;
+    }
+}
+
+MappedFile::MappedFile(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw LeaderboardArchiveException("no archive for this week!");
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    throw LeaderboardArchiveException("bad archive file!");
+  }
+  void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    throw LeaderboardArchiveException("cannot map archive file!");
+  }
+  _data = static_cast<const uint8_t*>(p);
+  _size = st.st_size;
+}
+
+MappedFile::~MappedFile() {
+  if (_data)
+    ::munmap(const_cast<uint8_t*>(_data), _size);
+}
+
+LeaderboardArchive::LeaderboardArchive(const std::string& dir) : _dir(dir) {
+  loadDictionary();
+  loadRetiredIndex();
+  _worker = std::thread([this] { run(); });
+}
+
+LeaderboardArchive::~LeaderboardArchive() {
+  {
+    std::unique_lock<std::mutex> lock { _queueMutex };
+    _stop = true;
+  }
+  _queueCond.notify_one();
+  _worker.join();
+}
+
+void LeaderboardArchive::submit(int week, StandingList standings) {
+  {
+    std::unique_lock<std::mutex> lock { _queueMutex };
+    _queue.emplace_back(week, std::move(standings));
+  }
+  _queueCond.notify_one();
+}
+
+void LeaderboardArchive::retire(RetiredList users) {
+  {
+    std::unique_lock<std::mutex> lock { _queueMutex };
+    _retiredQueue.push_back(std::move(users));
+  }
+  _queueCond.notify_one();
+}
+
+void LeaderboardArchive::run() {
+  cfx::CpuPlacement::placeBackgroundThread("archive");
+  for (;;) {
+    std::pair<int, StandingList> job;
+    RetiredList retired;
+    {
+      std::unique_lock<std::mutex> lock { _queueMutex };
+      _queueCond.wait(lock, [this] { return _stop || !_queue.empty() || !_retiredQueue.empty(); });
+      if (!_retiredQueue.empty()) {
+        retired = std::move(_retiredQueue.front());
+        _retiredQueue.pop_front();
+      }
+      else if (!_queue.empty()) {
+        job = std::move(_queue.front());
+        _queue.pop_front();
+      }
+      else {
+        return;
+      }
+    }
+    if (!retired.empty()) {
+      try {
+        appendRetired(retired);
+      }
+      catch (std::exception& e) {
+        std::cout << "Failed to archive " << retired.size() << " retired users: " << e.what() << std::endl;
+      }
+      continue;
+    }
+    try {
+      freeze(job.first, job.second);
+      std::cout << "=== Archived week " << job.first << ": "
+                << job.second.size() << " users" << std::endl;
+    }
+    catch (std::exception& e) {
+      std::cout << "Failed to archive week " << job.first << ": " << e.what() << std::endl;
+    }
+  }
+}
+
+void LeaderboardArchive::makeDir() {
+  if (_dirMade)
+    return;
+  if (::mkdir(_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw LeaderboardArchiveException("cannot create archive directory " + _dir + "!");
+  }
+  _dirMade = true;
+}
+
+std::string LeaderboardArchive::weekPath(int week) const {
+  return _dir + "/week-" + std::to_string(week) + ".lbc";
+}
+
+void LeaderboardArchive::appendRetired(const RetiredList& users) {
+  makeDir();
+  std::string buf;
+  std::vector<std::pair<const std::string*, size_t>> offsets;
+  for (const auto& u : users) {
+    offsets.emplace_back(&u.id, buf.size());
+    putVarint(buf, u.id.size());
+    buf += u.id;
+    putVarint(buf, u.name.size());
+    buf += u.name;
+    buf.append(reinterpret_cast<const char*>(&u.revenue), sizeof(u.revenue));
+    buf.append(reinterpret_cast<const char*>(&u.lastDeal), sizeof(u.lastDeal));
+    buf.append(reinterpret_cast<const char*>(&u.retiredAt), sizeof(u.retiredAt));
+  }
+  std::ofstream out(_dir + "/retired.log", std::ios::binary | std::ios::app);
+  out.seekp(0, std::ios::end);
+  std::streamoff start = out.tellp();
+  out.write(buf.data(), buf.size());
+  if (start < 0 || !out.flush()) {
+    throw LeaderboardArchiveException("cannot append to retired users log!");
+  }
+  std::unique_lock<std::mutex> lock { _retiredMutex };
+  for (const auto& o : offsets)
+    _retiredIndex[*o.first] = uint64_t(start) + o.second;
+}
+
+bool LeaderboardArchive::readRetired(const uint8_t* data, size_t size, size_t& pos, RetiredUser& res) {
+  const size_t fixed = sizeof(res.revenue) + sizeof(res.lastDeal) + sizeof(res.retiredAt);
+  size_t at = pos;
+  try {
+    size_t idLen = getVarint(data, size, at);
+    if (at + idLen > size)
+      return false;
+    res.id.assign(reinterpret_cast<const char*>(data + at), idLen);
+    at += idLen;
+    size_t nameLen = getVarint(data, size, at);
+    if (at + nameLen + fixed > size)
+      return false;
+    res.name.assign(reinterpret_cast<const char*>(data + at), nameLen);
+    const uint8_t* p = data + at + nameLen;
+    std::memcpy(&res.revenue, p, sizeof(res.revenue));
+    std::memcpy(&res.lastDeal, p + sizeof(res.revenue), sizeof(res.lastDeal));
+    std::memcpy(&res.retiredAt, p + sizeof(res.revenue) + sizeof(res.lastDeal), sizeof(res.retiredAt));
+    pos = at + nameLen + fixed;
+  }
+  catch (LeaderboardArchiveException&) {
+    return false;
+  }
+  return true;
+}
+
+void LeaderboardArchive::loadRetiredIndex() {
+  std::string path = _dir + "/retired.log";
+  std::unique_ptr<MappedFile> f;
+  try {
+    f.reset(new MappedFile(path));
+  }
+  catch (LeaderboardArchiveException&) {
+    return;
+  }
+  size_t pos = 0;
+  RetiredUser u;
+  // later records of the same id are newer and take its place
+  for (size_t start = pos; pos < f->size() && readRetired(f->data(), f->size(), pos, u); start = pos)
+    _retiredIndex[u.id] = start;
+  // drop the torn tail of an interrupted append so new records line up again
+  if (pos < f->size() && ::truncate(path.c_str(), pos) != 0) {
+    throw LeaderboardArchiveException("cannot repair retired users log!");
+  }
+}
+
+bool LeaderboardArchive::findRetired(const std::string& id, RetiredUser& res) {
+  size_t pos;
+  {
+    std::unique_lock<std::mutex> lock { _retiredMutex };
+    auto it = _retiredIndex.find(id);
+    if (it == _retiredIndex.end())
+      return false;
+    pos = it->second;
+  }
+  std::unique_ptr<MappedFile> f;
+  try {
+    f.reset(new MappedFile(_dir + "/retired.log"));
+  }
+  catch (LeaderboardArchiveException&) {
+    return false;
+  }
+  return readRetired(f->data(), f->size(), pos, res);
+}
+
+void LeaderboardArchive::loadDictionary() {
+  std::string path = _dir + "/ids.dict";
+  std::ifstream in(path, std::ios::binary);
+  std::string buf((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(buf.data());
+  size_t pos = 0, good = 0;
+  try {
+    while (pos < buf.size()) {
+      size_t len = getVarint(data, buf.size(), pos);
+      if (pos + len > buf.size())
+        break;
+      std::string id(buf, pos, len);
+      pos += len;
+      good = pos;
+      _idIndex.emplace(id, _ids.size());
+      _ids.push_back(std::move(id));
+    }
+  }
+  catch (LeaderboardArchiveException&) {
+  }
+  // drop the torn tail of an interrupted append so new ids line up again
+  if (good < buf.size() && ::truncate(path.c_str(), good) != 0) {
+    throw LeaderboardArchiveException("cannot repair id dictionary!");
+  }
+}
+
+uint32_t LeaderboardArchive::internId(const std::string& id) {
+  auto it = _idIndex.find(id);
+  if (it != _idIndex.end())
+    return it->second;
+  uint32_t idx = _ids.size();
+  _idIndex.emplace(id, idx);
+  _ids.push_back(id);
+  return idx;
+}
+
+void LeaderboardArchive::freeze(int week, StandingList& standings) {
+  std::sort(standings.begin(), standings.end(),
+            [](const ArchivedStanding& a, const ArchivedStanding& b) {
+              return a.revenue > b.revenue || (a.revenue == b.revenue && a.id < b.id);
+            });
+  makeDir();
+
+  std::string users, revenue, newIds;
+  {
+    std::unique_lock<std::mutex> lock { _dictMutex };
+    size_t known = _ids.size();
+    for (const auto& s : standings)
+      putVarint(users, internId(s.id));
+    for (size_t i = known; i < _ids.size(); i++) {
+      putVarint(newIds, _ids[i].size());
+      newIds += _ids[i];
+    }
+    if (!newIds.empty()) {
+      std::string path = _dir + "/ids.dict";
+      std::ofstream dict(path, std::ios::binary | std::ios::app);
+      dict.seekp(0, std::ios::end);
+      std::streamoff size = dict.tellp();
+      dict.write(newIds.data(), newIds.size());
+      dict.close();
+      if (!dict) {
+        // forget the new ids, so the next freeze writes them again, and cut
+        // what made it to the file
+        for (size_t i = known; i < _ids.size(); i++)
+          _idIndex.erase(_ids[i]);
+        _ids.resize(known);
+        if (size >= 0 && ::truncate(path.c_str(), size) != 0)
+          std::cout << "cannot cut a partial write of " << path << '\n';
+        throw LeaderboardArchiveException("cannot write id dictionary!");
+      }
+    }
+  }
+
+  // quantization is monotonic, so every delta is non-negative
+  uint64_t prev = 0;
+  for (size_t i = 0; i < standings.size(); i++) {
+    uint64_t q = quantize(standings[i].revenue);
+    putVarint(revenue, i == 0 ? q : prev - q);
+    prev = q;
+  }
+
+  WeekHeader h;
+  std::memcpy(h.magic, fileMagic, sizeof(fileMagic));
+  h.week = week;
+  h.rows = standings.size();
+  h.reserved = 0;
+  h.usersOffset = sizeof(WeekHeader);
+  h.usersSize = users.size();
+  h.revenueOffset = h.usersOffset + h.usersSize;
+  h.revenueSize = revenue.size();
+
+  std::string path = weekPath(week);
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.write(users.data(), users.size());
+    out.write(revenue.data(), revenue.size());
+    if (!out) {
+      throw LeaderboardArchiveException("cannot write archive file!");
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    throw LeaderboardArchiveException("cannot publish archive file!");
+  }
+
+  std::unique_lock<std::mutex> lock { _filesMutex };
+  _files.erase(week);
+}
+
+std::shared_ptr<MappedFile> LeaderboardArchive::mapWeek(int week) {
+  std::unique_lock<std::mutex> lock { _filesMutex };
+  auto it = _files.find(week);
+  if (it != _files.end())
+    return it->second;
+  std::shared_ptr<MappedFile> f = std::make_shared<MappedFile>(weekPath(week));
+  checkHeader(*f);
+  _files[week] = f;
+  return f;
+}
+
+std::vector<int> LeaderboardArchive::weeks() {
+  std::vector<int> res;
+  DIR* d = ::opendir(_dir.c_str());
+  if (!d)
+    return res;
+  while (struct dirent* e = ::readdir(d)) {
+    std::string name = e->d_name;
+    if (name.size() > 9 && name.compare(0, 5, "week-") == 0 &&
+        name.compare(name.size() - 4, 4, ".lbc") == 0) {
+      try {
+        res.push_back(std::stoi(name.substr(5, name.size() - 9)));
+      }
+      catch (std::exception&) {
+      }
+    }
+  }
+  ::closedir(d);
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+std::vector<ArchivedEntry> LeaderboardArchive::top(int week, size_t n) {
+  std::shared_ptr<MappedFile> f = mapWeek(week);
+  const WeekHeader& h = checkHeader(*f);
+  const uint8_t* users = f->data() + h.usersOffset;
+  const uint8_t* revenue = f->data() + h.revenueOffset;
+  size_t upos = 0, rpos = 0;
+  uint64_t q = 0;
+
+  std::vector<ArchivedEntry> res;
+  n = std::min<size_t>(n, h.rows);
+  res.reserve(n);
+  std::unique_lock<std::mutex> lock { _dictMutex };
+  for (size_t i = 0; i < n; i++) {
+    uint64_t idx = getVarint(users, h.usersSize, upos);
+    uint64_t d = getVarint(revenue, h.revenueSize, rpos);
+    q = i == 0 ? d : q - d;
+    ArchivedEntry e;
+    e.week = week;
+    e.rank = i + 1;
+    e.id = idx < _ids.size() ? _ids[idx] : std::string();
+    e.revenue = q / revenueScale;
+    res.push_back(std::move(e));
+  }
+  return res;
+}
+
+std::vector<ArchivedEntry> LeaderboardArchive::userRanks(const std::string& id) {
+  uint64_t idx;
+  {
+    std::unique_lock<std::mutex> lock { _dictMutex };
+    auto it = _idIndex.find(id);
+    if (it == _idIndex.end())
+      return std::vector<ArchivedEntry>();
+    idx = it->second;
+  }
+
+  std::vector<ArchivedEntry> res;
+  for (int week : weeks()) {
+    std::shared_ptr<MappedFile> f = mapWeek(week);
+    const WeekHeader& h = checkHeader(*f);
+    const uint8_t* users = f->data() + h.usersOffset;
+    const uint8_t* revenue = f->data() + h.revenueOffset;
+    size_t upos = 0, rpos = 0;
+    uint64_t q = 0;
+    for (size_t i = 0; i < h.rows; i++) {
+      uint64_t d = getVarint(revenue, h.revenueSize, rpos);
+      q = i == 0 ? d : q - d;
+      if (getVarint(users, h.usersSize, upos) == idx) {
+        ArchivedEntry e;
+        e.week = week;
+        e.rank = i + 1;
+        e.id = id;
+        e.revenue = q / revenueScale;
+        res.push_back(std::move(e));
+        break;
+      }
+    }
+  }
+  return res;
+}
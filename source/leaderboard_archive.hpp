@@ -0,0 +1,149 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using Rating = float;
+
+// Final standing of a single user in a closed week
+struct ArchivedStanding {
+  std::string id;
+  Rating revenue = 0;
+};
+
+using StandingList = std::vector<ArchivedStanding>;
+
+// One row of a frozen leaderboard as served back to clients
+struct ArchivedEntry {
+  int week = 0;
+  size_t rank = 0;
+  std::string id;
+  Rating revenue = 0;
+};
+
+// Last state of a user evicted from the live table
+struct RetiredUser {
+  std::string id;
+  std::string name;
+  Rating revenue = 0;
+  int64_t lastDeal = 0;    // ns since epoch
+  int64_t retiredAt = 0;   // ns since epoch
+};
+
+using RetiredList = std::vector<RetiredUser>;
+
+class LeaderboardArchiveException : public std::exception {
+  std::string _message;
+public:
+  LeaderboardArchiveException(const std::string & message) :
+    _message(message) { }
+  const char * what() const throw() {
+    return _message.c_str();
+  }
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data() const { return _data; }
+  size_t size() const { return _size; }
+
+private:
+  const uint8_t* _data = nullptr;
+  size_t _size = 0;
+};
+
+// Columnar store of closed weekly leaderboards.
+//
+// Every closed week is frozen into "<dir>/week-<key>.lbc":
+//
+//   header   magic "LBC1", week key, row count, column offsets/sizes
+//   users    varint index into the shared id dictionary, in rank order
+//   revenue  varint of the top revenue (in 1/1000 units) followed by
+//            varint deltas to the next row (revenue is non-increasing)
+//
+// The rank of a row is its position, so it is not stored at all.
+// User ids are kept once in "<dir>/ids.dict" (varint length + bytes per id,
+// the position in the file being the index) and shared by all weeks.
+//
+// Users evicted for inactivity are appended to "<dir>/retired.log" (varint
+// length + bytes of id and name, f32 revenue, i64 last deal and eviction
+// time per record). The offset of the latest record of every id is kept in
+// memory, read from the log when the archive opens.
+//
+// Freezing and appending happen on a worker thread: submit() and retire()
+// only queue the data. The directory is made by the first of them, a
+// process that archives nothing leaves none behind.
+class LeaderboardArchive {
+public:
+  explicit LeaderboardArchive(const std::string& dir);
+  ~LeaderboardArchive();
+
+  // Queue the final standings of [week]; sorting, encoding and I/O are done
+  // by the archive worker.
+  void submit(int week, StandingList standings);
+
+  // Queue users evicted from the live table
+  void retire(RetiredList users);
+
+  // Latest retired record of [id], false if the user was never retired
+  bool findRetired(const std::string& id, RetiredUser& res);
+
+  // Keys (year * 100 + week number) of all archived weeks, oldest first
+  std::vector<int> weeks();
+
+  // First [n] rows of the given week
+  std::vector<ArchivedEntry> top(int week, size_t n);
+
+  // Rank of [id] in every archived week where the user had revenue
+  std::vector<ArchivedEntry> userRanks(const std::string& id);
+
+private:
+  void run();
+  void makeDir();
+  void freeze(int week, StandingList& standings);
+  void appendRetired(const RetiredList& users);
+  // Record at [pos] into [res], moving [pos] past it; false (and [pos]
+  // left alone) if cut short
+  static bool readRetired(const uint8_t* data, size_t size, size_t& pos, RetiredUser& res);
+  void loadRetiredIndex();
+  uint32_t internId(const std::string& id);
+  void loadDictionary();
+  std::shared_ptr<MappedFile> mapWeek(int week);
+  std::string weekPath(int week) const;
+
+  std::string _dir;
+  bool _dirMade = false;    // the worker's
+
+  std::mutex _queueMutex;
+  std::condition_variable _queueCond;
+  std::deque<std::pair<int, StandingList>> _queue;
+  std::deque<RetiredList> _retiredQueue;
+  bool _stop = false;
+
+  std::mutex _dictMutex;
+  std::vector<std::string> _ids;
+  std::unordered_map<std::string, uint32_t> _idIndex;
+
+  std::mutex _retiredMutex;
+  std::unordered_map<std::string, uint64_t> _retiredIndex;  // id -> offset of its latest record
+
+  std::mutex _filesMutex;
+  std::map<int, std::shared_ptr<MappedFile>> _files;
+
+  std::thread _worker;
+};
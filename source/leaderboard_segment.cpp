@@ -0,0 +1,93 @@
+#include <chrono>
+
+#include "leaderboard_segment.hpp"
+
+using namespace lbshm;
+
+LeaderboardSegment::LeaderboardSegment(const std::string& name, uint32_t capacity) : _name(name) {
+  if (capacity == 0) {
+    throw LeaderboardShmException("empty leaderboard segment!");
+  }
+  uint32_t slots = 1;
+  while (slots < 2 * uint64_t(capacity))
+    slots <<= 1;
+  size_t buffer = bufferSize(capacity, slots);
+  _size = sizeof(SegmentHeader) + 2 * buffer;
+
+  // readers still mapping the previous segment keep it until they reopen
+  ::shm_unlink(name.c_str());
+  int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    throw LeaderboardShmException("cannot create leaderboard segment " + name + "!");
+  }
+  if (::ftruncate(fd, _size) != 0) {
+    ::close(fd);
+    ::shm_unlink(name.c_str());
+    throw LeaderboardShmException("cannot size leaderboard segment " + name + "!");
+  }
+  void* p = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    ::shm_unlink(name.c_str());
+    throw LeaderboardShmException("cannot map leaderboard segment " + name + "!");
+  }
+  _base = static_cast<uint8_t*>(p);
+
+  // fresh shared memory is zeroed: generation 0, both seqlocks even
+  _header = new (_base) SegmentHeader();
+  _header->capacity = capacity;
+  _header->indexSlots = slots;
+  _header->bufferSize = buffer;
+  _header->bufferOffset[0] = sizeof(SegmentHeader);
+  _header->bufferOffset[1] = sizeof(SegmentHeader) + buffer;
+  _header->generation.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(_header->magic, magic, sizeof(magic));
+}
+
+LeaderboardSegment::~LeaderboardSegment() {
+  ::munmap(_base, _size);
+  ::shm_unlink(_name.c_str());
+}
+
+void LeaderboardSegment::publish(const RankSnapshot& snapshot) {
+  uint64_t g = _header->generation.load(std::memory_order_relaxed) + 1;
+  uint8_t* buf = _base + _header->bufferOffset[g & 1];
+  BufferHeader& h = *reinterpret_cast<BufferHeader*>(buf);
+  Entry* entries = reinterpret_cast<Entry*>(buf + entriesOffset());
+  uint32_t* index = reinterpret_cast<uint32_t*>(buf + indexOffset(_header->capacity));
+  uint32_t mask = _header->indexSlots - 1;
+
+  uint64_t seq = h.seq.load(std::memory_order_relaxed);
+  h.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  uint32_t count = std::min<size_t>(snapshot.ranks.size(), _header->capacity);
+  std::memset(index, 0, size_t(_header->indexSlots) * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; i++) {
+    const RankEntry& r = snapshot.ranks[i];
+    Entry& e = entries[i];
+    e.revenue = r.totalRev;
+    e.nameLen = std::min(r.name.size(), maxNameLen);
+    std::memcpy(e.name, r.name.data(), e.nameLen);
+    if (r.id.size() > maxIdLen) {
+      e.idLen = idTooLong;
+      continue;
+    }
+    e.idLen = r.id.size();
+    std::memcpy(e.id, r.id.data(), e.idLen);
+    uint64_t slot = hashId(r.id.data(), r.id.size()) & mask;
+    while (index[slot])
+      slot = (slot + 1) & mask;
+    index[slot] = i + 1;
+  }
+  h.version = snapshot.version;
+  h.publishedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  h.totalUsers = snapshot.ranks.size();
+  h.count = count;
+
+  h.seq.store(seq + 2, std::memory_order_release);
+  _header->generation.store(g, std::memory_order_release);
+  _version = snapshot.version;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+#include "leaderboard_shm.hpp"
+#include "user_manager.hpp"
+
+// Publishing side of the shared-memory leaderboard (see leaderboard_shm.hpp)
+class LeaderboardSegment {
+public:
+  // Creates segment [name] holding the top [capacity] users, replacing a
+  // segment left behind by an earlier run
+  LeaderboardSegment(const std::string& name, uint32_t capacity);
+  ~LeaderboardSegment();
+
+  LeaderboardSegment(const LeaderboardSegment&) = delete;
+  LeaderboardSegment& operator=(const LeaderboardSegment&) = delete;
+
+  // Writes [snapshot] into the buffer readers aren't on and switches them over
+  void publish(const RankSnapshot& snapshot);
+
+  // Users database version of the last publish, UINT64_MAX before the first
+  uint64_t version() const { return _version; }
+
+private:
+  std::string _name;
+  uint8_t* _base = nullptr;
+  size_t _size = 0;
+  lbshm::SegmentHeader* _header = nullptr;
+  uint64_t _version = UINT64_MAX;   // nothing published yet
+};
@@ -0,0 +1,227 @@
+#pragma once
+
+// Layout of the shared-memory leaderboard segment and a header-only reader
+// for processes on the same host.
+//
+// The service (LEADERBOARD_SHM=<name>) keeps two buffers in the segment
+// and publishes the ranked users into the one readers aren't pointed at,
+// then bumps the generation; the generation's low bit names the current
+// buffer. Every buffer carries a seqlock counter that is odd while it is
+// written, so a reader that got overtaken by two publishes notices and
+// retries. Reading takes neither syscalls nor locks:
+//
+//   lbshm::LeaderboardReader board("/microsvc-leaderboard");
+//   std::vector<lbshm::Standing> top;
+//   uint64_t total;
+//   if (board.top(10, top, &total)) ...
+//   lbshm::Standing me;
+//   if (board.rankOf("777", me)) ...
+//
+// The segment is recreated when the service restarts, readers attached to
+// the old one stop seeing updates (published() stays put) and should reopen.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lbshm {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "seqlock counters must be lock-free to be shared");
+
+const char magic[8] = {'L', 'B', 'S', 'H', 'M', '0', '0', '1'};
+const size_t maxIdLen = 56;      // longer ids are listed but can't be looked up
+const size_t maxNameLen = 64;    // longer names are cut
+const uint8_t idTooLong = 0xFF;
+
+struct Entry {
+  float revenue;
+  uint8_t idLen;                 // idTooLong if the id didn't fit
+  uint8_t nameLen;
+  uint16_t reserved;
+  char id[maxIdLen];
+  char name[maxNameLen];
+};
+static_assert(sizeof(Entry) == 128, "entries are two cache lines");
+
+struct alignas(64) SegmentHeader {
+  char magic[8];
+  uint32_t capacity;             // entries per buffer, the top [capacity] users
+  uint32_t indexSlots;           // power of two
+  uint64_t bufferSize;
+  uint64_t bufferOffset[2];
+  alignas(64) std::atomic<uint64_t> generation;  // 0 until the first publish
+};
+
+struct alignas(64) BufferHeader {
+  std::atomic<uint64_t> seq;     // odd while the buffer is written
+  uint64_t version;              // users database version of the rating
+  int64_t publishedNs;           // wall clock, ns since epoch
+  uint64_t totalUsers;           // all users, including those past [capacity]
+  uint32_t count;                // entries in use
+};
+
+// Buffer: BufferHeader, Entry[capacity], then uint32_t[indexSlots] of
+// entry position + 1 (0: free) by id hash, linear probing
+inline size_t entriesOffset() {
+  return sizeof(BufferHeader);
+}
+
+inline size_t indexOffset(uint32_t capacity) {
+  return entriesOffset() + size_t(capacity) * sizeof(Entry);
+}
+
+inline size_t bufferSize(uint32_t capacity, uint32_t indexSlots) {
+  size_t size = indexOffset(capacity) + size_t(indexSlots) * sizeof(uint32_t);
+  return (size + 63) & ~size_t(63);
+}
+
+inline uint64_t hashId(const char * id, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= static_cast<unsigned char>(id[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+class LeaderboardShmException : public std::exception {
+  std::string _message;
+public:
+  LeaderboardShmException(const std::string & message) :
+    _message(message) { }
+  const char * what() const throw() {
+    return _message.c_str();
+  }
+};
+
+struct Standing {
+  uint64_t rank = 0;             // 1-based
+  float revenue = 0;
+  std::string id;
+  std::string name;
+};
+
+class LeaderboardReader {
+public:
+  explicit LeaderboardReader(const std::string & name) {
+    int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      throw LeaderboardShmException("cannot open leaderboard segment " + name + "!");
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SegmentHeader)) {
+      ::close(fd);
+      throw LeaderboardShmException("leaderboard segment " + name + " is not initialized!");
+    }
+    void * p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      throw LeaderboardShmException("cannot map leaderboard segment " + name + "!");
+    }
+    _base = static_cast<const uint8_t *>(p);
+    _size = st.st_size;
+    _header = reinterpret_cast<const SegmentHeader *>(_base);
+    if (std::memcmp(_header->magic, magic, sizeof(magic)) != 0 ||
+        _header->bufferOffset[0] + _header->bufferSize > _size ||
+        _header->bufferOffset[1] + _header->bufferSize > _size ||
+        bufferSize(_header->capacity, _header->indexSlots) > _header->bufferSize) {
+      ::munmap(const_cast<uint8_t *>(_base), _size);
+      throw LeaderboardShmException("unknown leaderboard segment layout!");
+    }
+  }
+
+  ~LeaderboardReader() {
+    ::munmap(const_cast<uint8_t *>(_base), _size);
+  }
+
+  LeaderboardReader(const LeaderboardReader &) = delete;
+  LeaderboardReader & operator=(const LeaderboardReader &) = delete;
+
+  // Generation of the current rating, 0 before the first publish
+  uint64_t published() const {
+    return _header->generation.load(std::memory_order_acquire);
+  }
+
+  // First [n] users, false if nothing was published yet
+  bool top(size_t n, std::vector<Standing> & out, uint64_t * totalUsers = nullptr) const {
+    return consistent([&](const uint8_t * buf, const BufferHeader & h) {
+      out.clear();
+      size_t count = std::min<size_t>(std::min<size_t>(h.count, _header->capacity), n);
+      for (size_t i = 0; i < count; i++)
+        out.push_back(standing(buf, i));
+      if (totalUsers)
+        *totalUsers = h.totalUsers;
+      return true;
+    });
+  }
+
+  // Rank of [id], false if it isn't among the published users
+  bool rankOf(const std::string & id, Standing & out) const {
+    if (id.size() > maxIdLen)
+      return false;
+    return consistent([&](const uint8_t * buf, const BufferHeader & h) {
+      const Entry * entries = reinterpret_cast<const Entry *>(buf + entriesOffset());
+      const uint32_t * index = reinterpret_cast<const uint32_t *>(buf + indexOffset(_header->capacity));
+      uint32_t mask = _header->indexSlots - 1;
+      uint32_t count = std::min(h.count, _header->capacity);
+      uint64_t slot = hashId(id.data(), id.size()) & mask;
+      // a torn read can't loop forever, the whole index is probed at most once
+      for (uint32_t probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+        uint32_t pos = index[slot];
+        if (pos == 0 || pos > count)
+          return false;
+        const Entry & e = entries[pos - 1];
+        if (e.idLen == id.size() && std::memcmp(e.id, id.data(), id.size()) == 0) {
+          out = standing(buf, pos - 1);
+          return true;
+        }
+      }
+      return false;
+    });
+  }
+
+private:
+  Standing standing(const uint8_t * buf, size_t i) const {
+    const Entry & e = reinterpret_cast<const Entry *>(buf + entriesOffset())[i];
+    Standing s;
+    s.rank = i + 1;
+    s.revenue = e.revenue;
+    if (e.idLen != idTooLong)
+      s.id.assign(e.id, std::min<size_t>(e.idLen, maxIdLen));
+    s.name.assign(e.name, std::min<size_t>(e.nameLen, maxNameLen));
+    return s;
+  }
+
+  // Runs [read] on the current buffer until it saw a stable one
+  template <typename Read>
+  bool consistent(Read read) const {
+    for (;;) {
+      uint64_t g = _header->generation.load(std::memory_order_acquire);
+      if (g == 0)
+        return false;
+      const uint8_t * buf = _base + _header->bufferOffset[g & 1];
+      const BufferHeader & h = *reinterpret_cast<const BufferHeader *>(buf);
+      uint64_t s1 = h.seq.load(std::memory_order_acquire);
+      if (s1 & 1)
+        continue;
+      bool res = read(buf, h);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (h.seq.load(std::memory_order_relaxed) == s1)
+        return res;
+    }
+  }
+
+  const uint8_t * _base = nullptr;
+  size_t _size = 0;
+  const SegmentHeader * _header = nullptr;
+};
+
+}
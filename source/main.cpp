@@ -24,37 +24,113 @@
 // SOFTWARE.
 //
 
+#include <cstdlib>
 #include <iostream>
 
 #include <usr_interrupt_handler.hpp>
 #include <runtime_utils.hpp>
+#include <cpu_placement.hpp>
+#include <handler_executor.hpp>
+#include <request_trace.hpp>
+#include <startup_report.hpp>
+#include <pplx/threadpool.h>
 
+#include <std_micro_service.hpp>
 #include "microsvc_controller.hpp"
+#include "router_controller.hpp"
+#include "traffic_capture.hpp"
 
 using namespace web;
 using namespace cfx;
 
+namespace {
+    int serve(BasicController & server, const std::string & endpoint) {
+        try {
+            {
+                StartupStage stage("endpoint");
+                server.setEndpoint(endpoint);
+                stage.detail(server.endpoint());
+            }
+            // the port opens last, whatever connects is served right away
+            {
+                StartupStage stage("listener");
+                server.accept().wait();
+            }
+            StartupReport::ready();
+            std::cout << "Modern C++ Microservice now listening for requests at: " << server.endpoint() << '\n';
+            
+            InterruptHandler::waitForUserInterrupt();
+
+            server.shutdown().wait();
+            CaptureWriter::stop();
+        }
+        catch(std::exception & e) {
+            std::cerr << "somehitng wrong happen! :( " << e.what() << '\n';
+        }
+        catch(...) {
+            RuntimeUtils::printStackTrace();
+        }
+        RequestTrace::shutdown();
+        return 0;
+    }
+}
+
 int main(int argc, const char * argv[]) {
     InterruptHandler::hookSIGINT();
 
-    MicroserviceController server;
-    server.setEndpoint("http://host_auto_ip4:6502/api");
-    
-    try {
-        // wait for server initialization...
-        server.accept().wait();
-        std::cout << "Modern C++ Microservice now listening for requests at: " << server.endpoint() << '\n';
-        
-        InterruptHandler::waitForUserInterrupt();
-
-        server.shutdown().wait();
+    // placement has to be settled before the first thread starts
+    auto placement = PlacementConfig::fromEnvironment();
+    CpuPlacement::configure(placement);
+    if (placement.ioThreads) {
+        crossplat::threadpool::initialize_with_threads(placement.ioThreads);
     }
-    catch(std::exception & e) {
-        std::cerr << "somehitng wrong happen! :(" << '\n';
+    HandlerExecutor::start(placement.handlerThreads);
+    RequestTrace::configure(TraceConfig::fromEnvironment());
+
+    // SERVICE_PORT lets several instances (e.g. a replication leader and
+    // its followers) run side by side on one host
+    std::string port = "6502";
+    if (const char* env_p = std::getenv("SERVICE_PORT")) {
+        port = env_p;
     }
-    catch(...) {
-        RuntimeUtils::printStackTrace();
+    // SERVICE_HOST=<address> skips looking for one (host_auto_ip6 picks an
+    // IPv6 one, 0.0.0.0 listens on all of them)
+    std::string host = "host_auto_ip4";
+    if (const char* env_p = std::getenv("SERVICE_HOST")) {
+        host = env_p;
     }
+    std::string endpoint = "http://" + host + ":" + port + "/api";
 
-    return 0;
+    // CLUSTER_PARTITIONS=<uri>,<uri>,... turns this instance into the router
+    // in front of the listed partitions
+    if (const char* env_p = std::getenv("CLUSTER_PARTITIONS")) {
+        std::string list = env_p;
+        std::vector<std::string> partitions;
+        boost::split(partitions, list, boost::is_any_of(","), boost::token_compress_on);
+        std::cout << CpuPlacement::report() << std::endl;
+        RouterController router(partitions);
+        return serve(router, endpoint);
+    }
+
+    // background jobs (timers, archive, replication) start here rather
+    // than on the first request, after the STATE_FILE users are in
+    UserManager::getInstance();
+    std::cout << CpuPlacement::report() << std::endl;
+    {
+        StartupStage stage("rank snapshots");
+        UserManager::getInstance().prepareRatings();
+    }
+
+    // requests are recorded for traffic-replay from here on with
+    // CAPTURE_ON_START=1, or once /admin/capture starts a capture
+    CaptureWriter::configure(CaptureConfig::fromEnvironment());
+
+    MicroserviceController server;
+    {
+        StartupStage stage("top lists");
+        server.warmUp();
+    }
+    int res = serve(server, endpoint);
+    UserManager::getInstance().saveState();
+    return res;
 }
@@ -24,188 +24,935 @@
 // SOFTWARE.
 //
 
+#include <algorithm>
+#include <cpprest/containerstream.h>
+
 #include <std_micro_service.hpp>
+#include <cpu_placement.hpp>
+#include <handler_executor.hpp>
 #include "microsvc_controller.hpp"
 #include "user_manager.hpp"
+#include "wire_format.hpp"
 
 using namespace web;
 using namespace http;
 
+namespace {
+    const unsigned short tooManyRequests = 429;
+
+    // Still url-encoded value of [field] in a form body, found without
+    // splitting or decoding the rest of it
+    std::string rawFormField(const std::string & body, const std::string & field) {
+        size_t pos = 0;
+        while (pos < body.size()) {
+            size_t end = body.find('&', pos);
+            if (end == std::string::npos)
+                end = body.size();
+            if (end - pos > field.size() && body[pos + field.size()] == '=' &&
+                body.compare(pos, field.size(), field) == 0) {
+                pos += field.size() + 1;
+                return body.substr(pos, end - pos);
+            }
+            pos = end + 1;
+        }
+        return std::string();
+    }
+
+    // Rate limit key of a form body: the decoded id, so that differently
+    // encoded spellings of one id share a bucket
+    std::string formUserKey(const std::string & body) {
+        std::string raw = rawFormField(body, "id");
+        try {
+            return uri::decode(raw);
+        }
+        catch (std::exception & e) {
+            return raw;
+        }
+    }
+
+    void captureUserOp(const std::string & what, const UserOpRequest & op) {
+        static const std::map<std::string, CaptureOp> ops = {
+            {"registered", CaptureOp::Register},
+            {"renamed", CaptureOp::Rename},
+            {"deregistered", CaptureOp::Deregister},
+            {"connected", CaptureOp::Connect},
+            {"disconnected", CaptureOp::Disconnect},
+            {"deal", CaptureOp::Deal},
+            {"current", CaptureOp::SetCurrent}
+        };
+        auto it = ops.find(what);
+        if (it == ops.end())
+            return;
+        CapturedRequest r;
+        r.op = it->second;
+        r.arrival = op.arrival;
+        r.id = op.id;
+        r.text = op.name;
+        r.amount = op.amount;
+        r.time = op.time;
+        r.approximate = op.approximate;
+        CaptureWriter::record(r);
+    }
+
+    const size_t importChunkSize = 1 << 20;
+    const size_t maxImportLine = 64 * 1024;
+    const size_t maxReportedErrors = 1000;
+    const size_t importBytesPerRow = 20;  // table pre-sizing guess from Content-Length
+    const size_t minImportRowBytes = 4;   // "a,b\n", bounds the rows a body can hold
+
+    // IMPORT_MAX_ROWS caps the rows an import may announce through ?rows=
+    // (default 10M), the users table is sized for them up front
+    size_t importMaxRows() {
+        static const size_t max = [] {
+            size_t v = 10000000;
+            if (const char * env_p = std::getenv("IMPORT_MAX_ROWS")) {
+                try {
+                    v = std::stoull(env_p);
+                }
+                catch (std::exception & e) {
+                    std::cout << "Bad import max rows value: " << e.what() << '\n';
+                }
+            }
+            return v;
+        }();
+        return max;
+    }
+
+    // One streaming import, shared by its read loop and chunk tasks. The read
+    // loop and the applies are each sequential, so nothing here is locked.
+    struct ImportJob {
+        concurrency::streams::istream body;
+        std::string tail;        // incomplete last line of the body read so far
+        size_t nextLine = 1;     // number of the first line after the dispatched chunks
+        pplx::task<void> applied = pplx::task_from_result();
+        size_t rows = 0;
+        size_t imported = 0;
+        size_t failed = 0;
+        std::vector<ImportError> errors;   // first maxReportedErrors of them
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    };
+
+    // Chunks are parsed side by side as they arrive but applied in body
+    // order, so of two rows with the same id the first one wins
+    void dispatchChunk(std::shared_ptr<ImportJob> job, std::string data) {
+        size_t first = job->nextLine;
+        job->nextLine += countLines(data.data(), data.size());
+
+        auto text = std::make_shared<std::string>(std::move(data));
+        auto batch = std::make_shared<ImportBatch>();
+        auto parsed = pplx::create_task([=] {
+            *batch = parseImportChunk(text->data(), text->size(), first);
+        }, HandlerExecutor::options());
+
+        job->applied = (job->applied && parsed).then([=] {
+            size_t rows = batch->rows.size() + batch->errors.size();
+            size_t imported = UserManager::getInstance().importUsers(batch->rows, batch->errors);
+            job->rows += rows;
+            job->imported += imported;
+            job->failed += rows - imported;
+
+            std::stable_sort(batch->errors.begin(), batch->errors.end(),
+                             [](const ImportError & a, const ImportError & b) { return a.line < b.line; });
+            for (auto & e : batch->errors) {
+                if (job->errors.size() == maxReportedErrors)
+                    break;
+                job->errors.push_back(std::move(e));
+            }
+        });
+    }
+
+    pplx::task<void> readImport(std::shared_ptr<ImportJob> job) {
+        auto buf = std::make_shared<concurrency::streams::container_buffer<std::vector<uint8_t>>>();
+        return job->body.read(*buf, importChunkSize).then([=](size_t n) -> pplx::task<void> {
+            if (n == 0) {
+                if (!job->tail.empty())
+                    dispatchChunk(job, std::move(job->tail));
+                return pplx::task_from_result();
+            }
+
+            // only whole lines are parsed, the rest waits for the next read
+            const auto & data = buf->collection();
+            const char * bytes = reinterpret_cast<const char *>(data.data());
+            size_t size = data.size();
+            size_t whole = size;
+            while (whole > 0 && bytes[whole - 1] != '\n')
+                whole--;
+            if (whole == 0) {
+                job->tail.append(bytes, size);
+                if (job->tail.size() > maxImportLine)
+                    throw std::runtime_error("line " + std::to_string(job->nextLine) + " too long!");
+            }
+            else {
+                std::string chunk;
+                chunk.reserve(job->tail.size() + whole);
+                chunk.append(job->tail);
+                chunk.append(bytes, whole);
+                job->tail.assign(bytes + whole, size - whole);
+                dispatchChunk(job, std::move(chunk));
+            }
+            return readImport(job);
+        });
+    }
+}
+
+MicroserviceController::MicroserviceController() : BasicController(),
+    _userLimiter(RateLimitConfig::fromEnvironment("RATE_LIMIT_USER", 0, 0)),
+    _clientLimiter(RateLimitConfig::fromEnvironment("RATE_LIMIT_CLIENT", 0, 0)) {
+}
+
 void MicroserviceController::initRestOpHandlers() {
-    _listener.support(methods::GET, std::bind(&MicroserviceController::handleGet, this, std::placeholders::_1));
-    _listener.support(methods::PUT, std::bind(&MicroserviceController::handlePut, this, std::placeholders::_1));
-    _listener.support(methods::POST, std::bind(&MicroserviceController::handlePost, this, std::placeholders::_1));
-    _listener.support(methods::DEL, std::bind(&MicroserviceController::handleDelete, this, std::placeholders::_1));
-    _listener.support(methods::PATCH, std::bind(&MicroserviceController::handlePatch, this, std::placeholders::_1));
+    support(methods::GET, std::bind(&MicroserviceController::handleGet, this, std::placeholders::_1));
+    support(methods::PUT, std::bind(&MicroserviceController::handlePut, this, std::placeholders::_1));
+    support(methods::POST, std::bind(&MicroserviceController::handlePost, this, std::placeholders::_1));
+    support(methods::DEL, std::bind(&MicroserviceController::handleDelete, this, std::placeholders::_1));
+    support(methods::PATCH, std::bind(&MicroserviceController::handlePatch, this, std::placeholders::_1));
 }
 
 void MicroserviceController::handleGet(http_request message) {
+    CpuPlacement::placeIoThread();
+    auto arrival = CaptureWriter::stamp();
+    if (HandlerExecutor::started()) {
+        auto span = RequestTrace::current();
+        pplx::create_task([=] {
+            TraceScope scope(span, true);
+            routeGet(message, arrival);
+        }, HandlerExecutor::options());
+        return;
+    }
+    routeGet(message, arrival);
+}
+
+void MicroserviceController::routeGet(http_request message, uint64_t arrival) {
     auto path = requestPath(message);
-    if (!path.empty()) {
+    if (path.size() > 1) {
       //   message.relative_uri() 
         if (path[0] == "service" && path[1] == "test") {
             auto response = json::value::object();
             response["version"] = json::value::string("0.1.1");
             response["status"] = json::value::string("ready!");
-            message.reply(status_codes::OK, response);
+            reply(message, status_codes::OK, response);
+        }
+        else if (path[0] == "service" && path[1] == "ready") {
+            replyReadiness(message);
+        }
+        else if (path[0] == "service" && path[1] == "metrics") {
+            auto m = UserManager::getInstance().getMemoryMetrics();
+            json::value response;
+            response["users"] = json::value::number(static_cast<uint64_t>(m.users));
+            response["rss_bytes"] = json::value::number(m.rssBytes);
+            response["rss_per_user_bytes"] = json::value::number(m.users ? m.rssBytes / m.users : 0);
+            response["evicted_users"] = json::value::number(m.evicted);
+            response["deregistered_users"] = json::value::number(m.deregistered);
+            auto d = UserManager::getInstance().getDealMetrics();
+            response["deals_buffered"] = json::value::number(static_cast<uint64_t>(d.buffered));
+            response["deals_applied"] = json::value::number(d.applied);
+            response["deals_late"] = json::value::number(d.late);
+            response["deals_dropped"] = json::value::number(d.dropped);
+            response["deals_forced"] = json::value::number(d.forced);
+            response["deals_merged"] = json::value::number(d.merged);
+            reply(message, status_codes::OK, response);
+        }
+        else if (path[0] == "admin" && path[1] == "lockprof") {
+            handleLockProfile(message);
+        }
+        else if (path[0] == "admin" && path[1] == "trace") {
+            auto s = RequestTrace::stats();
+            const auto & c = RequestTrace::config();
+            json::value response;
+            response["file"] = json::value::string(c.file);
+            response["ring_spans"] = json::value::number(static_cast<uint64_t>(c.ringSpans));
+            response["slow_ms"] = json::value::number(c.slowNs / 1000000);
+            response["sample_every"] = json::value::number(c.sampleEvery);
+            response["recorded"] = json::value::number(s.recorded);
+            response["slow"] = json::value::number(s.slow);
+            response["sampled"] = json::value::number(s.sampled);
+            response["lost"] = json::value::number(s.lost);
+            response["threads"] = json::value::number(static_cast<uint64_t>(s.threads));
+            reply(message, status_codes::OK, response);
+        }
+        else if (path[0] == "admin" && path[1] == "capture") {
+            auto s = CaptureWriter::stats();
+            json::value response;
+            response["active"] = s.active;
+            response["file"] = json::value::string(s.file);
+            response["records"] = json::value::number(s.records);
+            response["bytes"] = json::value::number(s.bytes);
+            response["dropped"] = json::value::number(s.dropped);
+            reply(message, status_codes::OK, response);
+        }
+        else if (path[0] == "rating" && path[1] == "percentiles") {
+            handlePercentiles(message);
+        }
+        else if (path[0] == "rating" && path[1] == "partial") {
+            handlePartialRating(message);
+        }
+        else if (path[0] == "rating" && path[1] == "windows") {
+            const auto & w = UserManager::getInstance().getRatingWindows();
+            std::vector<json::value> windows;
+            for (size_t i = 0; i < w.names.size(); i++) {
+                json::value v;
+                v["name"] = json::value::string(w.names[i]);
+                v["buckets"] = json::value::number(w.lengths[i]);
+                windows.push_back(v);
+            }
+            json::value response;
+            response["bucket_sec"] = json::value::number(w.bucketSec);
+            response["windows"] = json::value::array(windows);
+            reply(message, status_codes::OK, response);
+        }
+        else if (path[0] == "rating") {
+            handleRating(message, path[1], arrival);
+        }
+        else if (path[0] == "replication" && path[1] == "status") {
+            auto s = UserManager::getInstance().getReplicationStatus();
+            json::value response;
+            response["role"] = json::value::string(s.role);
+            response["linked"] = s.linked;
+            response["followers"] = json::value::number(static_cast<uint64_t>(s.followers));
+            response["applied_seq"] = json::value::number(s.appliedSeq);
+            response["leader_seq"] = json::value::number(s.leaderSeq);
+            response["lag_records"] = json::value::number(s.leaderSeq - s.appliedSeq);
+            response["lag_ms"] = json::value::number(s.lagMs);
+            reply(message, status_codes::OK, response);
+        }
+        else if (path[0] == "archive") {
+            handleArchive(message, path[1]);
+        }
+        else {
+            reply(message, status_codes::NotFound);
         }
     }
     else {
-        message.reply(status_codes::NotFound);
+        reply(message, status_codes::NotFound);
+    }
+}
+
+void MicroserviceController::handleRating(http_request message, const std::string & what, uint64_t arrival) {
+    auto q = uri::split_query(message.request_uri().query());
+    try {
+        RatingRequest req;
+        if (what == "user") {
+            req.userId = q["id"];
+            req.approximate = q["mode"] == "approx";
+            if (req.userId.empty()) {
+                throw UserManagerException("empty user id!");
+            }
+        }
+        else if (what != "top") {
+            reply(message, status_codes::NotFound);
+            return;
+        }
+        if (!q["n"].empty())
+            req.topNum = std::stoul(q["n"]);
+        req.window = q["window"];
+        if (CaptureWriter::active()) {
+            CapturedRequest r;
+            r.op = what == "user" ? CaptureOp::RatingUser : CaptureOp::RatingTop;
+            r.arrival = arrival;
+            r.id = req.userId;
+            r.text = req.window;
+            r.topNum = static_cast<uint32_t>(req.topNum);
+            r.approximate = req.approximate;
+            CaptureWriter::record(r);
+        }
+        UserManager::getInstance().getRating(req);
+        if (req.userId.empty()) {
+            auto top = topResponse(req);
+            if (acceptsBinary(message))
+                replyBinary(message, top->binary);
+            else
+                reply(message, status_codes::OK, top->json, std::string("application/json"));
+            return;
+        }
+        if (acceptsBinary(message)) {
+            replyBinary(message, wire::encodeRating(req));
+            return;
+        }
+        json::value response;
+        ratingResponse(req, response);
+        reply(message, status_codes::OK, response);
+    }
+    catch(UserManagerException & e) {
+        reply(message, status_codes::BadRequest, e.what());
+    }
+    catch(std::exception & e) {
+        reply(message, status_codes::BadRequest, e.what());
     }
 }
 
+std::shared_ptr<const MicroserviceController::TopResponse> MicroserviceController::topResponse(const RatingRequest & req) {
+    uint64_t version = req.snapshot ? req.snapshot->version : 0;
+    uint32_t bucket = req.snapshot ? req.snapshot->bucket : 0;
+    {
+        std::unique_lock<std::mutex> lock { _topMutex };
+        auto it = _topResponses.find(req.window);
+        if (it != _topResponses.end() && it->second->version == version &&
+            it->second->bucket == bucket && it->second->topNum == req.topNum)
+            return it->second;
+    }
+    auto fresh = std::make_shared<TopResponse>();
+    fresh->version = version;
+    fresh->bucket = bucket;
+    fresh->topNum = req.topNum;
+    json::value response;
+    ratingResponse(req, response);
+    fresh->json = response.serialize();
+    fresh->binary = wire::encodeRating(req);
+
+    std::unique_lock<std::mutex> lock { _topMutex };
+    auto & cached = _topResponses[req.window];
+    if (!cached || cached->version < version || (cached->version == version && cached->bucket <= bucket))
+        cached = fresh;
+    return fresh;
+}
+
+void MicroserviceController::warmUp() {
+    std::vector<std::string> windows = UserManager::getInstance().getRatingWindows().names;
+    windows.insert(windows.begin(), std::string());
+    for (const auto & w : windows) {
+        RatingRequest req;
+        req.window = w;
+        UserManager::getInstance().getRating(req);
+        topResponse(req);
+    }
+}
+
+void MicroserviceController::handlePartialRating(http_request message) {
+    auto q = uri::split_query(message.request_uri().query());
+    try {
+        PartialRatingRequest req;
+        if (!q["n"].empty())
+            req.topNum = std::stoul(q["n"]);
+        if (!q["near"].empty())
+            req.nearNum = std::stoul(q["near"]);
+        if (!q["pivot"].empty()) {
+            req.withPivot = true;
+            req.pivot = std::stof(q["pivot"]);
+            req.userId = q["id"];
+        }
+        UserManager::getInstance().getPartialRating(req);
+
+        auto entries = [](const UserList & users) -> json::value {
+            std::vector<json::value> vals;
+            vals.reserve(users.size());
+            for (const auto & u : users) {
+                json::value pos;
+                pos["id"] = json::value::string(u.second.id);
+                pos["name"] = json::value::string(u.second.name);
+                pos["rating"] = u.second.totalRev;
+                vals.push_back(pos);
+            }
+            return json::value::array(vals);
+        };
+        json::value response;
+        response["top_rated"] = entries(req.topRated);
+        response["higher"] = entries(req.higher);
+        response["lower"] = entries(req.lower);
+        response["above"] = json::value::number(static_cast<uint64_t>(req.above));
+        response["total_users"] = json::value::number(static_cast<uint64_t>(req.totalUsers));
+        reply(message, status_codes::OK, response);
+    }
+    catch(std::exception & e) {
+        reply(message, status_codes::BadRequest, e.what());
+    }
+}
+
+void MicroserviceController::ratingResponse(const RatingRequest & req, json::value & response) {
+    // arrays are filled in place straight from the rank snapshot
+    json::value top = json::value::array(req.topRated.size());
+    for (size_t i = 0; i < req.topRated.size(); i++) {
+        const auto & u = req.topRated[i];
+        json::value & pos = top[i];
+        pos["position"] = json::value::number(static_cast<uint64_t>(i + 1));
+        pos["name"] = json::value::string(u.name);
+        pos["rating"] = u.totalRev;
+    }
+    response["top_rated"] = std::move(top);
+    response["total_users"] = json::value::number(static_cast<uint64_t>(req.totalUsers));
+    if (!req.window.empty())
+        response["window"] = json::value::string(req.window);
+
+    if (req.userId.empty())
+        return;
+
+    json::value near = json::value::array(req.neighbours.size());
+    for (size_t i = 0; i < req.neighbours.size(); i++) {
+        const auto & u = req.neighbours[i];
+        json::value & pos = near[i];
+        pos["position"] = json::value::number(static_cast<uint64_t>(req.bestNeigbourPos + i));
+        pos["name"] = json::value::string(u.name);
+        pos["rating"] = u.totalRev;
+        pos["is_current"] = u.id == req.userId;
+    }
+    response["neigbour_list"] = std::move(near);
+    response["position"] = json::value::number(static_cast<uint64_t>(req.userPos));
+    response["rating"] = req.userRating;
+    response["top_percent"] = req.topPercent;
+    response["approximate"] = req.approximate;
+}
+
+void MicroserviceController::handlePercentiles(http_request message) {
+    auto q = uri::split_query(message.request_uri().query());
+    std::string list = q["p"].empty() ? "50,90,99,99.9" : q["p"];
+    std::vector<std::string> ps;
+    boost::split(ps, list, boost::is_any_of(","));
+    try {
+        json::value response;
+        for (const auto & p : ps) {
+            response[p] = UserManager::getInstance().getRevenuePercentile(std::stod(p));
+        }
+        reply(message, status_codes::OK, response);
+    }
+    catch(UserManagerException & e) {
+        reply(message, status_codes::BadRequest, e.what());
+    }
+    catch(std::exception & e) {
+        reply(message, status_codes::BadRequest, e.what());
+    }
+}
+
+void MicroserviceController::handleArchive(http_request message, const std::string & what) {
+    auto q = uri::split_query(message.request_uri().query());
+    try {
+        json::value response;
+        if (what == "weeks") {
+            auto weeks = UserManager::getInstance().getArchivedWeeks();
+            std::vector<json::value> vals;
+            vals.reserve(weeks.size());
+            for (int w : weeks)
+                vals.push_back(json::value::number(w));
+            response["weeks"] = json::value::array(vals);
+        }
+        else if (what == "top") {
+            size_t n = 10;
+            if (!q["n"].empty())
+                n = std::stoul(q["n"]);
+            auto entries = UserManager::getInstance().getArchivedTop(std::stoi(q["week"]), n);
+            response["top_rated"] = archivedEntries(entries);
+        }
+        else if (what == "user") {
+            auto entries = UserManager::getInstance().getArchivedRanks(q["id"]);
+            response["ranks"] = archivedEntries(entries);
+        }
+        else if (what == "retired") {
+            RetiredUser u;
+            if (!UserManager::getInstance().getRetiredUser(q["id"], u)) {
+                reply(message, status_codes::NotFound, "user was not retired!");
+                return;
+            }
+            response["id"] = json::value::string(u.id);
+            response["name"] = json::value::string(u.name);
+            response["rating"] = u.revenue;
+            response["last_deal"] = json::value::number(u.lastDeal);
+            response["retired_at"] = json::value::number(u.retiredAt);
+        }
+        else {
+            reply(message, status_codes::NotFound);
+            return;
+        }
+        reply(message, status_codes::OK, response);
+    }
+    catch(LeaderboardArchiveException & e) {
+        reply(message, status_codes::NotFound, e.what());
+    }
+    catch(std::exception & e) {
+        reply(message, status_codes::BadRequest, e.what());
+    }
+}
+
+void MicroserviceController::handleImport(http_request message) {
+    auto job = std::make_shared<ImportJob>();
+    job->body = message.body();
+
+    // ?rows=<n> announces the number of rows, otherwise it is guessed
+    // from the body size when that is known up front
+    try {
+        auto q = uri::split_query(message.request_uri().query());
+        size_t length = message.headers().content_length();
+        size_t expected = 0;
+        if (!q["rows"].empty()) {
+            expected = std::stoull(q["rows"]);
+            if (expected > importMaxRows() || (length && expected > length / minImportRowBytes)) {
+                throw std::out_of_range("rows out of range!");
+            }
+        }
+        else {
+            expected = std::min(length / importBytesPerRow, importMaxRows());
+        }
+        if (expected)
+            UserManager::getInstance().reserveUsers(expected);
+    }
+    catch(std::exception & e) {
+        reply(message, status_codes::BadRequest, e.what());
+        return;
+    }
+
+    auto span = RequestTrace::current();
+    readImport(job).then([=] {
+        return job->applied;
+    }).then([=](pplx::task<void> t) {
+        TraceScope scope(span);
+        try {
+            t.get();
+        }
+        catch(std::exception & e) {
+            reply(message, status_codes::BadRequest, e.what());
+            return;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job->started).count();
+        json::value response;
+        response["rows"] = json::value::number(static_cast<uint64_t>(job->rows));
+        response["imported"] = json::value::number(static_cast<uint64_t>(job->imported));
+        response["failed"] = json::value::number(static_cast<uint64_t>(job->failed));
+        response["elapsed_ms"] = seconds * 1000;
+        response["rows_per_sec"] = seconds > 0 ? job->rows / seconds : 0;
+        std::vector<json::value> errors;
+        errors.reserve(job->errors.size());
+        for (const auto & e : job->errors) {
+            json::value v;
+            v["line"] = json::value::number(static_cast<uint64_t>(e.line));
+            v["error"] = json::value::string(e.message);
+            errors.push_back(v);
+        }
+        response["errors"] = json::value::array(errors);
+        response["errors_truncated"] = job->failed > job->errors.size();
+        reply(message, status_codes::OK, response);
+    });
+}
+
+void MicroserviceController::handleLockProfile(http_request message) {
+    auto q = uri::split_query(message.request_uri().query());
+    size_t top = 10;
+    try {
+        if (!q["top"].empty())
+            top = std::stoul(q["top"]);
+    }
+    catch(std::exception & e) {
+        reply(message, status_codes::BadRequest, e.what());
+        return;
+    }
+
+    // histograms are cut after their last non-empty bucket
+    auto histogram = [](const std::vector<uint64_t> & h) -> json::value {
+        size_t n = h.size();
+        while (n > 0 && h[n - 1] == 0)
+            n--;
+        std::vector<json::value> vals;
+        for (size_t i = 0; i < n; i++)
+            vals.push_back(json::value::number(h[i]));
+        return json::value::array(vals);
+    };
+
+    auto p = UserManager::getInstance().getLockProfile(top);
+    json::value response;
+    response["enabled"] = p.enabled;
+    response["elapsed_ms"] = json::value::number(p.elapsedMs);
+    std::vector<json::value> ops;
+    for (const auto & s : p.ops) {
+        json::value v;
+        v["op"] = json::value::string(s.op);
+        v["acquisitions"] = json::value::number(s.acquisitions);
+        v["contended"] = json::value::number(s.contended);
+        v["wait_ns_total"] = json::value::number(s.waitNs);
+        v["hold_ns_total"] = json::value::number(s.holdNs);
+        v["wait_ns_max"] = json::value::number(s.maxWaitNs);
+        v["hold_ns_max"] = json::value::number(s.maxHoldNs);
+        v["wait_ns_p50"] = json::value::number(cfx::LockOpStats::percentile(s.waitHistogram, 50));
+        v["wait_ns_p99"] = json::value::number(cfx::LockOpStats::percentile(s.waitHistogram, 99));
+        v["hold_ns_p50"] = json::value::number(cfx::LockOpStats::percentile(s.holdHistogram, 50));
+        v["hold_ns_p99"] = json::value::number(cfx::LockOpStats::percentile(s.holdHistogram, 99));
+        v["wait_log2_histogram"] = histogram(s.waitHistogram);
+        v["hold_log2_histogram"] = histogram(s.holdHistogram);
+        ops.push_back(v);
+    }
+    response["operations"] = json::value::array(ops);
+    std::vector<json::value> blocking;
+    for (const auto & b : p.blocking) {
+        json::value v;
+        v["waiter"] = json::value::string(b.waiter);
+        v["holder"] = json::value::string(b.holder);
+        v["count"] = json::value::number(b.count);
+        v["wait_ns_total"] = json::value::number(b.waitNs);
+        blocking.push_back(v);
+    }
+    response["top_blocking"] = json::value::array(blocking);
+    reply(message, status_codes::OK, response);
+}
+
+json::value MicroserviceController::archivedEntries(const std::vector<ArchivedEntry> & entries) {
+    std::vector<json::value> vals;
+    vals.reserve(entries.size());
+    for (const auto & e : entries) {
+        json::value pos;
+        pos["week"] = e.week;
+        pos["position"] = json::value::number(static_cast<uint64_t>(e.rank));
+        pos["id"] = json::value::string(e.id);
+        pos["rating"] = e.revenue;
+        vals.push_back(pos);
+    }
+    return json::value::array(vals);
+}
+
 void MicroserviceController::handlePatch(http_request message) {
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::PATCH));
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::PATCH));
 }
 
 void MicroserviceController::handlePut(http_request message) {
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::PUT));
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::PUT));
 }
 
 void MicroserviceController::handlePost(http_request message) {
+  CpuPlacement::placeIoThread();
   auto path = requestPath(message);
-  if (!path.empty() && path[0] == "user") {
+  auto span = RequestTrace::current();
+  auto arrival = CaptureWriter::stamp();
+  // action=enable|disable|reset, replicas included
+  if (path.size() > 1 && path[0] == "admin" && path[1] == "lockprof") {
+    message.extract_string().then([=](utility::string_t body) {
+      TraceScope scope(span, true);
+      auto action = uri::split_query(body)["action"];
+      if (action == "enable" || action == "disable")
+        UserManager::getInstance().setLockProfiling(action == "enable");
+      else if (action == "reset")
+        UserManager::getInstance().resetLockProfile();
+      else {
+        reply(message, status_codes::BadRequest, "unknown lock profiler action!");
+        return;
+      }
+      replyAck(message, "lock profiler " + action + (action == "reset" ? "!" : "d!"));
+    });
+    return;
+  }
+  // action=flush writes the pending slow and sampled spans, action=dump
+  // everything still in the rings
+  if (path.size() > 1 && path[0] == "admin" && path[1] == "trace") {
+    message.extract_string().then([=](utility::string_t body) {
+      TraceScope scope(span, true);
+      auto action = uri::split_query(body)["action"];
+      if (action == "flush") {
+        RequestTrace::flush();
+        replyAck(message, "trace flushed!");
+      }
+      else if (action == "dump") {
+        replyAck(message, std::to_string(RequestTrace::dump()) + " spans dumped!");
+      }
+      else {
+        reply(message, status_codes::BadRequest, "unknown trace action!");
+      }
+    });
+    return;
+  }
+  // action=start (CAPTURE_FILE is truncated) or action=stop
+  if (path.size() > 1 && path[0] == "admin" && path[1] == "capture") {
+    message.extract_string().then([=](utility::string_t body) {
+      TraceScope scope(span, true);
+      auto action = uri::split_query(body)["action"];
+      try {
+        if (action == "start") {
+          CaptureWriter::start();
+          replyAck(message, "capture started!");
+        }
+        else if (action == "stop") {
+          CaptureWriter::stop();
+          replyAck(message, "capture stopped!");
+        }
+        else {
+          reply(message, status_codes::BadRequest, "unknown capture action!");
+        }
+      }
+      catch(CaptureException & e) {
+        reply(message, status_codes::BadRequest, e.what());
+      }
+    });
+    return;
+  }
+  if (UserManager::getInstance().isReplica()) {
+    reply(message, status_codes::Forbidden, "read-only replica!");
+    return;
+  }
+  if (path.size() > 1 && path[0] == "user" && path[1] == "import") {
+    handleImport(message);
+    return;
+  }
+  if (path.size() > 1 && path[0] == "user") {
+    // rate limits are checked before anything of the body is parsed
+    bool limited = path[1] == "deal" || path[1] == "connected";
+    if (limited && !_clientLimiter.allow(message.remote_address())) {
+      reply(message, tooManyRequests, "client rate limit exceeded!");
+      return;
+    }
+    if (boost::starts_with(message.headers().content_type(), wire::contentType)) {
+      message.
+        extract_vector().
+        then([=](std::vector<unsigned char> request) {
+          TraceScope scope(span, true);
+          try {
+            wire::WireReader r(request.data(), request.size());
+            // deals come as Deal messages, every other user operation as User
+            bool deal = path[1] == "deal";
+            if (r.kind() != (deal ? wire::WireKind::Deal : wire::WireKind::User)) {
+              throw wire::WireFormatException("binary message kind doesn't match the request!");
+            }
+            if (limited) {
+              if (!_userLimiter.allow(r.text(deal ? wire::deal::id : wire::user::id))) {
+                reply(message, tooManyRequests, "user rate limit exceeded!");
+                return;
+              }
+            }
+            UserOpRequest op;
+            op.arrival = arrival;
+            if (deal) {
+              op.id = r.text(wire::deal::id);
+              op.amount = r.scalar<float>(wire::deal::amount);
+              op.time = r.scalar<uint64_t>(wire::deal::time);
+            }
+            else {
+              op.id = r.text(wire::user::id);
+              op.name = r.text(wire::user::name);
+              op.approximate = r.scalar<uint8_t>(wire::user::flags) & wire::user::approximate;
+            }
+            handleUserOp(message, path[1], op);
+          }
+          catch(std::exception& e) {
+            reply(message, status_codes::BadRequest, e.what());
+          }
+        }, HandlerExecutor::options());
+      return;
+    }
+
     message.
       extract_string().
       then([=](utility::string_t request) {
+          TraceScope scope(span, true);
+          if (limited && _userLimiter.enabled() && !_userLimiter.allow(formUserKey(request))) {
+            reply(message, tooManyRequests, "user rate limit exceeded!");
+            return;
+          }
 	  auto q = uri::split_query(request);
 	  try {
-	    if(path[1] == "registered") {
-	      UserManager::getInstance().registerUser(q["id"], q["name"]);
-	       
-	       json::value response;
-	       response["message"] = json::value::string(
-							"succesful registration!");
-	       message.reply(status_codes::OK, response);
-	    }
-	    else if(path[1] == "renamed") {
-	       
-	       UserManager::getInstance().hadnleUserRenamed(q["id"], q["name"]);
-	       
-	       json::value response;
-	       response["message"] = json::value::string(
-							"succesful rename!");
-	       message.reply(status_codes::OK, response);
-
-	    }
-	    else if(path[1] == "connected") {
-               std::string userId = q["id"];
-	       UserManager::getInstance().hadnleUserConnected(userId);
-	       json::value response;
-	       response["message"] = json::value::string(
-							"succesfuly connected!");
-               RatingRequest req;
-               req.userId = userId;
-               UserManager::getInstance().getRating(req);
-               auto i = 1;
-               std::vector<json::value> vals;
-               vals.reserve(req.topRated.size()); 
-               for(const auto& u : req.topRated) {
-                   json::value pos;
-                   pos["position"] = i;
-                   pos["name"] = json::value::string(u.second.name);
-                   pos["rating"] = u.second.totalRev;
-                   vals.push_back(pos);
-                   i++;
-               }
-
-	       response["top_rated"] = json::value::array(vals);
-
-               vals.clear();
-               vals.reserve(req.neighbours.size());
-               i = req.bestNeigbourPos;
-               for(const auto& u : req.neighbours) {
-                   json::value pos;
-                   pos["position"] = i;
-                   pos["name"] = json::value::string(u.second.name);
-                   pos["rating"] = u.second.totalRev;
-                   pos["is_current"] = u.second.id == userId;
-                   vals.push_back(pos);
-                   i++;
-               }
-               response["neigbour_list"] = json::value::array(vals);
-
-	       message.reply(status_codes::OK, response);
-
-	    }
-	    else if(path[1] == "disconnected") {
-	       UserManager::getInstance().hadnleUserDisconnected(q["id"]);
-	       
-	       json::value response;
-	       response["message"] = json::value::string(
-							"succesfuly disconnected!");
-	       message.reply(status_codes::OK, response);
-
-	    }
-	    else if(path[1] == "deal") {
-               Rating r {};
-	       std::string s = q["amount"];
-	       if (!s.empty())
-		 r = std::stof(s);
-	       
-	       uint64_t t {};
-	       s = q["time"];
-	       if (!s.empty())
-		 t = std::stoull(s);
-
-	       TimePoint tp {std::chrono::nanoseconds(t)};
-	       if (!t)
-		 tp = Clock::now();
-	       
-	       UserManager::getInstance().hadnleUserDial(q["id"], tp, r);
-	       
-	       json::value response;
-	       response["message"] = json::value::string(
-							"succesful deal!");
-	       message.reply(status_codes::OK, response);
-
-	    }
-	    else if(path[1] == "current") {
-	       UserManager::getInstance().hadnleUserSetCurrent(q["id"]);
-	       
-	       json::value response;
-	       response["message"] = json::value::string(
-							"succesful!");
-	       message.reply(status_codes::OK, response);
-
-	    }
-
-
+            UserOpRequest op;
+            op.arrival = arrival;
+            op.id = q["id"];
+            op.name = q["name"];
+            op.approximate = q["mode"] == "approx";
+	    std::string s = q["amount"];
+	    if (!s.empty())
+	      op.amount = std::stof(s);
+	    s = q["time"];
+	    if (!s.empty())
+	      op.time = std::stoull(s);
+            handleUserOp(message, path[1], op);
 	  }
 	  catch(UserManagerException & e) {
-	    message.reply(status_codes::BadRequest, e.what());
+	    reply(message, status_codes::BadRequest, e.what());
 	  }
 	  catch(std::exception& e) {
-	    message.reply(status_codes::BadRequest, e.what());
+	    reply(message, status_codes::BadRequest, e.what());
 	  }
-	});
+	}, HandlerExecutor::options());
+  }
+  else {
+    reply(message, status_codes::NotFound);
   }
 }
 
+void MicroserviceController::handleUserOp(http_request message, const std::string & what, const UserOpRequest & op) {
+    RequestTrace::setUser(op.id);
+    if (CaptureWriter::active())
+        captureUserOp(what, op);
+    if (what == "registered") {
+        UserManager::getInstance().registerUser(op.id, op.name);
+        replyAck(message, "succesful registration!");
+    }
+    else if (what == "renamed") {
+        UserManager::getInstance().hadnleUserRenamed(op.id, op.name);
+        replyAck(message, "succesful rename!");
+    }
+    else if (what == "deregistered") {
+        UserManager::getInstance().deregisterUser(op.id);
+        replyAck(message, "succesful deregistration!");
+    }
+    else if (what == "connected") {
+        UserManager::getInstance().hadnleUserConnected(op.id);
+        RatingRequest req;
+        req.userId = op.id;
+        req.approximate = op.approximate;
+        UserManager::getInstance().getRating(req);
+        if (acceptsBinary(message)) {
+            replyBinary(message, wire::encodeRating(req));
+            return;
+        }
+        json::value response;
+        response["message"] = json::value::string("succesfuly connected!");
+        ratingResponse(req, response);
+        reply(message, status_codes::OK, response);
+    }
+    else if (what == "disconnected") {
+        UserManager::getInstance().hadnleUserDisconnected(op.id);
+        replyAck(message, "succesfuly disconnected!");
+    }
+    else if (what == "deal") {
+        TimePoint tp {std::chrono::nanoseconds(op.time)};
+        if (!op.time)
+            tp = Clock::now();
+        UserManager::getInstance().hadnleUserDial(op.id, tp, op.amount);
+        replyAck(message, "succesful deal!");
+    }
+    else if (what == "current") {
+        UserManager::getInstance().hadnleUserSetCurrent(op.id);
+        replyAck(message, "succesful!");
+    }
+    else {
+        reply(message, status_codes::NotFound);
+    }
+}
+
+bool MicroserviceController::acceptsBinary(const http_request & message) {
+    auto accept = message.headers().find("Accept");
+    return accept != message.headers().end() &&
+        accept->second.find(wire::contentType) != utility::string_t::npos;
+}
+
+void MicroserviceController::replyBinary(http_request message, const std::vector<unsigned char> & body) {
+    http_response response(status_codes::OK);
+    response.set_body(body);
+    response.headers().set_content_type(wire::contentType);
+    reply(message, response);
+}
+
+void MicroserviceController::replyAck(http_request message, const std::string & text) {
+    if (acceptsBinary(message)) {
+        replyBinary(message, wire::encodeAck(text));
+        return;
+    }
+    json::value response;
+    response["message"] = json::value::string(text);
+    reply(message, status_codes::OK, response);
+}
+
 
 void MicroserviceController::handleDelete(http_request message) {    
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::DEL));
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::DEL));
 }
 
 void MicroserviceController::handleHead(http_request message) {
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::HEAD));
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::HEAD));
 }
 
 void MicroserviceController::handleOptions(http_request message) {
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::OPTIONS));
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::OPTIONS));
 }
 
 void MicroserviceController::handleTrace(http_request message) {
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::TRCE));
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::TRCE));
 }
 
 void MicroserviceController::handleConnect(http_request message) {
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::CONNECT));
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::CONNECT));
 }
 
 void MicroserviceController::handleMerge(http_request message) {
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::MERGE));
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::MERGE));
 }
 
 json::value MicroserviceController::responseNotImpl(const http::method & method) {
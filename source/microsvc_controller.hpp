@@ -26,13 +26,30 @@
 
 #pragma once 
 
+#include <map>
+#include <mutex>
+
 #include <basic_controller.hpp>
+#include <rate_limiter.hpp>
+
+#include "traffic_capture.hpp"
+#include "user_manager.hpp"
 
 using namespace cfx;
 
+// Fields of a /user/* request, whatever encoding it came in
+struct UserOpRequest {
+    std::string id;
+    std::string name;
+    Rating amount = 0;
+    uint64_t time = 0;          // ns since epoch, 0 for "now"
+    bool approximate = false;   // approximate rating on connect
+    uint64_t arrival = 0;       // CaptureWriter::stamp() when the request came in
+};
+
 class MicroserviceController : public BasicController, Controller {
 public:
-    MicroserviceController() : BasicController() {}
+    MicroserviceController();
     ~MicroserviceController() {}
     void handleGet(http_request message) override;
     void handlePut(http_request message) override;
@@ -46,6 +63,45 @@ public:
     void handleMerge(http_request message) override;
     void initRestOpHandlers() override;    
 
+    // Serializes the top lists of the week and of every rating window
+    // ahead of the first request for them
+    void warmUp();
+
 private:
+    // Body of a /rating/top reply in both encodings, made once per rank
+    // snapshot (by version, not by pointer, so an outdated snapshot isn't
+    // kept alive by it) and top size
+    struct TopResponse {
+        uint64_t version = 0;
+        uint32_t bucket = 0;
+        size_t topNum = 0;
+        std::string json;
+        std::vector<unsigned char> binary;
+    };
+    std::mutex _topMutex;
+    std::map<std::string, std::shared_ptr<const TopResponse>> _topResponses;  // by rating window
+
+    std::shared_ptr<const TopResponse> topResponse(const RatingRequest & req);
+
+    // Deals and connects are limited per user id (RATE_LIMIT_USER_*) and
+    // per client address (RATE_LIMIT_CLIENT_*), both off unless configured.
+    // Behind a router all requests come from the router, so the client
+    // limit belongs there.
+    RateLimiter _userLimiter;
+    RateLimiter _clientLimiter;
+
+    void routeGet(http_request message, uint64_t arrival);
+    void handleUserOp(http_request message, const std::string & what, const UserOpRequest & op);
+    void handleImport(http_request message);
+    void handleRating(http_request message, const std::string & what, uint64_t arrival);
+    void handlePartialRating(http_request message);
+    void handlePercentiles(http_request message);
+    void handleArchive(http_request message, const std::string & what);
+    void handleLockProfile(http_request message);
+    static void ratingResponse(const RatingRequest & req, json::value & response);
+    static json::value archivedEntries(const std::vector<ArchivedEntry> & entries);
+    static bool acceptsBinary(const http_request & message);
+    static void replyBinary(http_request message, const std::vector<unsigned char> & body);
+    static void replyAck(http_request message, const std::string & text);
     static json::value responseNotImpl(const http::method & method);
 };
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+#include "rating_windows.hpp"
+
+RatingWindows RatingWindows::fromEnvironment() {
+  RatingWindows w;
+  if (const char* env_p = std::getenv("RATING_WINDOW_BUCKET")) {
+    int64_t sec = parseSeconds(env_p);
+    if (sec > 0)
+      w.bucketSec = sec;
+    else
+      std::cout << "Bad rating window bucket: " << env_p << '\n';
+  }
+
+  std::string list = "24h,7d";
+  if (const char* env_p = std::getenv("RATING_WINDOWS"))
+    list = env_p;
+  std::istringstream in(list);
+  std::string name;
+  while (std::getline(in, name, ',')) {
+    if (name.empty())
+      continue;
+    int64_t sec = parseSeconds(name);
+    // a window is at least one bucket, partial buckets round up
+    int64_t len = (sec + w.bucketSec - 1) / w.bucketSec;
+    if (sec <= 0 || len > maxHorizon) {
+      std::cout << "Bad rating window: " << name << '\n';
+      continue;
+    }
+    if (w.names.size() == maxWindows) {
+      std::cout << "Too many rating windows, " << name << " is ignored\n";
+      continue;
+    }
+    w.names.push_back(name);
+    w.lengths.push_back(static_cast<uint32_t>(len));
+    w.horizon = std::max(w.horizon, static_cast<uint32_t>(len));
+  }
+  return w;
+}
+
+int RatingWindows::find(const std::string& name) const {
+  auto it = std::find(names.begin(), names.end(), name);
+  return it == names.end() ? -1 : int(it - names.begin());
+}
+
+int64_t RatingWindows::parseSeconds(const std::string& len) {
+  if (len.size() < 2)
+    return 0;
+  int64_t unit;
+  switch (len.back()) {
+    case 'm': unit = 60; break;
+    case 'h': unit = 3600; break;
+    case 'd': unit = 24 * 3600; break;
+    default: return 0;
+  }
+  try {
+    size_t used = 0;
+    int64_t n = std::stoll(len.substr(0, len.size() - 1), &used);
+    return used == len.size() - 1 && n > 0 ? n * unit : 0;
+  }
+  catch (std::exception&) {
+    return 0;
+  }
+}
+
+void WindowedRevenue::advance(const RatingWindows& w, uint32_t now) {
+  if (ring.empty())
+    return;
+  size_t drop = ring.size();
+  for (size_t i = 0; i < w.lengths.size(); i++) {
+    uint32_t len = w.lengths[i];
+    while (expired[i] < ring.size() && ring[expired[i]].index + len <= now) {
+      totals[i] -= ring[expired[i]].amount;
+      expired[i]++;
+    }
+    // no drift of float subtractions survives an empty window
+    if (expired[i] == ring.size())
+      totals[i] = 0;
+    drop = std::min<size_t>(drop, expired[i]);
+  }
+  if (!drop)
+    return;
+  // what the longest window let go of isn't needed by any window
+  if (drop == ring.size()) {
+    std::vector<Bucket>().swap(ring);
+  }
+  else {
+    ring.erase(ring.begin(), ring.begin() + drop);
+  }
+  for (size_t i = 0; i < w.lengths.size(); i++)
+    expired[i] -= drop;
+}
+
+bool WindowedRevenue::add(const RatingWindows& w, uint32_t now, uint32_t bucket, Rating amount) {
+  bucket = std::min(bucket, now);
+  if (!w.horizon || bucket + w.horizon <= now)
+    return false;
+
+  // deals mostly land in the newest bucket, so the search starts there
+  size_t pos = ring.size();
+  while (pos > 0 && ring[pos - 1].index > bucket)
+    pos--;
+  bool merged = pos > 0 && ring[pos - 1].index == bucket;
+  if (merged) {
+    ring[pos - 1].amount += amount;
+  }
+  else {
+    Bucket b;
+    b.index = bucket;
+    b.amount = amount;
+    ring.insert(ring.begin() + pos, b);
+  }
+
+  for (size_t i = 0; i < w.lengths.size(); i++) {
+    if (bucket + w.lengths[i] > now)
+      totals[i] += amount;
+    else if (!merged)
+      expired[i]++;   // sorts among the buckets the window let go of
+  }
+  return true;
+}
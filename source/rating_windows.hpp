@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using Rating = float;
+
+// Rolling rating windows next to the calendar week, e.g. "24h,7d".
+//
+// Time is cut into buckets of [bucketSec] (an hour by default) counted from
+// the epoch, and a window is a whole number of them ending with the current
+// bucket, so a window slides forward one bucket at a time.
+struct RatingWindows {
+  static const size_t maxWindows = 4;
+  static const uint32_t maxHorizon = 0xFFFF;   // buckets of the longest window
+
+  int64_t bucketSec = 3600;
+  std::vector<std::string> names;
+  std::vector<uint32_t> lengths;               // in buckets
+  uint32_t horizon = 0;                        // longest of [lengths]
+
+  // RATING_WINDOWS=<len>[,<len>...] (default "24h,7d", empty: none), a
+  // length being a number with m, h or d; RATING_WINDOW_BUCKET=<len>
+  static RatingWindows fromEnvironment();
+
+  // Index of window [name], -1 if there is no such window
+  int find(const std::string& name) const;
+
+  uint32_t bucketOf(int64_t ns) const {
+    return ns > 0 ? static_cast<uint32_t>(ns / 1000000000 / bucketSec) : 0;
+  }
+
+  int64_t bucketStartNs(uint32_t bucket) const {
+    return int64_t(bucket) * bucketSec * 1000000000;
+  }
+
+  // "90m" -> 5400, 0 if unparsable
+  static int64_t parseSeconds(const std::string& len);
+};
+
+// Revenue of one user per bucket plus a running total per window.
+//
+// Only buckets with deals are kept, oldest first, and a bucket is dropped
+// once it left the longest window, so a user holds at most [horizon] of
+// them and an idle one none at all. Each window counts how many of the
+// oldest buckets it has already let go of; catching up with the clock
+// subtracts just the buckets that left since, and a deal adds to every
+// window it falls into. Either way nothing is summed over the whole ring.
+class WindowedRevenue {
+public:
+  struct Bucket {
+    uint32_t index;
+    Rating amount;
+  };
+
+  // Lets go of the buckets that left the windows by bucket [now]
+  void advance(const RatingWindows& w, uint32_t now);
+
+  // Adds [amount] to bucket [bucket] (at most [now]), false if it is older
+  // than the longest window. advance() must have been called for [now].
+  bool add(const RatingWindows& w, uint32_t now, uint32_t bucket, Rating amount);
+
+  // Revenue in window [window] as of the last advance()
+  Rating total(size_t window) const { return totals[window]; }
+
+  const std::vector<Bucket>& buckets() const { return ring; }
+
+private:
+  std::vector<Bucket> ring;
+  Rating totals[RatingWindows::maxWindows] = {};
+  uint16_t expired[RatingWindows::maxWindows] = {};   // leading buckets outside the window
+};
@@ -0,0 +1,339 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sys/socket.h>
+
+#include <cpu_placement.hpp>
+#include "replication.hpp"
+
+using boost::asio::ip::tcp;
+
+namespace {
+    const size_t maxFollowerQueue = 1 << 20;
+    const uint32_t maxFrameSize = 1 << 20;
+
+    int64_t wallClockNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    template <typename T>
+    void put(std::string& out, const T& v) {
+        out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    void putString(std::string& out, const std::string& s) {
+        put(out, static_cast<uint32_t>(s.size()));
+        out += s;
+    }
+
+    template <typename T>
+    T get(const std::string& in, size_t& pos) {
+        if (pos + sizeof(T) > in.size()) {
+            throw ReplicationException("truncated replication frame!");
+        }
+        T v;
+        std::memcpy(&v, in.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+    }
+
+    std::string getString(const std::string& in, size_t& pos) {
+        uint32_t len = get<uint32_t>(in, pos);
+        if (pos + len > in.size()) {
+            throw ReplicationException("truncated replication frame!");
+        }
+        std::string s(in, pos, len);
+        pos += len;
+        return s;
+    }
+
+    // Length-prefixed frame: u32 length, then the mutation fields in order
+    std::shared_ptr<std::string> encode(const Mutation& m) {
+        std::shared_ptr<std::string> frame = std::make_shared<std::string>();
+        frame->reserve(60 + m.id.size() + m.name.size());
+        put(*frame, uint32_t(0));
+        put(*frame, m.seq);
+        put(*frame, m.stamp);
+        put(*frame, static_cast<uint8_t>(m.type));
+        put(*frame, static_cast<uint8_t>(m.connected));
+        put(*frame, m.revenue);
+        put(*frame, m.lastDeal);
+        put(*frame, m.amount);
+        put(*frame, m.dealAt);
+        putString(*frame, m.id);
+        putString(*frame, m.name);
+        uint32_t len = frame->size() - sizeof(uint32_t);
+        std::memcpy(&(*frame)[0], &len, sizeof(len));
+        return frame;
+    }
+
+    Mutation decode(const std::string& in) {
+        size_t pos = 0;
+        Mutation m;
+        m.seq = get<uint64_t>(in, pos);
+        m.stamp = get<int64_t>(in, pos);
+        m.type = static_cast<MutationType>(get<uint8_t>(in, pos));
+        m.connected = get<uint8_t>(in, pos) != 0;
+        m.revenue = get<float>(in, pos);
+        m.lastDeal = get<int64_t>(in, pos);
+        m.amount = get<float>(in, pos);
+        m.dealAt = get<int64_t>(in, pos);
+        m.id = getString(in, pos);
+        m.name = getString(in, pos);
+        return m;
+    }
+}
+
+struct ReplicationLeader::Follower {
+  explicit Follower(boost::asio::io_service& ios) : socket(ios) {}
+
+  tcp::socket socket;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::deque<std::shared_ptr<std::string>> queue;
+  bool closed = false;
+  std::thread sender;
+
+  void send() {
+    cfx::CpuPlacement::placeBackgroundThread("replication sender");
+    std::deque<std::shared_ptr<std::string>> batch;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock { mutex };
+        cond.wait(lock, [this] { return closed || !queue.empty(); });
+        if (closed)
+          break;
+        batch.swap(queue);
+      }
+      std::vector<boost::asio::const_buffer> buffers;
+      buffers.reserve(batch.size());
+      for (const auto& f : batch)
+        buffers.push_back(boost::asio::buffer(*f));
+      boost::system::error_code ec;
+      boost::asio::write(socket, buffers, ec);
+      batch.clear();
+      if (ec) {
+        std::unique_lock<std::mutex> lock { mutex };
+        closed = true;
+        break;
+      }
+    }
+    boost::system::error_code ec;
+    socket.close(ec);
+  }
+};
+
+ReplicationLeader::ReplicationLeader(unsigned short port, cfx::ProfiledMutex& stateMutex, SnapshotFn snapshot) :
+  stateMutex(stateMutex), snapshot(snapshot), seq(0), stop(false),
+  acceptor(ios, tcp::endpoint(tcp::v4(), port)) {
+  acceptThread = std::thread([this] { acceptLoop(); });
+  heartbeatThread = std::thread([this] { heartbeatLoop(); });
+  std::cout << "Replication leader listening on port " << port << '\n';
+}
+
+ReplicationLeader::~ReplicationLeader() {
+  stop = true;
+  ::shutdown(acceptor.native_handle(), SHUT_RDWR);
+  acceptThread.join();
+  heartbeatThread.join();
+
+  std::unique_lock<std::mutex> lock { followersMutex };
+  for (auto& f : followers) {
+    {
+      std::unique_lock<std::mutex> flock { f->mutex };
+      f->closed = true;
+    }
+    f->cond.notify_one();
+    ::shutdown(f->socket.native_handle(), SHUT_RDWR);
+    f->sender.join();
+  }
+}
+
+void ReplicationLeader::acceptLoop() {
+  cfx::CpuPlacement::placeBackgroundThread("replication accept");
+  while (!stop) {
+    std::shared_ptr<Follower> f = std::make_shared<Follower>(ios);
+    boost::system::error_code ec;
+    acceptor.accept(f->socket, ec);
+    if (ec) {
+      // a closed listener ends the loop, other errors (out of descriptors)
+      // are waited out instead of retried in a spin
+      if (stop || !acceptor.is_open())
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      continue;
+    }
+    f->socket.set_option(tcp::no_delay(true), ec);
+    f->sender = std::thread([f] { f->send(); });
+
+    // the snapshot and the registration happen in one critical section
+    // with every publish(), so the follower neither misses nor repeats
+    // a mutation
+    std::unique_lock<cfx::ProfiledMutex> state { stateMutex.as("replicationSnapshot") };
+    Mutation begin;
+    begin.type = MutationType::SnapshotBegin;
+    begin.seq = seq;
+    begin.stamp = wallClockNs();
+    {
+      std::unique_lock<std::mutex> flock { f->mutex };
+      f->queue.push_back(encode(begin));
+      for (auto& m : snapshot()) {
+        m.seq = begin.seq;
+        m.stamp = begin.stamp;
+        f->queue.push_back(encode(m));
+      }
+    }
+    f->cond.notify_one();
+    std::unique_lock<std::mutex> lock { followersMutex };
+    followers.push_back(f);
+    std::cout << "Replication follower attached, " << followers.size() << " in total" << std::endl;
+  }
+}
+
+void ReplicationLeader::heartbeatLoop() {
+  cfx::CpuPlacement::placeBackgroundThread("replication heartbeat");
+  while (!stop) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    // taken with the state lock like publish(), so the heartbeat never
+    // overtakes the mutation its sequence number stands for
+    {
+      std::unique_lock<cfx::ProfiledMutex> state { stateMutex.as("replicationHeartbeat") };
+      Mutation hb;
+      hb.type = MutationType::Heartbeat;
+      hb.seq = seq;
+      hb.stamp = wallClockNs();
+      enqueue(encode(hb));
+    }
+
+    // reap followers whose link broke or who fell too far behind
+    std::unique_lock<std::mutex> lock { followersMutex };
+    for (auto it = followers.begin(); it != followers.end(); ) {
+      bool closed;
+      {
+        std::unique_lock<std::mutex> flock { (*it)->mutex };
+        closed = (*it)->closed;
+      }
+      if (closed) {
+        ::shutdown((*it)->socket.native_handle(), SHUT_RDWR);
+        (*it)->sender.join();
+        it = followers.erase(it);
+        std::cout << "Replication follower detached, " << followers.size() << " left" << std::endl;
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+}
+
+void ReplicationLeader::enqueue(const std::shared_ptr<std::string>& frame) {
+  std::unique_lock<std::mutex> lock { followersMutex };
+  for (auto& f : followers) {
+    {
+      std::unique_lock<std::mutex> flock { f->mutex };
+      if (f->closed)
+        continue;
+      if (f->queue.size() >= maxFollowerQueue) {
+        f->closed = true;
+      }
+      else {
+        f->queue.push_back(frame);
+      }
+    }
+    f->cond.notify_one();
+  }
+}
+
+void ReplicationLeader::publish(Mutation m) {
+  m.seq = ++seq;
+  m.stamp = wallClockNs();
+  enqueue(encode(m));
+}
+
+ReplicationStatus ReplicationLeader::status() {
+  ReplicationStatus s;
+  s.role = "leader";
+  s.linked = true;
+  s.appliedSeq = s.leaderSeq = seq;
+  std::unique_lock<std::mutex> lock { followersMutex };
+  s.followers = followers.size();
+  return s;
+}
+
+ReplicationFollower::ReplicationFollower(const std::string& host, const std::string& port, ApplyFn apply) :
+  host(host), port(port), apply(apply), stop(false) {
+  current.role = "follower";
+  thread = std::thread([this] { run(); });
+  std::cout << "Replication follower of " << host << ":" << port << '\n';
+}
+
+ReplicationFollower::~ReplicationFollower() {
+  stop = true;
+  {
+    std::unique_lock<std::mutex> lock { socketMutex };
+    if (socketFd >= 0)
+      ::shutdown(socketFd, SHUT_RDWR);
+  }
+  thread.join();
+}
+
+void ReplicationFollower::run() {
+  cfx::CpuPlacement::placeBackgroundThread("replication follower");
+  while (!stop) {
+    try {
+      boost::asio::io_service ios;
+      tcp::resolver resolver(ios);
+      tcp::socket socket(ios);
+      boost::asio::connect(socket, resolver.resolve(tcp::resolver::query(host, port)));
+      {
+        std::unique_lock<std::mutex> lock { socketMutex };
+        socketFd = socket.native_handle();
+      }
+      {
+        std::unique_lock<std::mutex> lock { statusMutex };
+        current.linked = true;
+      }
+
+      std::string frame;
+      while (!stop) {
+        uint32_t len;
+        boost::asio::read(socket, boost::asio::buffer(&len, sizeof(len)));
+        if (len > maxFrameSize) {
+          throw ReplicationException("oversized replication frame!");
+        }
+        frame.resize(len);
+        boost::asio::read(socket, boost::asio::buffer(&frame[0], len));
+        Mutation m = decode(frame);
+        if (m.type != MutationType::Heartbeat)
+          apply(m);
+
+        std::unique_lock<std::mutex> lock { statusMutex };
+        // a heartbeat only tells how far the leader is
+        if (m.type != MutationType::Heartbeat)
+          current.appliedSeq = m.seq;
+        current.leaderSeq = std::max(current.leaderSeq, m.seq);
+        current.lagMs = (wallClockNs() - m.stamp) / 1000000;
+      }
+    }
+    catch (std::exception& e) {
+      if (!stop)
+        std::cout << "Replication link lost: " << e.what() << std::endl;
+    }
+    {
+      std::unique_lock<std::mutex> lock { socketMutex };
+      socketFd = -1;
+    }
+    {
+      std::unique_lock<std::mutex> lock { statusMutex };
+      current.linked = false;
+    }
+    for (int i = 0; i < 10 && !stop; i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+ReplicationStatus ReplicationFollower::status() {
+  std::unique_lock<std::mutex> lock { statusMutex };
+  return current;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <profiled_mutex.hpp>
+
+enum class MutationType : uint8_t {
+  SnapshotBegin = 1, // follower drops its state, full user records follow
+  Upsert,            // full user record
+  Rename,
+  Connect,
+  Disconnect,
+  Deal,              // new weekly revenue and last deal time of the user, plus the
+                     // deal itself for the rolling windows
+  Remove,
+  Heartbeat          // no change, carries the leader's last sequence number
+};
+
+struct Mutation {
+  uint64_t seq = 0;        // position in the leader's log
+  int64_t stamp = 0;       // leader wall clock (ns) when the mutation was logged
+  MutationType type = MutationType::Heartbeat;
+  bool connected = false;
+  float revenue = 0;
+  int64_t lastDeal = 0;    // ns since epoch
+  float amount = 0;        // Deal: amount of the deal
+  int64_t dealAt = 0;      // Deal: time of the deal, ns since epoch
+  std::string id;
+  std::string name;
+};
+
+struct ReplicationStatus {
+  std::string role;        // "leader", "follower" or "standalone"
+  bool linked = false;     // follower: connected to the leader
+  size_t followers = 0;    // leader: number of attached followers
+  uint64_t appliedSeq = 0; // last sequence number logged (leader) or applied (follower)
+  uint64_t leaderSeq = 0;  // last sequence number known to the leader
+  int64_t lagMs = 0;       // follower: delay between logging and applying the last received frame
+};
+
+class ReplicationException : public std::exception {
+  std::string _message;
+public:
+  ReplicationException(const std::string & message) :
+    _message(message) { }
+  const char * what() const throw() {
+    return _message.c_str();
+  }
+};
+
+// Ships the ordered mutation log to followers over TCP.
+//
+// Every frame is a 32-bit length followed by the encoded mutation. A new
+// follower first gets SnapshotBegin plus one Upsert per user, taken under
+// the state lock together with its registration, then every mutation
+// published after that. A follower whose queue overflows is dropped and
+// starts over with a fresh snapshot when it reconnects.
+class ReplicationLeader {
+public:
+  using SnapshotFn = std::function<std::vector<Mutation>()>;
+
+  // [snapshot] is called with [stateMutex] held
+  ReplicationLeader(unsigned short port, cfx::ProfiledMutex& stateMutex, SnapshotFn snapshot);
+  ~ReplicationLeader();
+
+  // Appends [m] to the log, the caller holds the state lock
+  void publish(Mutation m);
+
+  ReplicationStatus status();
+
+private:
+  struct Follower;
+
+  void acceptLoop();
+  void heartbeatLoop();
+  void enqueue(const std::shared_ptr<std::string>& frame);
+
+  cfx::ProfiledMutex& stateMutex;
+  SnapshotFn snapshot;
+  std::atomic<uint64_t> seq;
+  std::atomic<bool> stop;
+
+  boost::asio::io_service ios;
+  boost::asio::ip::tcp::acceptor acceptor;
+
+  std::mutex followersMutex;
+  std::list<std::shared_ptr<Follower>> followers;
+
+  std::thread acceptThread;
+  std::thread heartbeatThread;
+};
+
+// Follows a leader, handing every received mutation to [apply] in log order
+// and reconnecting (for a fresh snapshot) whenever the link breaks.
+class ReplicationFollower {
+public:
+  using ApplyFn = std::function<void(const Mutation&)>;
+
+  ReplicationFollower(const std::string& host, const std::string& port, ApplyFn apply);
+  ~ReplicationFollower();
+
+  ReplicationStatus status();
+
+private:
+  void run();
+
+  std::string host;
+  std::string port;
+  ApplyFn apply;
+  std::atomic<bool> stop;
+
+  std::mutex statusMutex;
+  ReplicationStatus current;
+
+  std::mutex socketMutex;
+  int socketFd = -1;
+
+  std::thread thread;
+};
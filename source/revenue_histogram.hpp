@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Log-bucketed distribution of weekly revenue.
+//
+// Bucket 0 holds users without revenue, the rest split every power of two
+// in [2^minExp, 2^maxExp) into subBuckets geometric slices, so a bucket is
+// about 19% wide whatever the magnitude. All queries walk a fixed number of
+// buckets and cost the same regardless of the number of users.
+class RevenueHistogram {
+public:
+  static const int minExp = -16;
+  static const int maxExp = 48;
+  static const int subBuckets = 4;
+  static const int bucketsNum = 1 + (maxExp - minExp) * subBuckets;
+
+  RevenueHistogram() { counts.fill(0); }
+
+  void add(float rev) {
+    counts[bucketOf(rev)]++;
+    total++;
+  }
+
+  void remove(float rev) {
+    counts[bucketOf(rev)]--;
+    total--;
+  }
+
+  void move(float from, float to) {
+    int a = bucketOf(from), b = bucketOf(to);
+    if (a != b) {
+      counts[a]--;
+      counts[b]++;
+    }
+  }
+
+  // Every user drops back to zero revenue (week rollover)
+  void reset() {
+    counts.fill(0);
+    counts[0] = total;
+  }
+
+  uint64_t size() const { return total; }
+
+  // Estimated 1-based position of a user with [rev]: all users in higher
+  // buckets plus half of the users sharing the bucket
+  uint64_t approxRank(float rev) const {
+    int b = bucketOf(rev);
+    uint64_t above = 0;
+    for (int i = bucketsNum - 1; i > b; i--)
+      above += counts[i];
+    return above + counts[b] / 2 + 1;
+  }
+
+  // Estimated revenue at percentile [p] in [0, 100], i.e. p% of users have
+  // at most this revenue; the geometric middle of the matching bucket
+  float percentile(double p) const {
+    if (!total)
+      return 0;
+    uint64_t target = static_cast<uint64_t>(std::ceil(p / 100.0 * total));
+    uint64_t seen = 0;
+    for (int i = 0; i < bucketsNum; i++) {
+      seen += counts[i];
+      if (seen >= target && counts[i])
+        return bucketValue(i);
+    }
+    return bucketValue(bucketsNum - 1);
+  }
+
+private:
+  static int bucketOf(float rev) {
+    if (!(rev > 0))
+      return 0;
+    int e;
+    double m = std::frexp(rev, &e); // rev = m * 2^e, m in [0.5, 1)
+    e -= 1;
+    if (e < minExp)
+      return 1;
+    if (e >= maxExp)
+      return bucketsNum - 1;
+    int sub = static_cast<int>(std::log2(m * 2) * subBuckets);
+    return 1 + (e - minExp) * subBuckets + std::min(sub, subBuckets - 1);
+  }
+
+  static float bucketValue(int b) {
+    if (b == 0)
+      return 0;
+    double e = minExp + (b - 1 + 0.5) / subBuckets;
+    return static_cast<float>(std::exp2(e));
+  }
+
+  std::array<uint64_t, bucketsNum> counts;
+  uint64_t total = 0;
+};
@@ -0,0 +1,403 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include <std_micro_service.hpp>
+#include <cpu_placement.hpp>
+#include "router_controller.hpp"
+#include "wire_format.hpp"
+
+using namespace web;
+using namespace http;
+using namespace http::client;
+
+namespace {
+    const int virtualNodes = 64;
+    const size_t defaultTopNum = 10;
+    const size_t nearNum = 10;
+
+    uint64_t fnv1a(const std::string & s) {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : s) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    struct RatedUser {
+        std::string id;
+        std::string name;
+        double rating;
+    };
+
+    std::vector<RatedUser> ratedUsers(const json::value & parts, const std::string & field) {
+        std::vector<RatedUser> res;
+        for (const auto & part : parts.as_array()) {
+            if (!part.has_field(field))
+                continue;
+            for (const auto & u : part.at(field).as_array()) {
+                RatedUser r;
+                r.id = u.at("id").as_string();
+                r.name = u.at("name").as_string();
+                r.rating = u.at("rating").as_double();
+                res.push_back(r);
+            }
+        }
+        return res;
+    }
+
+    bool higherRated(const RatedUser & a, const RatedUser & b) {
+        return a.rating > b.rating;
+    }
+
+    json::value position(size_t pos, const RatedUser & u) {
+        json::value p;
+        p["position"] = json::value::number(static_cast<uint64_t>(pos));
+        p["name"] = json::value::string(u.name);
+        p["rating"] = u.rating;
+        return p;
+    }
+
+    // A partition turned the request down (4xx), its answer is the client's
+    class PartitionRejection : public std::exception {
+        status_code _status;
+        std::string _message;
+        std::string _contentType;
+    public:
+        PartitionRejection(status_code status, const std::string & message, const std::string & contentType) :
+            _status(status), _message(message), _contentType(contentType) { }
+        const char * what() const throw() {
+            return _message.c_str();
+        }
+        status_code status() const { return _status; }
+        const std::string & contentType() const { return _contentType; }
+    };
+
+    // Reads the whole reply of a partition, failing on anything but 200:
+    // with the partition's answer on a client error, as a gateway failure
+    // otherwise
+    pplx::task<json::value> partitionJson(http_response r) {
+        auto status = r.status_code();
+        if (status != status_codes::OK) {
+            auto type = r.headers().content_type();
+            return r.extract_string(true).then([=](utility::string_t body) -> json::value {
+                if (status >= 400 && status < 500)
+                    throw PartitionRejection(status, body, type);
+                throw http_exception(body);
+            });
+        }
+        return r.extract_json(true);
+    }
+}
+
+RouterController::RouterController(const std::vector<std::string> & partitions) : BasicController() {
+    if (partitions.empty()) {
+        throw std::invalid_argument("no partitions to route to!");
+    }
+    for (size_t i = 0; i < partitions.size(); i++) {
+        _partitions.push_back(http_client(uri(partitions[i])));
+        for (int v = 0; v < virtualNodes; v++) {
+            _ring[fnv1a(partitions[i] + "#" + std::to_string(v))] = i;
+        }
+    }
+}
+
+void RouterController::initRestOpHandlers() {
+    support(methods::GET, std::bind(&RouterController::handleGet, this, std::placeholders::_1));
+    support(methods::PUT, std::bind(&RouterController::handlePut, this, std::placeholders::_1));
+    support(methods::POST, std::bind(&RouterController::handlePost, this, std::placeholders::_1));
+    support(methods::DEL, std::bind(&RouterController::handleDelete, this, std::placeholders::_1));
+    support(methods::PATCH, std::bind(&RouterController::handlePatch, this, std::placeholders::_1));
+}
+
+http_client & RouterController::owner(const std::string & userId) {
+    auto it = _ring.lower_bound(fnv1a(userId));
+    if (it == _ring.end())
+        it = _ring.begin();
+    return _partitions[it->second];
+}
+
+void RouterController::replyWith(http_request message, pplx::task<void> done) {
+    auto span = RequestTrace::current();
+    done.then([=](pplx::task<void> t) {
+        TraceScope scope(span);
+        try {
+            t.get();
+        }
+        catch(PartitionRejection & e) {
+            reply(message, e.status(), std::string(e.what()), e.contentType());
+        }
+        catch(std::exception & e) {
+            reply(message, status_codes::BadGateway, e.what());
+        }
+    });
+}
+
+void RouterController::handleGet(http_request message) {
+    CpuPlacement::placeIoThread();
+    auto path = requestPath(message);
+    auto span = RequestTrace::current();
+    if (path.size() < 2) {
+        reply(message, status_codes::NotFound);
+        return;
+    }
+    if (path[0] == "service" && path[1] == "test") {
+        auto response = json::value::object();
+        response["version"] = json::value::string("0.1.1");
+        response["status"] = json::value::string("ready!");
+        response["partitions"] = json::value::number(static_cast<uint64_t>(_partitions.size()));
+        reply(message, status_codes::OK, response);
+        return;
+    }
+    if (path[0] == "service" && path[1] == "ready") {
+        replyReadiness(message);
+        return;
+    }
+    if (path[0] != "rating" || (path[1] != "top" && path[1] != "user")) {
+        reply(message, status_codes::NotFound);
+        return;
+    }
+
+    auto q = uri::split_query(message.request_uri().query());
+    size_t topNum = defaultTopNum;
+    try {
+        if (!q["n"].empty())
+            topNum = std::stoul(q["n"]);
+    }
+    catch(std::exception & e) {
+        reply(message, status_codes::BadRequest, e.what());
+        return;
+    }
+
+    if (path[1] == "top") {
+        replyWith(message, mergedRating("", json::value::null(), topNum).then([=](json::value response) {
+            TraceScope scope(span);
+            reply(message, status_codes::OK, response);
+        }));
+        return;
+    }
+
+    // Only the owner knows the revenue of the user, and every partition
+    // needs it to count the users above and pick the neighbours, so the
+    // scatter follows the owner's answer: two round trips where a top list
+    // takes one. A connect gets the revenue from the forwarded connect
+    // itself and adds no lookup.
+    std::string userId = q["id"];
+    auto lookup = owner(userId).request(methods::GET, "/rating/user?id=" + uri::encode_data_string(userId));
+    replyWith(message, lookup.then([](http_response r) { return partitionJson(r); }).then([=](json::value own) {
+        return mergedRating(userId, own, topNum);
+    }).then([=](json::value response) {
+        TraceScope scope(span);
+        reply(message, status_codes::OK, response);
+    }));
+}
+
+void RouterController::handlePost(http_request message) {
+    CpuPlacement::placeIoThread();
+    auto path = requestPath(message);
+    if (path.size() < 2 || path[0] != "user") {
+        reply(message, status_codes::NotFound);
+        return;
+    }
+    std::string op = path[1];
+    // the rows of an import belong to any number of partitions
+    if (op == "import") {
+        reply(message, status_codes::BadRequest, "import into every partition directly, not through the router!");
+        return;
+    }
+    auto contentType = message.headers().content_type();
+    bool binary = boost::starts_with(contentType, wire::contentType);
+    auto span = RequestTrace::current();
+
+    replyWith(message, message.extract_vector().then([=](std::vector<unsigned char> body) -> pplx::task<void> {
+        TraceScope scope(span);
+        // the partition is picked by the user, wherever the encoding keeps it
+        std::string userId;
+        try {
+            if (binary) {
+                wire::WireReader r(body.data(), body.size());
+                userId = r.text(r.kind() == wire::WireKind::Deal ? wire::deal::id : wire::user::id);
+            }
+            else {
+                userId = uri::split_query(std::string(body.begin(), body.end()))["id"];
+            }
+        }
+        catch(std::exception & e) {
+            reply(message, status_codes::BadRequest, e.what());
+            return pplx::task_from_result();
+        }
+        RequestTrace::setUser(userId);
+
+        http_request forward(methods::POST);
+        forward.set_request_uri("/user/" + op);
+        forward.set_body(std::move(body));
+        forward.headers().set_content_type(contentType);
+        // a connect is merged from JSON whatever the client takes, other
+        // replies pass through in the encoding it asked for
+        auto accept = message.headers().find(header_names::accept);
+        if (op == "connected")
+            forward.headers().add(header_names::accept, "application/json");
+        else if (accept != message.headers().end())
+            forward.headers().add(header_names::accept, accept->second);
+        auto forwarded = owner(userId).request(forward);
+
+        if (op != "connected") {
+            return forwarded.then([=](http_response r) -> pplx::task<void> {
+                auto status = r.status_code();
+                auto type = r.headers().content_type();
+                return r.extract_vector().then([=](std::vector<unsigned char> answer) {
+                    TraceScope scope(span);
+                    http_response response(status);
+                    response.set_body(std::move(answer));
+                    response.headers().set_content_type(type);
+                    reply(message, response);
+                });
+            });
+        }
+
+        // a connect answers with the global rating instead of the owner's
+        return forwarded.then([=](http_response r) -> pplx::task<void> {
+            if (r.status_code() != status_codes::OK) {
+                auto status = r.status_code();
+                return r.extract_string(true).then([=](utility::string_t answer) {
+                    TraceScope scope(span);
+                    reply(message, status, answer);
+                });
+            }
+            return r.extract_json(true).then([=](json::value own) {
+                return mergedRating(userId, own, defaultTopNum);
+            }).then([=](json::value response) {
+                response["message"] = json::value::string("succesfuly connected!");
+                TraceScope scope(span);
+                reply(message, status_codes::OK, response);
+            });
+        });
+    }));
+}
+
+pplx::task<json::value> RouterController::mergedRating(const std::string & userId,
+                                                        const json::value & ownerResponse,
+                                                        size_t topNum) {
+    bool withPivot = !ownerResponse.is_null();
+    double pivot = withPivot ? ownerResponse.at("rating").as_double() : 0;
+
+    std::ostringstream query;
+    query << "/rating/partial?n=" << topNum << "&near=" << nearNum;
+    if (withPivot) {
+        query << std::setprecision(17) << "&pivot=" << pivot
+              << "&id=" << uri::encode_data_string(userId);
+    }
+
+    // every partition is asked at once, so the merge waits for the slowest
+    // of them rather than for their sum
+    std::vector<pplx::task<json::value>> parts;
+    parts.reserve(_partitions.size());
+    for (auto & p : _partitions) {
+        parts.push_back(p.request(methods::GET, query.str()).then([](http_response r) {
+            return partitionJson(r);
+        }));
+    }
+
+    return pplx::when_all(parts.begin(), parts.end()).then([=](std::vector<json::value> answers) -> json::value {
+        json::value all = json::value::array(answers);
+        json::value response;
+        size_t total = 0, above = 0;
+        for (const auto & a : answers) {
+            total += a.at("total_users").as_number().to_uint64();
+            above += a.at("above").as_number().to_uint64();
+        }
+        response["total_users"] = json::value::number(static_cast<uint64_t>(total));
+
+        auto top = ratedUsers(all, "top_rated");
+        std::stable_sort(top.begin(), top.end(), higherRated);
+        top.resize(std::min(top.size(), topNum));
+        std::vector<json::value> vals;
+        for (size_t i = 0; i < top.size(); i++)
+            vals.push_back(position(i + 1, top[i]));
+        response["top_rated"] = json::value::array(vals);
+
+        if (!withPivot)
+            return response;
+
+        // closest users from either side of the pivot across all partitions
+        auto higher = ratedUsers(all, "higher");
+        std::stable_sort(higher.begin(), higher.end(), higherRated);
+        if (higher.size() > nearNum)
+            higher.erase(higher.begin(), higher.end() - nearNum);
+        auto lower = ratedUsers(all, "lower");
+        std::stable_sort(lower.begin(), lower.end(), higherRated);
+        lower.resize(std::min(lower.size(), nearNum));
+
+        RatedUser current;
+        current.id = userId;
+        current.name = userId;
+        current.rating = pivot;
+        if (ownerResponse.has_field("neigbour_list")) {
+            for (const auto & n : ownerResponse.at("neigbour_list").as_array()) {
+                if (n.at("is_current").as_bool())
+                    current.name = n.at("name").as_string();
+            }
+        }
+
+        size_t pos = above + 1;
+        size_t i = pos - higher.size();
+        vals.clear();
+        for (const auto & u : higher)
+            vals.push_back(position(i++, u));
+        json::value me = position(i++, current);
+        me["is_current"] = true;
+        vals.push_back(me);
+        for (const auto & u : lower)
+            vals.push_back(position(i++, u));
+        for (auto & v : vals) {
+            if (!v.has_field("is_current"))
+                v["is_current"] = false;
+        }
+        response["neigbour_list"] = json::value::array(vals);
+        response["position"] = json::value::number(static_cast<uint64_t>(pos));
+        response["rating"] = pivot;
+        response["top_percent"] = 100.0 * pos / total;
+        response["approximate"] = false;
+        return response;
+    });
+}
+
+void RouterController::handlePatch(http_request message) {
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::PATCH));
+}
+
+void RouterController::handlePut(http_request message) {
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::PUT));
+}
+
+void RouterController::handleDelete(http_request message) {
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::DEL));
+}
+
+void RouterController::handleHead(http_request message) {
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::HEAD));
+}
+
+void RouterController::handleOptions(http_request message) {
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::OPTIONS));
+}
+
+void RouterController::handleTrace(http_request message) {
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::TRCE));
+}
+
+void RouterController::handleConnect(http_request message) {
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::CONNECT));
+}
+
+void RouterController::handleMerge(http_request message) {
+    reply(message, status_codes::NotImplemented, responseNotImpl(methods::MERGE));
+}
+
+json::value RouterController::responseNotImpl(const http::method & method) {
+    auto response = json::value::object();
+    response["serviceName"] = json::value::string("C++ Mircroservice Sample");
+    response["http_method"] = json::value::string(method);
+    return response ;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <map>
+#include <basic_controller.hpp>
+#include <cpprest/http_client.h>
+
+using namespace cfx;
+
+// Front of a partitioned cluster.
+//
+// Users are spread over the partitions by consistent hashing of their id
+// (every partition owns a number of points on a 64-bit FNV-1a ring), so
+// writes go to the owning partition only. Ratings are scattered to every
+// partition at once and the per-partition top lists, neighbours and counts
+// of users above the requested user are merged into the global answer.
+// The rating of a user first asks its owner for the user's revenue, the
+// pivot the other partitions count and pick neighbours around.
+// Bulk imports span partitions and go to each partition directly.
+class RouterController : public BasicController, Controller {
+public:
+    explicit RouterController(const std::vector<std::string> & partitions);
+    ~RouterController() {}
+    void handleGet(http_request message) override;
+    void handlePut(http_request message) override;
+    void handlePost(http_request message) override;
+    void handlePatch(http_request message) override;
+    void handleDelete(http_request message) override;
+    void handleHead(http_request message) override;
+    void handleOptions(http_request message) override;
+    void handleTrace(http_request message) override;
+    void handleConnect(http_request message) override;
+    void handleMerge(http_request message) override;
+    void initRestOpHandlers() override;
+
+private:
+    http::client::http_client & owner(const std::string & userId);
+
+    // Scatters the rating query to all partitions and merges the answers,
+    // [ownerResponse] is the owner's rating of [userId] (null for top only)
+    pplx::task<json::value> mergedRating(const std::string & userId,
+                                         const json::value & ownerResponse,
+                                         size_t topNum);
+
+    // Replies 502 if [done] fails, or with the partition's answer if one
+    // rejected the request
+    static void replyWith(http_request message, pplx::task<void> done);
+    static json::value responseNotImpl(const http::method & method);
+
+    std::vector<http::client::http_client> _partitions;
+    std::map<uint64_t, size_t> _ring;
+};
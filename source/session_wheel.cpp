@@ -0,0 +1,54 @@
+#include <algorithm>
+
+#include "session_wheel.hpp"
+
+void SessionWheel::schedule(const std::string& id, uint32_t session, uint64_t expiresAt) {
+  Entry e;
+  e.id = id;
+  e.session = session;
+  e.expiresAt = std::max(expiresAt, current + 1);
+  insert(std::move(e));
+  entries++;
+}
+
+void SessionWheel::insert(Entry&& e) {
+  uint64_t delta = e.expiresAt > current ? e.expiresAt - current : 0;
+  int level = 0;
+  while (level < levels - 1 && delta >= (slotsNum << (slotBits * level)))
+    level++;
+  // beyond the wheel horizon: park in the farthest slot, re-filed from there
+  uint64_t at = std::min(e.expiresAt, current + (slotsNum << (slotBits * level)) - 1);
+  wheel[level][(at >> (slotBits * level)) & slotMask].push_back(std::move(e));
+}
+
+void SessionWheel::cascade(int level) {
+  std::vector<Entry> slot;
+  slot.swap(wheel[level][(current >> (slotBits * level)) & slotMask]);
+  for (auto& e : slot)
+    insert(std::move(e));
+}
+
+void SessionWheel::advance(uint64_t tick, std::vector<Entry>& due) {
+  while (current < tick) {
+    current++;
+    // refill the lower levels from every higher level that wrapped around,
+    // the highest first so its entries can land in the next one down
+    int top = 0;
+    while (top < levels - 1 && !(current & ((uint64_t(1) << (slotBits * (top + 1))) - 1)))
+      top++;
+    for (int level = top; level > 0; level--)
+      cascade(level);
+
+    std::vector<Entry> slot;
+    slot.swap(wheel[0][current & slotMask]);
+    for (auto& e : slot) {
+      if (e.expiresAt <= current) {
+        due.push_back(std::move(e));
+        entries--;
+      }
+      else {
+        insert(std::move(e));
+      }
+    }
+  }
+}
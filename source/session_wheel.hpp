@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Hierarchical timing wheel of session deadlines, in whole ticks.
+//
+// Three levels of 64 slots cover 64, 4096 and 262144 ticks ahead; further
+// deadlines are parked in the farthest slot and re-filed when it comes up.
+// An entry is touched once per level it cascades through, so the cost of
+// a tick is proportional to the entries that fall due, not to the number
+// of sessions. Refreshing a session is not a wheel operation at all: the
+// owner keeps the last activity tick and re-files an entry that fell due
+// too early (see UserManager).
+class SessionWheel {
+public:
+  struct Entry {
+    std::string id;
+    uint32_t session;
+    uint64_t expiresAt;
+  };
+
+  explicit SessionWheel(uint64_t startTick = 0) : current(startTick) {}
+
+  uint64_t now() const { return current; }
+
+  size_t size() const { return entries; }
+
+  // Files [id] to fall due at [expiresAt] (the next tick at the earliest)
+  void schedule(const std::string& id, uint32_t session, uint64_t expiresAt);
+
+  // Moves the wheel forward to [tick], appending the entries that fell due
+  void advance(uint64_t tick, std::vector<Entry>& due);
+
+private:
+  static const int levels = 3;
+  static const int slotBits = 6;
+  static const uint64_t slotsNum = 1 << slotBits;
+  static const uint64_t slotMask = slotsNum - 1;
+
+  void insert(Entry&& e);
+  void cascade(int level);
+
+  std::array<std::array<std::vector<Entry>, slotsNum>, levels> wheel;
+  uint64_t current;
+  size_t entries = 0;
+};
@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <cpu_placement.hpp>
+#include "traffic_capture.hpp"
+#include "wire_format.hpp"
+
+namespace {
+    const uint8_t magic[4] = {'M', 'S', 'C', 'P'};
+    const uint8_t version = 1;
+    const size_t headerSize = 16;
+
+    // Byte offsets of the record fields
+    namespace field {
+        const size_t length = 0;
+        const size_t op = 4;
+        const size_t flags = 5;
+        const size_t offset = 6;
+        const size_t amount = 14;
+        const size_t time = 18;
+        const size_t topNum = 26;
+        const size_t idLength = 30;
+        const size_t textLength = 32;
+        const size_t fixedSize = 34;
+    }
+    const uint8_t approximateFlag = 1;
+    const size_t maxRecord = 1 << 20;
+    const size_t wakeWriterBytes = 1 << 20;
+
+    CaptureConfig captureConfig;
+    std::atomic<bool> capturing(false);
+
+    // controlMutex (start and stop) is taken before writerMutex, that one
+    // before pendingMutex, request handlers take only the latter
+    std::mutex controlMutex;
+    std::thread writer;
+
+    std::mutex writerMutex;
+    std::ofstream out;
+    std::string outFile;
+    uint64_t written = 0;
+
+    std::mutex pendingMutex;
+    std::condition_variable wakeWriter;
+    bool writerStop = false;
+    std::string pending;
+    bool accepting = false;
+    uint64_t startedNs = 0;          // steady clock at the start of the capture
+    uint64_t records = 0;
+    uint64_t dropped = 0;
+
+    uint64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    template <typename T>
+    void put(std::string & buf, size_t offset, T v) {
+        v = wire::littleEndian(v);
+        std::memcpy(&buf[offset], &v, sizeof(v));
+    }
+
+    template <typename T>
+    T get(const std::string & buf, size_t offset) {
+        T v;
+        std::memcpy(&v, buf.data() + offset, sizeof(v));
+        return wire::littleEndian(v);
+    }
+
+    uint64_t envNumber(const char * name, uint64_t fallback) {
+        const char * v = std::getenv(name);
+        if (!v || !*v)
+            return fallback;
+        try {
+            return std::stoull(v);
+        }
+        catch (std::exception & e) {
+            std::cout << "Bad " << name << " value: " << e.what() << '\n';
+            return fallback;
+        }
+    }
+
+    // Under writerMutex
+    void writeOut(const std::string & data) {
+        if (!out || data.empty())
+            return;
+        out.write(data.data(), data.size());
+        out.flush();
+        written += data.size();
+    }
+
+    // Under writerMutex
+    std::string takePending() {
+        std::string data;
+        std::unique_lock<std::mutex> lock { pendingMutex };
+        data.swap(pending);
+        return data;
+    }
+
+    void writerLoop() {
+        cfx::CpuPlacement::placeBackgroundThread("capture writer");
+        std::unique_lock<std::mutex> lock { pendingMutex };
+        while (!writerStop) {
+            wakeWriter.wait_for(lock, std::chrono::milliseconds(captureConfig.flushMs),
+                                [] { return writerStop || pending.size() >= wakeWriterBytes; });
+            lock.unlock();
+            {
+                std::unique_lock<std::mutex> wlock { writerMutex };
+                writeOut(takePending());
+            }
+            lock.lock();
+        }
+    }
+
+    // Under controlMutex, not under writerMutex as the writer takes it
+    void stopWriter() {
+        if (!writer.joinable())
+            return;
+        {
+            std::unique_lock<std::mutex> lock { pendingMutex };
+            writerStop = true;
+        }
+        wakeWriter.notify_one();
+        writer.join();
+        std::unique_lock<std::mutex> lock { pendingMutex };
+        writerStop = false;
+    }
+
+    // Under writerMutex
+    void closeFile() {
+        {
+            std::unique_lock<std::mutex> lock { pendingMutex };
+            accepting = false;
+            capturing.store(false, std::memory_order_relaxed);
+        }
+        writeOut(takePending());
+        if (out.is_open())
+            out.close();
+    }
+
+    // A process leaving without CaptureWriter::stop() still ends the writer
+    // before the file and the buffer it writes go away
+    struct WriterGuard {
+        ~WriterGuard() {
+            CaptureWriter::stop();
+        }
+    } writerGuard;
+}
+
+const char * CapturedRequest::opName(CaptureOp op) {
+    switch (op) {
+        case CaptureOp::Register: return "registered";
+        case CaptureOp::Rename: return "renamed";
+        case CaptureOp::Deregister: return "deregistered";
+        case CaptureOp::Connect: return "connected";
+        case CaptureOp::Disconnect: return "disconnected";
+        case CaptureOp::Deal: return "deal";
+        case CaptureOp::SetCurrent: return "current";
+        case CaptureOp::RatingTop: return "rating/top";
+        case CaptureOp::RatingUser: return "rating/user";
+    }
+    return "unknown";
+}
+
+CaptureConfig CaptureConfig::fromEnvironment() {
+    CaptureConfig c;
+    if (const char * env_p = std::getenv("CAPTURE_FILE"))
+        c.file = env_p;
+    if (const char * env_p = std::getenv("CAPTURE_ON_START"))
+        c.onStart = std::string(env_p) == "1";
+    c.flushMs = static_cast<unsigned>(std::max<uint64_t>(1, envNumber("CAPTURE_FLUSH_MS", c.flushMs)));
+    c.maxPendingBytes = static_cast<size_t>(envNumber("CAPTURE_MAX_PENDING_MB", c.maxPendingBytes >> 20) << 20);
+    return c;
+}
+
+void CaptureWriter::configure(const CaptureConfig & config) {
+    {
+        std::unique_lock<std::mutex> lock { writerMutex };
+        captureConfig = config;
+    }
+    if (!config.onStart)
+        return;
+    try {
+        start();
+        std::cout << "Capturing requests into " << config.file << '\n';
+    }
+    catch (CaptureException & e) {
+        std::cout << e.what() << '\n';
+    }
+}
+
+void CaptureWriter::start() {
+    std::unique_lock<std::mutex> control { controlMutex };
+    stopWriter();
+    std::unique_lock<std::mutex> lock { writerMutex };
+    closeFile();
+    const std::string & file = captureConfig.file;
+
+    out.open(file, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw CaptureException("cannot open capture file " + file + "!");
+    uint64_t wallNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::string header(headerSize, '\0');
+    std::memcpy(&header[0], magic, sizeof(magic));
+    header[4] = char(version);
+    put(header, 8, wallNs);
+    outFile = file;
+    written = 0;
+    writeOut(header);
+
+    {
+        std::unique_lock<std::mutex> plock { pendingMutex };
+        accepting = true;
+        startedNs = nowNs();
+        records = 0;
+        dropped = 0;
+        capturing.store(true, std::memory_order_relaxed);
+    }
+    writer = std::thread(writerLoop);
+}
+
+void CaptureWriter::stop() {
+    std::unique_lock<std::mutex> control { controlMutex };
+    stopWriter();
+    std::unique_lock<std::mutex> lock { writerMutex };
+    closeFile();
+}
+
+bool CaptureWriter::active() {
+    return capturing.load(std::memory_order_relaxed);
+}
+
+uint64_t CaptureWriter::stamp() {
+    return active() ? nowNs() : 0;
+}
+
+void CaptureWriter::record(const CapturedRequest & r) {
+    if (!active())
+        return;
+
+    thread_local std::string buf;
+    size_t idLength = std::min<size_t>(r.id.size(), 0xFFFF);
+    size_t textLength = std::min<size_t>(r.text.size(), 0xFFFF);
+    size_t length = field::fixedSize + idLength + textLength;
+    buf.assign(field::fixedSize, '\0');
+    put(buf, field::length, static_cast<uint32_t>(length));
+    buf[field::op] = char(r.op);
+    buf[field::flags] = char(r.approximate ? approximateFlag : 0);
+    put(buf, field::amount, r.amount);
+    put(buf, field::time, r.time);
+    put(buf, field::topNum, r.topNum);
+    put(buf, field::idLength, static_cast<uint16_t>(idLength));
+    put(buf, field::textLength, static_cast<uint16_t>(textLength));
+    buf.append(r.id, 0, idLength);
+    buf.append(r.text, 0, textLength);
+
+    std::unique_lock<std::mutex> lock { pendingMutex };
+    if (!accepting)
+        return;
+    if (pending.size() + length > captureConfig.maxPendingBytes) {
+        dropped++;
+        return;
+    }
+    // requests that arrived before the start count from the start
+    uint64_t arrival = r.arrival ? r.arrival : nowNs();
+    put(buf, field::offset, arrival > startedNs ? arrival - startedNs : uint64_t(0));
+    bool wake = pending.size() < wakeWriterBytes && pending.size() + length >= wakeWriterBytes;
+    pending += buf;
+    records++;
+    lock.unlock();
+    if (wake)
+        wakeWriter.notify_one();
+}
+
+CaptureStats CaptureWriter::stats() {
+    CaptureStats s;
+    std::unique_lock<std::mutex> lock { writerMutex };
+    s.file = outFile;
+    s.bytes = written;
+    std::unique_lock<std::mutex> plock { pendingMutex };
+    s.active = accepting;
+    s.records = records;
+    s.dropped = dropped;
+    return s;
+}
+
+CaptureReader::CaptureReader(const std::string & file) :
+    _in(file, std::ios::in | std::ios::binary), _file(file) {
+    if (!_in)
+        throw CaptureException("cannot open capture file " + file + "!");
+    std::string header(headerSize, '\0');
+    if (!_in.read(&header[0], headerSize) || std::memcmp(header.data(), magic, sizeof(magic)) != 0)
+        throw CaptureException(file + " is not a capture file!");
+    if (uint8_t(header[4]) != version)
+        throw CaptureException("unsupported capture version in " + file + "!");
+    _started = get<uint64_t>(header, 8);
+}
+
+bool CaptureReader::next(CapturedRequest & r) {
+    // a record cut short (the service died while capturing) ends the capture
+    _buf.resize(field::fixedSize);
+    if (!_in.read(&_buf[0], sizeof(uint32_t)))
+        return false;
+    uint32_t length = get<uint32_t>(_buf, field::length);
+    if (length < field::fixedSize || length > maxRecord)
+        throw CaptureException("bad record " + std::to_string(_records) + " in " + _file + "!");
+    _buf.resize(length);
+    if (!_in.read(&_buf[sizeof(uint32_t)], length - sizeof(uint32_t)))
+        return false;
+
+    uint8_t op = uint8_t(_buf[field::op]);
+    size_t idLength = get<uint16_t>(_buf, field::idLength);
+    size_t textLength = get<uint16_t>(_buf, field::textLength);
+    if (op < uint8_t(CaptureOp::Register) || op > uint8_t(CaptureOp::RatingUser) ||
+        field::fixedSize + idLength + textLength != length)
+        throw CaptureException("bad record " + std::to_string(_records) + " in " + _file + "!");
+
+    r.op = static_cast<CaptureOp>(op);
+    r.approximate = uint8_t(_buf[field::flags]) & approximateFlag;
+    r.arrival = get<uint64_t>(_buf, field::offset);
+    r.amount = get<Rating>(_buf, field::amount);
+    r.time = get<uint64_t>(_buf, field::time);
+    r.topNum = get<uint32_t>(_buf, field::topNum);
+    r.id.assign(_buf, field::fixedSize, idLength);
+    r.text.assign(_buf, field::fixedSize + idLength, textLength);
+    _records++;
+    return true;
+}
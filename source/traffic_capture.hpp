@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+using Rating = float;
+
+// Production traffic recorded for traffic-replay.
+//
+// A capture file is a header followed by one record per request, in the
+// order the requests were handed to the capture:
+//
+//   header
+//     u32 magic     'M' 'S' 'C' 'P'
+//     u8  version
+//     u8  pad[3]
+//     u64 started   wall clock at the start of the capture, ns since epoch
+//
+//   record
+//     u32 length    size of the whole record, this field included
+//     u8  op        CaptureOp
+//     u8  flags     bit 0: approximate rating
+//     u64 offset    arrival at the controller, ns since the start
+//     f32 amount
+//     u64 time      deal time, ns since epoch, 0 for "now"
+//     u32 topNum
+//     u16 idLength
+//     u16 textLength
+//     ...           id, then the name or the rating window
+//
+// Requests are kept as the controller decoded them rather than as HTTP, so
+// a replay feeds them to UserManager without parsing anything but this.
+// All values are little-endian.
+enum class CaptureOp : uint8_t {
+  Register = 1,
+  Rename = 2,
+  Deregister = 3,
+  Connect = 4,        // connect plus the rating of the user in the reply
+  Disconnect = 5,
+  Deal = 6,
+  SetCurrent = 7,
+  RatingTop = 8,
+  RatingUser = 9
+};
+
+struct CapturedRequest {
+  CaptureOp op = CaptureOp::RatingTop;
+  uint64_t arrival = 0;       // steady clock ns, CaptureWriter::stamp() (offset when read back)
+  std::string id;
+  std::string text;           // name of Register and Rename, window of ratings
+  Rating amount = 0;
+  uint64_t time = 0;
+  uint32_t topNum = 10;
+  bool approximate = false;
+
+  static const char * opName(CaptureOp op);
+};
+
+class CaptureException : public std::exception {
+  std::string _message;
+public:
+  CaptureException(const std::string & message) :
+    _message(message) { }
+  const char * what() const throw() {
+    return _message.c_str();
+  }
+};
+
+// CAPTURE_FILE=<path> is where captures go (default "capture.bin"),
+// CAPTURE_ON_START=1 starts one along with the service, otherwise they are
+// started through /admin/capture. CAPTURE_FLUSH_MS is the period of the
+// writer (default 200), CAPTURE_MAX_PENDING_MB how much may wait for it
+// before records are dropped instead (default 64).
+struct CaptureConfig {
+  std::string file = "capture.bin";
+  bool onStart = false;
+  unsigned flushMs = 200;
+  size_t maxPendingBytes = 64 << 20;
+
+  static CaptureConfig fromEnvironment();
+};
+
+struct CaptureStats {
+  bool active = false;
+  std::string file;
+  uint64_t records = 0;       // since the capture started
+  uint64_t bytes = 0;         // written to the file so far
+  uint64_t dropped = 0;       // records the writer didn't keep up with
+};
+
+// Request handlers encode their record and append it to a pending buffer
+// under a short lock; a writer thread swaps the buffer out and writes it,
+// so no request waits for the disk. While no capture runs, stamp() and
+// record() cost a relaxed load.
+class CaptureWriter {
+public:
+  static void configure(const CaptureConfig & config);
+
+  // Starts capturing into the configured file (truncated), ends a running
+  // capture first
+  static void start();
+  // Joins the writer thread, writes what is pending and closes the file;
+  // also done at exit
+  static void stop();
+
+  static bool active();
+  // Arrival time to record for a request arriving now, 0 while inactive
+  static uint64_t stamp();
+  static void record(const CapturedRequest & r);
+
+  static CaptureStats stats();
+};
+
+// Reads a capture file record by record
+class CaptureReader {
+public:
+  explicit CaptureReader(const std::string & file);
+
+  // Wall clock at the start of the capture, ns since epoch
+  uint64_t started() const { return _started; }
+
+  // Next record with [arrival] as offset from the start, false at the end
+  bool next(CapturedRequest & r);
+
+private:
+  std::ifstream _in;
+  std::string _file;
+  std::string _buf;
+  uint64_t _started = 0;
+  uint64_t _records = 0;
+};
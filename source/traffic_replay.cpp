@@ -0,0 +1,279 @@
+// traffic-replay: feeds a capture of the service (CAPTURE_FILE or
+// /admin/capture) straight into UserManager and reports throughput and
+// latency per operation.
+//
+//   traffic-replay <capture> [speed] [threads]
+//
+//   speed    1 keeps the captured pace (default), 10 replays ten times
+//            faster, 0 as fast as possible
+//   threads  replaying threads (default 1)
+//
+// The users database is configured from the environment like the service
+// (RATING_WINDOWS, LOCK_PROFILE, ...), so two builds or two settings can be
+// compared on the same capture. Requests of one user always go to the same
+// thread in capture order; with a single thread the replay is deterministic.
+// Deal times are moved by the age of the capture, so its deals land in the
+// current week rather than in one long closed.
+//
+// Latency is taken from the time a request was due, so a replay that falls
+// behind the captured pace shows up in it; service time only counts the
+// UserManager call.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <profiled_mutex.hpp>
+#include "traffic_capture.hpp"
+#include "user_manager.hpp"
+
+namespace {
+    using Steady = std::chrono::steady_clock;
+
+    const int opCount = int(CaptureOp::RatingUser) + 1;
+
+    struct OpStats {
+        uint64_t count = 0;
+        uint64_t errors = 0;
+        uint64_t maxLatencyNs = 0;
+        uint64_t maxServiceNs = 0;
+        std::vector<uint64_t> latency = std::vector<uint64_t>(cfx::LockOpStats::buckets);
+        std::vector<uint64_t> service = std::vector<uint64_t>(cfx::LockOpStats::buckets);
+
+        void add(const OpStats & o) {
+            count += o.count;
+            errors += o.errors;
+            maxLatencyNs = std::max(maxLatencyNs, o.maxLatencyNs);
+            maxServiceNs = std::max(maxServiceNs, o.maxServiceNs);
+            for (int i = 0; i < cfx::LockOpStats::buckets; i++) {
+                latency[i] += o.latency[i];
+                service[i] += o.service[i];
+            }
+        }
+    };
+
+    // Same log2 buckets as the lock profile, so LockOpStats::percentile reads them
+    void count(std::vector<uint64_t> & histogram, uint64_t ns) {
+        int b = 0;
+        while (ns > 1 && b < cfx::LockOpStats::buckets - 1) {
+            ns >>= 1;
+            b++;
+        }
+        histogram[b]++;
+    }
+
+    struct Worker {
+        std::vector<CapturedRequest> requests;
+        OpStats stats[opCount];
+    };
+
+    void execute(const CapturedRequest & r, int64_t timeShift) {
+        auto & users = UserManager::getInstance();
+        switch (r.op) {
+            case CaptureOp::Register:
+                users.registerUser(r.id, r.text);
+                break;
+            case CaptureOp::Rename:
+                users.hadnleUserRenamed(r.id, r.text);
+                break;
+            case CaptureOp::Deregister:
+                users.deregisterUser(r.id);
+                break;
+            case CaptureOp::Connect: {
+                users.hadnleUserConnected(r.id);
+                RatingRequest req;
+                req.userId = r.id;
+                req.approximate = r.approximate;
+                users.getRating(req);
+                break;
+            }
+            case CaptureOp::Disconnect:
+                users.hadnleUserDisconnected(r.id);
+                break;
+            case CaptureOp::Deal: {
+                TimePoint tp = Clock::now();
+                if (r.time)
+                    tp = TimePoint(std::chrono::nanoseconds(int64_t(r.time) + timeShift));
+                users.hadnleUserDial(r.id, tp, r.amount);
+                break;
+            }
+            case CaptureOp::SetCurrent:
+                users.hadnleUserSetCurrent(r.id);
+                break;
+            case CaptureOp::RatingTop:
+            case CaptureOp::RatingUser: {
+                RatingRequest req;
+                if (r.op == CaptureOp::RatingUser)
+                    req.userId = r.id;
+                req.window = r.text;
+                req.topNum = r.topNum;
+                req.approximate = r.approximate;
+                users.getRating(req);
+                break;
+            }
+        }
+    }
+
+    void replay(Worker & w, Steady::time_point start, double speed, int64_t timeShift) {
+        for (const auto & r : w.requests) {
+            auto due = Steady::now();
+            if (speed > 0) {
+                due = start + std::chrono::nanoseconds(uint64_t(r.arrival / speed));
+                std::this_thread::sleep_until(due);
+            }
+            auto begin = Steady::now();
+            OpStats & s = w.stats[int(r.op)];
+            try {
+                execute(r, timeShift);
+            }
+            catch (std::exception & e) {
+                s.errors++;
+            }
+            auto end = Steady::now();
+            uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(end - due).count();
+            uint64_t service = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+            s.count++;
+            s.maxLatencyNs = std::max(s.maxLatencyNs, latency);
+            s.maxServiceNs = std::max(s.maxServiceNs, service);
+            count(s.latency, latency);
+            count(s.service, service);
+        }
+    }
+
+    double us(uint64_t ns) {
+        return ns / 1000.0;
+    }
+
+    // Upper bound of the bucket of percentile [p], but never above the maximum
+    uint64_t percentile(const std::vector<uint64_t> & histogram, double p, uint64_t max) {
+        return std::min(cfx::LockOpStats::percentile(histogram, p), max);
+    }
+
+    void printStats(const char * name, const OpStats & s) {
+        std::cout << std::left << std::setw(14) << name << std::right
+                  << std::setw(10) << s.count << std::setw(8) << s.errors
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(11) << us(percentile(s.latency, 50, s.maxLatencyNs))
+                  << std::setw(11) << us(percentile(s.latency, 99, s.maxLatencyNs))
+                  << std::setw(11) << us(percentile(s.latency, 99.9, s.maxLatencyNs))
+                  << std::setw(11) << us(s.maxLatencyNs)
+                  << std::setw(11) << us(percentile(s.service, 50, s.maxServiceNs))
+                  << std::setw(11) << us(percentile(s.service, 99, s.maxServiceNs))
+                  << std::setw(11) << us(s.maxServiceNs) << '\n';
+    }
+
+    int usage() {
+        std::cerr << "usage: traffic-replay <capture> [speed (1: captured pace, 0: as fast as possible)] [threads]\n";
+        return 2;
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    if (argc < 2 || argc > 4)
+        return usage();
+    double speed = 1;
+    unsigned threads = 1;
+    try {
+        if (argc > 2)
+            speed = std::stod(argv[2]);
+        if (argc > 3)
+            threads = static_cast<unsigned>(std::stoul(argv[3]));
+    }
+    catch (std::exception & e) {
+        return usage();
+    }
+    if (speed < 0 || threads == 0)
+        return usage();
+
+    // the whole capture is loaded up front, reading it isn't measured
+    std::vector<Worker> workers(threads);
+    uint64_t total = 0;
+    uint64_t capturedNs = 0;
+    uint64_t capturedAt = 0;
+    try {
+        CaptureReader reader(argv[1]);
+        capturedAt = reader.started();
+        std::hash<std::string> hash;
+        size_t next = 0;
+        CapturedRequest r;
+        while (reader.next(r)) {
+            // requests without a user (the top list) are dealt out in turn
+            size_t w = r.id.empty() ? next++ % threads : hash(r.id) % threads;
+            capturedNs = std::max(capturedNs, r.arrival);
+            workers[w].requests.push_back(r);
+            total++;
+        }
+    }
+    catch (CaptureException & e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    auto & users = UserManager::getInstance();
+    if (users.isReplica()) {
+        std::cerr << "a replica can't replay requests!\n";
+        return 1;
+    }
+
+    std::cout << "=== Replaying " << total << " requests captured over "
+              << std::fixed << std::setprecision(3) << capturedNs / 1e9 << " s";
+    if (speed > 0)
+        std::cout << " at " << speed << "x";
+    else
+        std::cout << " as fast as possible";
+    std::cout << " on " << threads << " thread(s)" << std::endl;
+
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+    int64_t timeShift = now - int64_t(capturedAt);
+
+    auto start = Steady::now();
+    std::vector<std::thread> running;
+    for (auto & w : workers)
+        running.emplace_back(replay, std::ref(w), start, speed, timeShift);
+    for (auto & t : running)
+        t.join();
+    double seconds = std::chrono::duration<double>(Steady::now() - start).count();
+
+    OpStats all;
+    OpStats perOp[opCount];
+    for (const auto & w : workers) {
+        for (int op = 0; op < opCount; op++) {
+            perOp[op].add(w.stats[op]);
+            all.add(w.stats[op]);
+        }
+    }
+
+    std::cout << "=== Replayed " << all.count << " requests in " << std::setprecision(3) << seconds << " s, "
+              << std::setprecision(0) << (seconds > 0 ? all.count / seconds : 0) << " requests/s, "
+              << all.errors << " errors\n";
+    std::cout << "=== Latency from the due time and UserManager service time, us\n";
+    std::cout << std::left << std::setw(14) << "op" << std::right
+              << std::setw(10) << "count" << std::setw(8) << "errors"
+              << std::setw(11) << "lat p50" << std::setw(11) << "lat p99" << std::setw(11) << "lat p99.9"
+              << std::setw(11) << "lat max" << std::setw(11) << "svc p50" << std::setw(11) << "svc p99"
+              << std::setw(11) << "svc max" << '\n';
+    for (int op = 1; op < opCount; op++) {
+        if (perOp[op].count)
+            printStats(CapturedRequest::opName(CaptureOp(op)), perOp[op]);
+    }
+    printStats("all", all);
+
+    // LOCK_PROFILE=1 adds where the users database lock was waited for
+    auto profile = users.getLockProfile(5);
+    if (profile.enabled) {
+        std::cout << "=== Users database lock\n";
+        for (const auto & s : profile.ops) {
+            std::cout << std::left << std::setw(20) << s.op << std::right
+                      << std::setw(10) << s.acquisitions << std::setw(10) << s.contended
+                      << " contended, waited " << std::setprecision(3) << s.waitNs / 1e6 << " ms, held "
+                      << s.holdNs / 1e6 << " ms\n";
+        }
+    }
+    return 0;
+}
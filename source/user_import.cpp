@@ -0,0 +1,258 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "user_import.hpp"
+
+namespace {
+    struct LineError {
+      std::string message;
+    };
+
+    bool isSpace(char c) {
+      return c == ' ' || c == '\t';
+    }
+
+    bool parseRevenue(const std::string & s, Rating & res) {
+      if (s.empty())
+        return true;
+      char * end = nullptr;
+      res = std::strtof(s.c_str(), &end);
+      return end == s.c_str() + s.size();
+    }
+
+    // id,name[,revenue] with optional "quoted" fields
+    void parseCsv(const char * p, const char * end, ImportRow & row) {
+      std::vector<std::string> fields;
+      for (;;) {
+        std::string field;
+        if (p < end && *p == '"') {
+          for (p++; ; p++) {
+            if (p == end)
+              throw LineError{"unterminated quote"};
+            if (*p == '"') {
+              if (p + 1 < end && p[1] == '"') {
+                field += '"';
+                p++;
+                continue;
+              }
+              p++;
+              break;
+            }
+            field += *p;
+          }
+          if (p < end && *p != ',')
+            throw LineError{"garbage after quoted field"};
+        }
+        else {
+          const char * comma = static_cast<const char *>(std::memchr(p, ',', end - p));
+          const char * stop = comma ? comma : end;
+          field.assign(p, stop);
+          p = stop;
+        }
+        fields.push_back(std::move(field));
+        if (p == end)
+          break;
+        p++;  // ','
+      }
+      if (fields.size() < 2 || fields.size() > 3)
+        throw LineError{"expected id,name[,revenue]"};
+      row.id = std::move(fields[0]);
+      row.name = std::move(fields[1]);
+      if (fields.size() == 3 && !parseRevenue(fields[2], row.revenue))
+        throw LineError{"bad revenue"};
+    }
+
+    void appendUtf8(std::string & s, unsigned cp) {
+      if (cp < 0x80) {
+        s += char(cp);
+      }
+      else if (cp < 0x800) {
+        s += char(0xC0 | (cp >> 6));
+        s += char(0x80 | (cp & 0x3F));
+      }
+      else if (cp < 0x10000) {
+        s += char(0xE0 | (cp >> 12));
+        s += char(0x80 | ((cp >> 6) & 0x3F));
+        s += char(0x80 | (cp & 0x3F));
+      }
+      else {
+        s += char(0xF0 | (cp >> 18));
+        s += char(0x80 | ((cp >> 12) & 0x3F));
+        s += char(0x80 | ((cp >> 6) & 0x3F));
+        s += char(0x80 | (cp & 0x3F));
+      }
+    }
+
+    unsigned hex4(const char *& p, const char * end) {
+      if (end - p < 4)
+        throw LineError{"bad \\u escape"};
+      unsigned v = 0;
+      for (int i = 0; i < 4; i++, p++) {
+        char c = *p;
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else throw LineError{"bad \\u escape"};
+      }
+      return v;
+    }
+
+    // [p] is past the opening quote
+    std::string jsonString(const char *& p, const char * end) {
+      std::string s;
+      for (;;) {
+        if (p == end)
+          throw LineError{"unterminated string"};
+        char c = *p++;
+        if (c == '"')
+          return s;
+        if (c != '\\') {
+          s += c;
+          continue;
+        }
+        if (p == end)
+          throw LineError{"unterminated string"};
+        c = *p++;
+        switch (c) {
+          case '"': case '\\': case '/': s += c; break;
+          case 'b': s += '\b'; break;
+          case 'f': s += '\f'; break;
+          case 'n': s += '\n'; break;
+          case 'r': s += '\r'; break;
+          case 't': s += '\t'; break;
+          case 'u': {
+            unsigned cp = hex4(p, end);
+            if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+              p += 2;
+              unsigned lo = hex4(p, end);
+              cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            }
+            appendUtf8(s, cp);
+            break;
+          }
+          default:
+            throw LineError{"bad escape"};
+        }
+      }
+    }
+
+    void skipSpace(const char *& p, const char * end) {
+      while (p < end && isSpace(*p))
+        p++;
+    }
+
+    // Flat object of strings and scalars, unknown keys are ignored
+    void parseJson(const char * p, const char * end, ImportRow & row) {
+      p++;  // '{'
+      skipSpace(p, end);
+      if (p < end && *p == '}')
+        throw LineError{"expected id and name"};
+      for (;;) {
+        skipSpace(p, end);
+        if (p == end || *p != '"')
+          throw LineError{"expected key"};
+        p++;
+        std::string key = jsonString(p, end);
+        skipSpace(p, end);
+        if (p == end || *p != ':')
+          throw LineError{"expected ':'"};
+        p++;
+        skipSpace(p, end);
+        if (p == end)
+          throw LineError{"expected value"};
+
+        std::string value;
+        bool quoted = *p == '"';
+        if (quoted) {
+          p++;
+          value = jsonString(p, end);
+        }
+        else {
+          const char * start = p;
+          while (p < end && *p != ',' && *p != '}' && !isSpace(*p))
+            p++;
+          value.assign(start, p);
+        }
+
+        if (key == "id") {
+          row.id = std::move(value);
+        }
+        else if (key == "name") {
+          row.name = std::move(value);
+        }
+        else if (key == "revenue") {
+          if (quoted || !parseRevenue(value, row.revenue))
+            throw LineError{"bad revenue"};
+        }
+
+        skipSpace(p, end);
+        if (p == end)
+          throw LineError{"unterminated object"};
+        if (*p == '}')
+          break;
+        if (*p != ',')
+          throw LineError{"expected ',' or '}'"};
+        p++;
+      }
+      p++;
+      skipSpace(p, end);
+      if (p != end)
+        throw LineError{"garbage after object"};
+    }
+}
+
+size_t countLines(const char * data, size_t size) {
+  size_t n = 0;
+  const char * end = data + size;
+  while ((data = static_cast<const char *>(std::memchr(data, '\n', end - data)))) {
+    n++;
+    data++;
+  }
+  return n;
+}
+
+ImportBatch parseImportChunk(const char * data, size_t size, size_t firstLine) {
+  ImportBatch batch;
+  // a row is rarely shorter than that, a slight overshoot is cheaper than regrowing
+  batch.rows.reserve(size / 16 + 1);
+
+  const char * p = data;
+  const char * end = data + size;
+  for (size_t line = firstLine; p < end; line++) {
+    const char * nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    const char * eol = nl ? nl : end;
+    const char * next = nl ? nl + 1 : end;
+    if (eol > p && eol[-1] == '\r')
+      eol--;
+    while (p < eol && isSpace(*p))
+      p++;
+
+    if (p == eol || (line == 1 && eol - p >= 3 && std::memcmp(p, "id,", 3) == 0)) {
+      p = next;
+      continue;
+    }
+
+    ImportRow row;
+    row.line = line;
+    try {
+      if (*p == '{')
+        parseJson(p, eol, row);
+      else
+        parseCsv(p, eol, row);
+      if (row.id.empty())
+        throw LineError{"empty user id!"};
+      if (row.name.empty())
+        throw LineError{"empty user name!"};
+      batch.rows.push_back(std::move(row));
+    }
+    catch (LineError & e) {
+      ImportError err;
+      err.line = line;
+      err.message = std::move(e.message);
+      batch.errors.push_back(std::move(err));
+    }
+    p = next;
+  }
+  return batch;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using Rating = float;
+
+// Bulk registration rows, one per line of either format:
+//
+//   CSV      id,name[,revenue]   fields may be "quoted" with "" escapes,
+//                                an "id,name..." first line is a header
+//   NDJSON   {"id": "...", "name": "...", "revenue": 12.5}
+//
+// Blank lines are skipped, the format is picked per line.
+struct ImportRow {
+  size_t line = 0;
+  std::string id;
+  std::string name;
+  Rating revenue = 0;
+};
+
+struct ImportError {
+  size_t line = 0;
+  std::string message;
+};
+
+struct ImportBatch {
+  std::vector<ImportRow> rows;
+  std::vector<ImportError> errors;
+};
+
+// Parses the complete lines in [data, data + size), the first of them
+// being line [firstLine] of the body
+ImportBatch parseImportChunk(const char * data, size_t size, size_t firstLine);
+
+size_t countLines(const char * data, size_t size);
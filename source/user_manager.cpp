@@ -1,10 +1,22 @@
 
 #include <mutex>
-#include <set>
 #include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <boost/timer/timer.hpp>
+#include <cpu_placement.hpp>
+#include <startup_report.hpp>
 
 #include "user_manager.hpp"
+#include "deal_reorder.hpp"
+#include "leaderboard_segment.hpp"
+#include "revenue_histogram.hpp"
+#include "session_wheel.hpp"
+#include "users_state.hpp"
 
 namespace {
     int ratingTimeout = 60;
@@ -12,15 +24,18 @@ namespace {
     // (Monday as the first day of the week) as a decimal number [00,53].
     // All days in a new year preceding the first Monday are considered to be in week 0.
     int getWeekNum(const TimePoint& tp) {
-        std::tm tm = {0};
+        std::tm tm {};
         std::time_t tt = std::chrono::system_clock::to_time_t(tp);
         gmtime_r(&tt, &tm);
         return (tm.tm_yday + 7 - (tm.tm_wday ? (tm.tm_wday - 1) : 6)) / 7;
     }
-  
-    bool isCurrentWeek(const TimePoint& tp) {
-        TimePoint cur = Clock::now();
-        return getWeekNum(cur) == getWeekNum(tp);
+
+    // Week number qualified with the year: year * 100 + week number
+    int getWeekKey(const TimePoint& tp) {
+        std::tm tm {};
+        std::time_t tt = std::chrono::system_clock::to_time_t(tp);
+        gmtime_r(&tt, &tm);
+        return (tm.tm_year + 1900) * 100 + getWeekNum(tp);
     }
 
     void setRatingTimeout() {
@@ -33,26 +48,251 @@ namespace {
             }
         }
     }
+
+    // Connected users idle for that long (s) are disconnected, 0 (the
+    // default) keeps sessions until the client ends them
+    uint64_t sessionTtl = 0;
+
+    void setSessionTtl() {
+        if(const char* env_p = std::getenv("SESSION_TTL")) {
+            try {
+                sessionTtl = std::stoull(env_p);
+            }
+            catch (std::exception& e) {
+                std::cout << "Bad session TTL value: " << e.what() << '\n';
+            }
+        }
+    }
+
+    unsigned short getReplicationPort() {
+        if(const char* env_p = std::getenv("REPLICATION_PORT")) {
+            try {
+                return std::stoi(env_p);
+            }
+            catch (std::exception& e) {
+                std::cout << "Bad replication port: " << e.what() << '\n';
+            }
+        }
+        return 0;
+    }
+
+    int64_t sinceEpochNs(const TimePoint& tp) {
+        return tp.time_since_epoch().count();
+    }
+
+    const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    // Session wheel ticks are whole seconds since start
+    uint64_t currentTick() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - startTime).count();
+    }
+
+    uint32_t leaderboardShmCapacity = 100000;
+    int leaderboardShmIntervalMs = 1000;
+
+    void setLeaderboardShm() {
+        try {
+            if(const char* env_p = std::getenv("LEADERBOARD_SHM_CAPACITY"))
+                leaderboardShmCapacity = std::stoul(env_p);
+            if(const char* env_p = std::getenv("LEADERBOARD_SHM_INTERVAL_MS"))
+                leaderboardShmIntervalMs = std::stoi(env_p);
+        }
+        catch (std::exception& e) {
+            std::cout << "Bad leaderboard segment setting: " << e.what() << '\n';
+        }
+    }
+
+    // Users neither connected nor active for that long are evicted, 0
+    // (the default) keeps every user
+    uint64_t evictAfterSec = 0;
+    // Hash table buckets looked through per eviction pass (one a second)
+    size_t evictBucketsPerPass = 4096;
+    // Freed memory goes back to the system at most that often
+    const std::chrono::seconds trimInterval(10);
+
+    void setEviction() {
+        try {
+            if(const char* env_p = std::getenv("EVICT_AFTER_WEEKS"))
+                evictAfterSec = std::stoull(env_p) * 7 * 24 * 3600;
+            if(const char* env_p = std::getenv("EVICT_BUCKETS_PER_PASS"))
+                evictBucketsPerPass = std::max(1ULL, std::stoull(env_p));
+        }
+        catch (std::exception& e) {
+            std::cout << "Bad eviction setting: " << e.what() << '\n';
+        }
+    }
+
+    // Deals are held that long to be applied in event-time order (0: as
+    // they come), a week closes that long after its end
+    std::chrono::nanoseconds dealReorderDelay(0);
+    std::chrono::nanoseconds weekGrace = std::chrono::seconds(30);
+    size_t dealReorderCapacity = 100000;
+
+    void setDealOrdering() {
+        try {
+            if(const char* env_p = std::getenv("DEAL_REORDER_MS"))
+                dealReorderDelay = std::chrono::milliseconds(std::stoll(env_p));
+            if(const char* env_p = std::getenv("WEEK_GRACE_SEC"))
+                weekGrace = std::chrono::seconds(std::stoll(env_p));
+            if(const char* env_p = std::getenv("DEAL_REORDER_CAPACITY"))
+                dealReorderCapacity = std::stoull(env_p);
+        }
+        catch (std::exception& e) {
+            std::cout << "Bad deal ordering setting: " << e.what() << '\n';
+        }
+    }
+
+    // STATE_FILE=<path> keeps the live users across restarts (unset: they
+    // are not kept), STATE_LOAD_THREADS decode it (default: one per CPU)
+    std::string stateFile;
+    unsigned stateLoadThreads = std::max(1u, std::thread::hardware_concurrency());
+    // enough shards to keep every loading thread busy
+    const size_t stateShards = 256;
+
+    void setStateFile() {
+        if(const char* env_p = std::getenv("STATE_FILE"))
+            stateFile = env_p;
+        if(const char* env_p = std::getenv("STATE_LOAD_THREADS")) {
+            try {
+                stateLoadThreads = std::max(1, std::stoi(env_p));
+            }
+            catch (std::exception& e) {
+                std::cout << "Bad state load threads value: " << e.what() << '\n';
+            }
+        }
+    }
+
+    uint64_t residentBytes() {
+        std::ifstream statm("/proc/self/statm");
+        uint64_t size = 0, resident = 0;
+        statm >> size >> resident;
+        return resident * ::sysconf(_SC_PAGESIZE);
+    }
+
+    std::string getArchiveDir() {
+        if(const char* env_p = std::getenv("ARCHIVE_DIR")) {
+            return env_p;
+        }
+        return "archive";
+    }
     
 }
 
 UserDatabase usersDB;
 std::string currentUserId;
-std::mutex usersDBMutex;
+cfx::ProfiledMutex usersDBMutex;
 std::atomic_bool timeToExit(false);
+std::mutex exitMutex;
+std::condition_variable exitCv;  // wakes the background threads to exit
+int activeWeek = getWeekKey(Clock::now());
+RevenueHistogram revenueHistogram;
+uint64_t usersVersion = 0;  // bumped on every change of names or revenue
+std::shared_ptr<const RankSnapshot> rankSnapshot;
+SessionWheel sessionWheel(currentTick());
+size_t evictCursor = 0;     // next bucket of usersDB to look through
+std::atomic<uint64_t> evictedUsers(0);
+std::atomic<uint64_t> deregisteredUsers(0);
+RatingWindows ratingWindows;
+std::vector<std::shared_ptr<const RankSnapshot>> windowSnapshots;  // one per rating window
+DealReorderBuffer pendingDeals;
+int64_t appliedDealsUpTo = 0;  // latest event time of the applied deals
+std::atomic<uint64_t> dealsApplied(0);
+std::atomic<uint64_t> dealsLate(0);
+std::atomic<uint64_t> dealsDropped(0);
+std::atomic<uint64_t> dealsForced(0);
+std::atomic<uint64_t> dealsMerged(0);
+// The closed week stays with the users until they are settled: by the
+// sweep or by their next change, whichever comes first
+int closingWeek = 0;           // 0 once settled
+size_t unsettledUsers = 0;
+StandingList closingStandings;
+size_t weekSweepCursor = 0;    // next bucket of usersDB to settle
+
+namespace {
+    // Hash table buckets settled per slice of the week sweep
+    const size_t weekSweepBucketsPerPass = 4096;
+
+    // Revenue of [u] in the active week, none while it holds a closed one
+    Rating weekRevenue(const UserInformation& u) {
+        return u.revenueWeek == activeWeek ? u.totalRev : 0;
+    }
+
+    // Waits [d], or less if the manager goes away: true then
+    template <typename Duration>
+    bool waitForExit(const Duration& d) {
+        std::unique_lock<std::mutex> lock { exitMutex };
+        return exitCv.wait_for(lock, d, [] { return timeToExit.load(); });
+    }
+}
 
 UserManager& UserManager::getInstance() {
     static UserManager m;
     return m;
 }
 
-UserManager::UserManager() {
+UserManager::UserManager() : archive(getArchiveDir()) {
+  // settled before a follower applies its first deal
+  ratingWindows = RatingWindows::fromEnvironment();
+  windowSnapshots.resize(ratingWindows.names.size());
+  setDealOrdering();
+  pendingDeals.setCapacity(dealReorderCapacity);
+  activeWeek = getWeekKey(Clock::now() - weekGrace);
+
+  // the state is in place before a follower can ask for a snapshot,
+  // followers themselves get theirs from the leader
+  setStateFile();
+  if (!std::getenv("REPLICA_OF"))
+    loadState();
+
+  // REPLICA_OF=<host>:<port> makes this instance a read-only follower,
+  // REPLICATION_PORT=<port> lets followers attach to it
+  if(const char* env_p = std::getenv("REPLICA_OF")) {
+    std::string leaderAddr = env_p;
+    auto colon = leaderAddr.rfind(':');
+    if (colon == std::string::npos) {
+      throw UserManagerException("REPLICA_OF must be <host>:<port>!");
+    }
+    follower.reset(new ReplicationFollower(leaderAddr.substr(0, colon),
+                                           leaderAddr.substr(colon + 1),
+                                           [this](const Mutation& m) { applyMutation(m); }));
+  }
+  else if (unsigned short port = getReplicationPort()) {
+    leader.reset(new ReplicationLeader(port, usersDBMutex,
+                                       [this] { return snapshotMutations(); }));
+  }
+
   setRatingTimeout();
+
+  // LOCK_PROFILE=1 profiles the users database lock from the start,
+  // otherwise it is switched on through /admin/lockprof
+  if(const char* env_p = std::getenv("LOCK_PROFILE")) {
+    usersDBMutex.enable(std::string(env_p) == "1");
+  }
+
+  // LEADERBOARD_SHM=<name> publishes the rating for local processes
+  if(const char* env_p = std::getenv("LEADERBOARD_SHM")) {
+    setLeaderboardShm();
+    leaderboardShm.reset(new LeaderboardSegment(env_p, leaderboardShmCapacity));
+    std::cout << "Leaderboard segment " << env_p << " holds the top "
+              << leaderboardShmCapacity << " users\n";
+  }
+
   timerThread = std::thread( [=] {
-      while(!timeToExit) {
-	std::this_thread::sleep_for(std::chrono::seconds(ratingTimeout));
+      cfx::CpuPlacement::placeBackgroundThread("rating timer");
+      // with a leaderboard segment the loop wakes up for every publish,
+      // the rating is still printed every RATING_TIMEOUT seconds
+      std::chrono::milliseconds tick = std::chrono::seconds(ratingTimeout);
+      if (leaderboardShm)
+        tick = std::min(tick, std::chrono::milliseconds(leaderboardShmIntervalMs));
+      auto nextReport = std::chrono::steady_clock::now() + std::chrono::seconds(ratingTimeout);
+      while(!waitForExit(tick)) {
+        if (leaderboardShm)
+          publishLeaderboard();
+        if (std::chrono::steady_clock::now() < nextReport)
+          continue;
+        nextReport = std::chrono::steady_clock::now() + std::chrono::seconds(ratingTimeout);
         std::cout << "=== Rating:\n";
-	std::vector<UserDatabaseItem> usrs;
 	RatingRequest req;
         req.userId = currentUserId;
 	try {
@@ -61,16 +301,16 @@ UserManager::UserManager() {
 	    std::cout << "=== TOP " << req.topNum << " ===" << std::endl;
 	    auto i = 1;
 	    for (const auto& u : req.topRated) {
-		std::cout << i << ". " << u.second.name << " --> " << u.second.totalRev << std::endl;
+		std::cout << i << ". " << u.name << " --> " << u.totalRev << std::endl;
 		i++;
 	    }
 	    std::cout << "=== USER " << " ===" << std::endl;
             i = req.bestNeigbourPos;
 	    for (const auto& u : req.neighbours) {
                 std::string mark;
-                if (u.second.id == currentUserId)
+                if (u.id == currentUserId)
                     mark = "* ";
-		std::cout << mark << i << ". " << u.second.name << " --> " << u.second.totalRev << std::endl;
+		std::cout << mark << i << ". " << u.name << " --> " << u.totalRev << std::endl;
 		i++;
 	    }
 	    std::cout << "=== EOF Rating\n";
@@ -81,17 +321,385 @@ UserManager::UserManager() {
 	}
       }
   } );
+
+  setSessionTtl();
+  if (sessionTtl) {
+    sessionThread = std::thread( [=] {
+        cfx::CpuPlacement::placeBackgroundThread("session expiry");
+        while(!waitForExit(std::chrono::seconds(1))) {
+          expireSessions();
+        }
+    } );
+  }
+
+  // only with EVICT_AFTER_WEEKS set, followers get evictions from the leader
+  setEviction();
+  if (evictAfterSec && !follower) {
+    evictionThread = std::thread( [=] {
+        cfx::CpuPlacement::placeBackgroundThread("eviction");
+        auto lastTrim = std::chrono::steady_clock::now();
+        bool freed = false;
+        while(!waitForExit(std::chrono::seconds(1))) {
+          uint64_t before = evictedUsers;
+          evictInactive();
+          freed = freed || evictedUsers != before;
+#ifdef __GLIBC__
+          // hand the pages of evicted users back, outside of any lock
+          if (freed && std::chrono::steady_clock::now() - lastTrim > trimInterval) {
+            malloc_trim(0);
+            lastTrim = std::chrono::steady_clock::now();
+            freed = false;
+          }
+#endif
+        }
+    } );
+  }
+
+  // the closed week is settled in slices, followers settle their own copy
+  weekThread = std::thread( [=] {
+      cfx::CpuPlacement::placeBackgroundThread("week sweep");
+      while(!waitForExit(std::chrono::seconds(1))) {
+        sweepClosedWeek();
+      }
+  } );
+
+  // the buffer is drained for the watermark and for the deals of a new
+  // week that waited out the grace period of the old one
+  if (!follower && (dealReorderDelay.count() || weekGrace.count())) {
+    auto tick = std::chrono::duration_cast<std::chrono::milliseconds>(dealReorderDelay / 2);
+    tick = std::max(std::chrono::milliseconds(10), std::min(std::chrono::milliseconds(1000), tick));
+    if (!dealReorderDelay.count())
+      tick = std::chrono::milliseconds(1000);
+    dealThread = std::thread( [=] {
+        cfx::CpuPlacement::placeBackgroundThread("deal reorder");
+        while(!waitForExit(tick)) {
+          drainDeals();
+        }
+    } );
+  }
 }
 
 UserManager::~UserManager()
 {
-  timeToExit = true;
+  // every thread that can replicate is gone before the leader is
+  {
+    std::unique_lock<std::mutex> lock { exitMutex };
+    timeToExit = true;
+  }
+  exitCv.notify_all();
   timerThread.join();
+  if (sessionThread.joinable())
+    sessionThread.join();
+  if (evictionThread.joinable())
+    evictionThread.join();
+  if (dealThread.joinable())
+    dealThread.join();
+  weekThread.join();
+  follower.reset();
+  // replicate() reads the pointer under the lock, the leader's own threads
+  // take it too, so it is only taken out under the lock
+  std::unique_ptr<ReplicationLeader> stopped;
+  {
+    std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("shutdown") };
+    stopped.swap(leader);
+  }
+}
+
+void UserManager::loadState() {
+  if (stateFile.empty())
+    return;
+  cfx::StartupStage stage("users state");
+  std::unique_ptr<UsersStateReader> reader;
+  try {
+    reader.reset(new UsersStateReader(stateFile));
+  }
+  catch (UsersStateException& e) {
+    stage.detail(e.what());
+    return;
+  }
+
+  auto now = Clock::now();
+  uint32_t bucket = ratingWindows.bucketOf(sinceEpochNs(now));
+  size_t shards = reader->shards();
+  unsigned threads = std::max<unsigned>(1, std::min<size_t>(stateLoadThreads, shards));
+  std::mutex decodedMutex;
+  std::condition_variable decodedCv;
+  std::vector<std::vector<UserInformation>> decoded(shards);
+  std::vector<bool> done(shards, false);
+  std::string failure;
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&] {
+        for (size_t i = next++; i < shards; i = next++) {
+          std::vector<UserInformation> users;
+          std::string error;
+          try {
+            users = reader->shard(i, ratingWindows, bucket);
+          }
+          catch (UsersStateException& e) {
+            error = e.what();
+          }
+          std::unique_lock<std::mutex> lock { decodedMutex };
+          decoded[i].swap(users);
+          if (failure.empty())
+            failure = error;
+          done[i] = true;
+          decodedCv.notify_all();
+        }
+    });
+  }
+
+  std::vector<PendingDeal> waiting;
+  std::string dealsError;
+  try {
+    waiting = reader->deals();
+  }
+  catch (UsersStateException& e) {
+    dealsError = e.what();
+  }
+
+  size_t loaded = 0;
+  std::string error;
+  {
+    std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("loadState") };
+    uint64_t tick = currentTick();
+    // a week that closed while the service was down is archived once loaded
+    int openWeek = activeWeek;
+    activeWeek = std::min(activeWeek, reader->week());
+    usersDB.reserve(reader->users());
+    for (size_t i = 0; i < shards; i++) {
+      std::vector<UserInformation> users;
+      {
+        std::unique_lock<std::mutex> wait { decodedMutex };
+        decodedCv.wait(wait, [&] { return done[i]; });
+        users.swap(decoded[i]);
+        error = failure;
+      }
+      if (!error.empty())
+        break;
+      for (auto& u : users) {
+        // sessions start over with the process, eviction goes by lastSeen
+        u.lastActive = tick;
+        u.revenueWeek = activeWeek;
+        appliedDealsUpTo = std::max(appliedDealsUpTo, sinceEpochNs(u.lastDeal));
+        revenueHistogram.add(u.totalRev);
+        std::string id = u.id;
+        usersDB.emplace(std::move(id), std::move(u));
+      }
+      loaded += users.size();
+    }
+    if (error.empty())
+      error = dealsError;
+    if (error.empty()) {
+      usersVersion++;
+      rollOverWeek(now);
+      // the deals wait again for their week, or count now if it opened
+      // while the service was down
+      for (auto& d : waiting) {
+        auto u = usersDB.find(d.id);
+        if (u == usersDB.end()) {
+          dealsDropped++;
+          continue;
+        }
+        TimePoint at { std::chrono::nanoseconds(d.at) };
+        int week = getWeekKey(at);
+        if (week <= activeWeek)
+          applyDeal(u->second, at, d.amount, now);
+        else if (!pendingDeals.full())
+          pendingDeals.push(week, std::move(d));
+        else
+          pendingDeals.merge(week, std::move(d));
+      }
+    }
+    else {
+      activeWeek = openWeek;
+      UserDatabase().swap(usersDB);
+      revenueHistogram = RevenueHistogram();
+      appliedDealsUpTo = 0;
+      loaded = 0;
+    }
+  }
+  for (auto& w : workers)
+    w.join();
+
+  if (error.empty())
+    stage.detail(std::to_string(loaded) + " users and " + std::to_string(waiting.size()) +
+                 " waiting deals from " + stateFile + ", " + std::to_string(threads) + " threads");
+  else
+    stage.detail(error + " Starting empty");
+}
+
+void UserManager::saveState() {
+  if (stateFile.empty() || follower)
+    return;
+  auto started = std::chrono::steady_clock::now();
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("saveState") };
+  auto now = Clock::now();
+  rollOverWeek(now);
+  finishClosedWeek();
+  // buffered deals of the open week are applied rather than lost, the ones
+  // of the next week are saved with the users and wait again after the load
+  std::vector<PendingDeal> ready;
+  pendingDeals.releaseBefore(activeWeek + 1, ready);
+  for (const auto& d : ready) {
+    auto u = usersDB.find(d.id);
+    if (u == usersDB.end()) {
+      dealsDropped++;
+      continue;
+    }
+    applyDeal(u->second, TimePoint(std::chrono::nanoseconds(d.at)), d.amount, now);
+  }
+  std::vector<PendingDeal> waiting;
+  pendingDeals.copyAll(waiting);
+  try {
+    saveUsersState(stateFile, activeWeek, usersDB, ratingWindows, stateShards, waiting);
+  }
+  catch (UsersStateException& e) {
+    std::cout << e.what() << std::endl;
+    return;
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+  std::cout << "=== Users state saved: " << usersDB.size() << " users, " << waiting.size()
+            << " deals waiting in " << ms << " ms" << std::endl;
+}
+
+void UserManager::prepareRatings() {
+  RatingRequest req;
+  req.topNum = 0;
+  getRating(req);
+  for (const auto& name : ratingWindows.names) {
+    RatingRequest w;
+    w.topNum = 0;
+    w.window = name;
+    getRating(w);
+  }
+  if (leaderboardShm)
+    publishLeaderboard();
+}
+
+void UserManager::evictInactive() {
+  RetiredList retired;
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    Clock::now().time_since_epoch()).count();
+
+  // Only a slice of the buckets is looked through per pass, so the lock is
+  // held for about the same short time whatever the table size
+  // wall time, so the inactivity of users loaded from STATE_FILE counts
+  // from before the restart
+  int64_t before = now - int64_t(evictAfterSec) * 1000000000;
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("evictInactive") };
+  size_t buckets = usersDB.bucket_count();
+  std::vector<UserDatabase::iterator> victims;
+  for (size_t n = 0; n < evictBucketsPerPass && n < buckets; n++) {
+    size_t b = (evictCursor + n) % buckets;
+    for (auto it = usersDB.cbegin(b); it != usersDB.cend(b); ++it) {
+      if (!it->second.connected && it->second.lastSeen < before)
+        victims.push_back(usersDB.find(it->first));
+    }
+  }
+  evictCursor = (evictCursor + evictBucketsPerPass) % buckets;
+
+  for (auto u : victims) {
+    settleWeek(u->second);
+    RetiredUser r;
+    r.id = u->second.id;
+    r.name = u->second.name;
+    r.revenue = u->second.totalRev;
+    r.lastDeal = u->second.lastDeal.time_since_epoch().count();
+    r.retiredAt = now;
+    revenueHistogram.remove(u->second.totalRev);
+    replicate(MutationType::Remove, u->second);
+    if (currentUserId == u->first)
+      currentUserId.clear();
+    usersDB.erase(u);
+    retired.push_back(std::move(r));
+  }
+  if (retired.empty())
+    return;
+  // the next rating drops their rank entries, the current snapshot goes
+  // with the last request holding it
+  usersVersion++;
+  lock.unlock();
+
+  evictedUsers += retired.size();
+  std::cout << "=== Users evicted: " << retired.size() << std::endl;
+  archive.retire(std::move(retired));
+}
+
+DealMetrics UserManager::getDealMetrics() {
+  DealMetrics m;
+  {
+    std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("metrics") };
+    m.buffered = pendingDeals.size();
+  }
+  m.applied = dealsApplied;
+  m.late = dealsLate;
+  m.dropped = dealsDropped;
+  m.forced = dealsForced;
+  m.merged = dealsMerged;
+  return m;
+}
+
+MemoryMetrics UserManager::getMemoryMetrics() {
+  MemoryMetrics m;
+  {
+    std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("metrics") };
+    m.users = usersDB.size();
+  }
+  m.rssBytes = residentBytes();
+  m.evicted = evictedUsers;
+  m.deregistered = deregisteredUsers;
+  return m;
+}
+
+void UserManager::publishLeaderboard() {
+  RatingRequest req;
+  req.topNum = 0;
+  try {
+    getRating(req);
+  }
+  catch(UserManagerException & e) {
+    std::cout << "Failed to publish the leaderboard: " << e.what() << std::endl;
+    return;
+  }
+  // getRating() reuses the snapshot while nothing changed, so an idle
+  // service publishes nothing
+  if (req.snapshot && req.snapshot->version != leaderboardShm->version())
+    leaderboardShm->publish(*req.snapshot);
+}
+
+void UserManager::expireSessions() {
+  std::vector<SessionWheel::Entry> due;
+  size_t expired = 0;
+
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("expireSessions") };
+  uint64_t tick = currentTick();
+  sessionWheel.advance(tick, due);
+  for (const auto& e : due) {
+    auto u = usersDB.find(e.id);
+    if (u == usersDB.end() || !u->second.connected || u->second.session != e.session)
+      continue;
+    // activity since the entry was filed only moved the deadline
+    uint64_t deadline = u->second.lastActive + sessionTtl;
+    if (deadline > tick) {
+      sessionWheel.schedule(e.id, e.session, deadline);
+    }
+    else {
+      u->second.connected = false;
+      replicate(MutationType::Disconnect, u->second);
+      expired++;
+    }
+  }
+  lock.unlock();
+
+  if (expired)
+    std::cout << "=== Sessions expired: " << expired << std::endl;
 }
 
 void UserManager::hadnleUserSetCurrent(const std::string& id)
 {
-    std::unique_lock<std::mutex> lock { usersDBMutex };
+    std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("setCurrent") };
     if (usersDB.find(id) == usersDB.end()) {
       throw UserManagerException("user does not exist!");
     }
@@ -100,65 +708,180 @@ void UserManager::hadnleUserSetCurrent(const std::string& id)
 
 void UserManager::getRating(RatingRequest& req)
 {
-    req.topRated.clear();
-    req.neighbours.clear();
+    req.snapshot.reset();
+    req.topRated = RankRange();
+    req.neighbours = RankRange();
     req.userPos = 0;
     req.bestNeigbourPos = 0;
+    req.topPercent = 0;
+    req.userRating = 0;
+
+    // rolling windows rank by the windowed revenue, which the histogram
+    // doesn't know about, so their positions are always exact
+    int window = -1;
+    if (!req.window.empty()) {
+	window = ratingWindows.find(req.window);
+	if (window < 0) {
+	    throw UserManagerException("unknown rating window!");
+	}
+	req.approximate = false;
+    }
+    auto now = Clock::now();
+    uint32_t bucket = window < 0 ? 0 : ratingWindows.bucketOf(sinceEpochNs(now));
+    // revenue of [u] in the requested rating, windows caught up with the clock
+    auto revenueOf = [&](UserInformation& u) -> Rating {
+	if (window < 0)
+	    return weekRevenue(u);
+	u.windows.advance(ratingWindows, bucket);
+	return u.windows.total(window);
+    };
   
-    std::unique_lock<std::mutex> lock { usersDBMutex };
+    std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("getRating") };
 
     // Check for outdated ratings
-    for(auto& u : usersDB) {
-      if (u.second.totalRev != 0) {
-	if (!isCurrentWeek(u.second.lastDeal)) {
-	  u.second.totalRev = 0;
+    rollOverWeek(now);
+
+    UserDatabase::iterator u = usersDB.end();
+    if (!req.userId.empty()) {
+	u = usersDB.find(req.userId);
+	if (u == usersDB.end()) {
+	    throw UserManagerException("cannot find user rating!");
 	}
-      }
+	req.userRating = revenueOf(u->second);
     }
 
-    // Make sorted snapshot of users database and fill top rated list
-    typedef std::function<bool(const UserDatabaseItem&, const UserDatabaseItem&)> Comparator;
-    Comparator compFunctor =
-	[](const UserDatabaseItem& elem1, const UserDatabaseItem& elem2)
-	{
-	    return elem1.second.totalRev > elem2.second.totalRev;
-	};
-    std::multiset<UserDatabaseItem, Comparator> setOfUsers(
-	usersDB.begin(), usersDB.end(), compFunctor);
+    // Users deep in the tail only get an estimate from the histogram, the
+    // top list comes from the last snapshot of the week even if deals came
+    // in since (without one they get the exact rating, which builds it)
+    if (req.approximate && !req.userId.empty()) {
+	size_t pos = revenueHistogram.approxRank(weekRevenue(u->second));
+	std::shared_ptr<const RankSnapshot> snap = rankSnapshot;
+	if (pos > req.topNum + req.nearNum && snap) {
+	    req.totalUsers = usersDB.size();
+	    lock.unlock();
+	    req.snapshot = snap;
+	    size_t n = std::min(snap->ranks.size(), req.topNum);
+	    req.topRated = RankRange(snap->ranks.data(), snap->ranks.data() + n);
+	    req.userPos = pos;
+	    req.topPercent = 100.0 * pos / req.totalUsers;
+	    return;
+	}
+	req.approximate = false;
+    }
 
-    int n = std::min(setOfUsers.size(), req.topNum);
-    req.topRated.reserve(n);
-    std::copy_n(setOfUsers.begin(), n, std::back_inserter(req.topRated));
-    req.totalUsers = setOfUsers.size();
+    // Reuse the sorted snapshot while nothing changed (a window's also has
+    // to be from the current bucket), otherwise copy the users under the
+    // lock and sort them outside of it
+    std::shared_ptr<const RankSnapshot>& cached = window < 0 ? rankSnapshot : windowSnapshots[window];
+    std::shared_ptr<const RankSnapshot> snap = cached;
+    if (!snap || snap->version != usersVersion || snap->bucket != bucket) {
+	std::shared_ptr<RankSnapshot> fresh = std::make_shared<RankSnapshot>();
+	fresh->version = usersVersion;
+	fresh->bucket = bucket;
+	fresh->ranks.reserve(usersDB.size());
+	for (auto& i : usersDB) {
+	    RankEntry e { i.second.id, i.second.name, revenueOf(i.second) };
+	    fresh->ranks.push_back(std::move(e));
+	}
+	lock.unlock();
+	std::sort(fresh->ranks.begin(), fresh->ranks.end(),
+		  [](const RankEntry& a, const RankEntry& b) { return a.totalRev > b.totalRev; });
+	usersDBMutex.as("getRating.publish");
+	lock.lock();
+	if (!cached || cached->version < fresh->version ||
+	    (cached->version == fresh->version && cached->bucket < fresh->bucket))
+	    cached = fresh;
+	snap = fresh;
+    }
+    lock.unlock();
+
+    const std::vector<RankEntry>& ranks = snap->ranks;
+    req.snapshot = snap;
+    req.totalUsers = ranks.size();
+    size_t n = std::min(ranks.size(), req.topNum);
+    req.topRated = RankRange(ranks.data(), ranks.data() + n);
 
     // If requested fill rating for the particular user
     if (!req.userId.empty()) {
-	auto it = std::find_if(setOfUsers.begin(),
-			       setOfUsers.end(),
-			       [&](const UserDatabaseItem& p ) { return p.second.id == req.userId;});
-	if (it == setOfUsers.end()) {
+	// the user's revenue is the one it has in the snapshot, so only the
+	// users sharing it need to be looked through
+	auto same = std::equal_range(ranks.begin(), ranks.end(), RankEntry { "", "", req.userRating },
+				     [](const RankEntry& a, const RankEntry& b) { return a.totalRev > b.totalRev; });
+	auto it = std::find_if(same.first, same.second,
+			       [&](const RankEntry& e) { return e.id == req.userId; });
+	if (it == same.second) {
 	    throw UserManagerException("cannot find user rating!");
 	}
-	auto fit = next(it);
-	auto bit = it;
-	if (bit != setOfUsers.begin())
-	    bit = prev(bit);
-	for (int i = 0; i < req.nearNum - 1; i++)
-	{
-	    if (fit != setOfUsers.end())
-		fit = next(fit);
-	    if (bit != setOfUsers.begin())
-		bit = prev(bit);
-	    if (fit == setOfUsers.end() && bit == setOfUsers.begin())
-		break;
+	size_t pos = it - ranks.begin();
+	size_t first = pos > req.nearNum ? pos - req.nearNum : 0;
+	size_t last = std::min(ranks.size(), pos + req.nearNum + 1);
+	req.bestNeigbourPos = first + 1;
+	req.userPos = pos + 1;
+	req.neighbours = RankRange(ranks.data() + first, ranks.data() + last);
+	req.topPercent = 100.0 * req.userPos / req.totalUsers;
+    }
+}
+
+void UserManager::getPartialRating(PartialRatingRequest& req)
+{
+    req.topRated.clear();
+    req.higher.clear();
+    req.lower.clear();
+    req.above = 0;
+
+    typedef const UserDatabase::value_type* ItemPtr;
+    auto byRevenue = [](ItemPtr a, ItemPtr b) { return weekRevenue(a->second) > weekRevenue(b->second); };
+    // copies of the users, with the revenue of the active week
+    auto copy = [](UserList& to, ItemPtr u) {
+	to.push_back(*u);
+	to.back().second.totalRev = weekRevenue(u->second);
+    };
+    std::vector<ItemPtr> items, higher, lower;
+
+    std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("getPartialRating") };
+    rollOverWeek(Clock::now());
+
+    // Only the requested slices get ordered: top of the partition and the
+    // users closest to the pivot from either side
+    items.reserve(usersDB.size());
+    for (const auto& u : usersDB) {
+	items.push_back(&u);
+	if (!req.withPivot || u.first == req.userId)
+	    continue;
+	if (weekRevenue(u.second) > req.pivot) {
+	    higher.push_back(&u);
+	    req.above++;
+	}
+	else {
+	    lower.push_back(&u);
 	}
-	if (fit != setOfUsers.end())
-	    fit = next(fit);
-	req.bestNeigbourPos = std::distance(setOfUsers.begin(), bit) + 1;
-	req.userPos = req.bestNeigbourPos + std::distance(bit, it);
-	req.neighbours.reserve(std::distance(bit, fit));
-        std::copy(bit, fit, std::back_inserter(req.neighbours));
     }
+    req.totalUsers = usersDB.size();
+
+    size_t n = std::min(items.size(), req.topNum);
+    std::partial_sort(items.begin(), items.begin() + n, items.end(), byRevenue);
+    for (size_t i = 0; i < n; i++)
+	copy(req.topRated, items[i]);
+
+    n = std::min(higher.size(), req.nearNum);
+    std::partial_sort(higher.begin(), higher.begin() + n, higher.end(),
+		      [&](ItemPtr a, ItemPtr b) { return byRevenue(b, a); });
+    for (size_t i = n; i > 0; i--)
+	copy(req.higher, higher[i - 1]);
+
+    n = std::min(lower.size(), req.nearNum);
+    std::partial_sort(lower.begin(), lower.begin() + n, lower.end(), byRevenue);
+    for (size_t i = 0; i < n; i++)
+	copy(req.lower, lower[i]);
+}
+
+Rating UserManager::getRevenuePercentile(double p) {
+  if (!(p >= 0 && p <= 100)) {
+    throw UserManagerException("percentile out of range!");
+  }
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("percentile") };
+  rollOverWeek(Clock::now());
+  return revenueHistogram.percentile(p);
 }
 
 void UserManager::registerUser(const std::string& id,
@@ -172,7 +895,7 @@ void UserManager::registerUser(const std::string& id,
     throw UserManagerException("empty user name!");
   }
 
-  std::unique_lock<std::mutex> lock { usersDBMutex };
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("register") };
 
   if (usersDB.find(id) != usersDB.end()) {
     throw UserManagerException("user already exists!");
@@ -180,11 +903,77 @@ void UserManager::registerUser(const std::string& id,
   UserInformation ui;
   ui.id = id;
   ui.name = name;
+  ui.lastActive = currentTick();
+  ui.lastSeen = sinceEpochNs(Clock::now());
+  ui.revenueWeek = activeWeek;
   usersDB.insert(UserDatabaseItem(id, ui));
+  usersVersion++;
+  revenueHistogram.add(0);
+  replicate(MutationType::Upsert, ui);
+}
+
+size_t UserManager::importUsers(std::vector<ImportRow>& rows, std::vector<ImportError>& errors) {
+  auto now = Clock::now();
+  uint64_t tick = currentTick();
+  size_t imported = 0;
+
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("import") };
+  rollOverWeek(now);
+  usersDB.reserve(usersDB.size() + rows.size());
+  for (auto& r : rows) {
+    auto res = usersDB.emplace(r.id, UserInformation());
+    if (!res.second) {
+      ImportError e;
+      e.line = r.line;
+      e.message = "user already exists!";
+      errors.push_back(std::move(e));
+      continue;
+    }
+    UserInformation& ui = res.first->second;
+    ui.id = std::move(r.id);
+    ui.name = std::move(r.name);
+    ui.lastActive = tick;
+    ui.lastSeen = sinceEpochNs(now);
+    ui.revenueWeek = activeWeek;
+    if (r.revenue != 0) {
+      ui.totalRev = r.revenue;
+      ui.lastDeal = now;
+    }
+    revenueHistogram.add(ui.totalRev);
+    replicate(MutationType::Upsert, ui);
+    imported++;
+  }
+  if (imported)
+    usersVersion++;
+  return imported;
+}
+
+void UserManager::reserveUsers(size_t expected) {
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("reserve") };
+  usersDB.reserve(usersDB.size() + expected);
+}
+
+void UserManager::deregisterUser(const std::string& id) {
+  if (id.empty()) {
+    throw UserManagerException("empty user id!");
+  }
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("deregister") };
+  auto u = usersDB.find(id);
+  if (u == usersDB.end()) {
+    throw UserManagerException("user not registered!");
+  }
+  settleWeek(u->second);
+  revenueHistogram.remove(u->second.totalRev);
+  replicate(MutationType::Remove, u->second);
+  if (currentUserId == id)
+    currentUserId.clear();
+  usersDB.erase(u);
+  usersVersion++;
+  deregisteredUsers++;
 }
 
 void UserManager::hadnleUserConnected(const std::string& id) {
-  std::unique_lock<std::mutex> lock { usersDBMutex };
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("connect") };
   auto u = usersDB.find(id);
   if (u == usersDB.end()) {
     throw UserManagerException("user not registered!");
@@ -194,10 +983,17 @@ void UserManager::hadnleUserConnected(const std::string& id) {
   }
 
   u->second.connected = true;
+  u->second.lastActive = currentTick();
+  u->second.lastSeen = sinceEpochNs(Clock::now());
+  if (sessionTtl) {
+    u->second.session++;
+    sessionWheel.schedule(id, u->second.session, u->second.lastActive + sessionTtl);
+  }
+  replicate(MutationType::Connect, u->second);
 }
 
 void UserManager::hadnleUserDisconnected(const std::string& id) {
-  std::unique_lock<std::mutex> lock { usersDBMutex };
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("disconnect") };
   auto u = usersDB.find(id);
   if (u == usersDB.end()) {
     throw UserManagerException("user not registered!");
@@ -206,6 +1002,7 @@ void UserManager::hadnleUserDisconnected(const std::string& id) {
     throw UserManagerException("user not connected!");
   }
   u->second.connected = false;
+  replicate(MutationType::Disconnect, u->second);
 }
 
 void UserManager::hadnleUserRenamed(const std::string& id,
@@ -217,16 +1014,18 @@ void UserManager::hadnleUserRenamed(const std::string& id,
   if (newName.empty()) {
     throw UserManagerException("empty user name!");
   }
-  std::unique_lock<std::mutex> lock { usersDBMutex };
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("rename") };
   auto u = usersDB.find(id);
   if (u == usersDB.end()) {
     throw UserManagerException("user not registered!");
   }
   u->second.name = newName;
+  usersVersion++;
+  replicate(MutationType::Rename, u->second);
 }
 
 void UserManager::hadnleUserDial(const std::string& id, const TimePoint& tp, const Rating& val) {
-  std::unique_lock<std::mutex> lock { usersDBMutex };
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("deal") };
   auto u = usersDB.find(id);
   if (u == usersDB.end()) {
     throw UserManagerException("user not registered!");
@@ -234,11 +1033,285 @@ void UserManager::hadnleUserDial(const std::string& id, const TimePoint& tp, con
   if (!u->second.connected) {
     throw UserManagerException("user not connected!");
   }
-  if (u->second.totalRev != 0 && !isCurrentWeek(u->second.lastDeal)) {
-    u->second.totalRev = 0;
+  u->second.lastActive = currentTick();
+  auto now = Clock::now();
+  u->second.lastSeen = sinceEpochNs(now);
+  rollOverWeek(now);
+
+  // event times ahead of the clock are taken as now
+  TimePoint at = std::min<TimePoint>(tp, now);
+  int week = getWeekKey(at);
+  bool behind = sinceEpochNs(at) < appliedDealsUpTo;
+  // deals of a week that isn't open yet have to wait, the others only if
+  // they are to be ordered and aren't behind the applied ones already
+  if (week > activeWeek || (dealReorderDelay.count() && week == activeWeek && !behind)) {
+    PendingDeal d;
+    d.id = id;
+    d.at = sinceEpochNs(at);
+    d.amount = val;
+    if (!pendingDeals.full()) {
+      pendingDeals.push(week, std::move(d));
+      return;
+    }
+    // with no room left the next week's deals still wait, one per user
+    if (week > activeWeek) {
+      pendingDeals.merge(week, std::move(d));
+      dealsMerged++;
+      return;
+    }
+    dealsForced++;
+  }
+  applyDeal(u->second, at, val, now);
+}
+
+void UserManager::applyDeal(UserInformation& u, const TimePoint& at, Rating val, const TimePoint& now) {
+  int64_t atNs = sinceEpochNs(at);
+  if (atNs < appliedDealsUpTo)
+    dealsLate++;
+  else
+    appliedDealsUpTo = atNs;
+
+  // a deal of last week still counts in the windows reaching back to it
+  uint32_t bucket = ratingWindows.bucketOf(sinceEpochNs(now));
+  u.windows.advance(ratingWindows, bucket);
+  bool windowed = u.windows.add(ratingWindows, bucket, ratingWindows.bucketOf(atNs), val);
+  bool weekly = getWeekKey(at) == activeWeek;
+  if (!weekly && !windowed) {
+    dealsDropped++;
+    return;
+  }
+  if (weekly) {
+    settleWeek(u);
+    revenueHistogram.move(u.totalRev, u.totalRev + val);
+    u.totalRev += val;
+  }
+  usersVersion++;
+  // a late deal doesn't move the last deal back
+  u.lastDeal = std::max(u.lastDeal, at);
+  replicate(MutationType::Deal, u, val, at);
+  dealsApplied++;
+}
+
+void UserManager::drainDeals() {
+  std::vector<PendingDeal> ready;
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("drainDeals") };
+  auto now = Clock::now();
+  rollOverWeek(now);
+  // deals whose week closed while they waited still count in the windows
+  pendingDeals.releaseBefore(activeWeek, ready);
+  pendingDeals.release(activeWeek, sinceEpochNs(now - dealReorderDelay), ready);
+  for (const auto& d : ready) {
+    auto u = usersDB.find(d.id);
+    if (u == usersDB.end()) {
+      dealsDropped++;
+      continue;
+    }
+    applyDeal(u->second, TimePoint(std::chrono::nanoseconds(d.at)), d.amount, now);
+  }
+}
+
+void UserManager::rollOverWeek(const TimePoint& now) {
+  int week = getWeekKey(now - weekGrace);
+  if (week == activeWeek)
+    return;
+
+  // a week still being settled is done with at once, two never overlap
+  if (closingWeek)
+    finishClosedWeek();
+  // The users keep the revenue of the closed week for now, it reads as
+  // none, so closing takes the same short time whatever the table size.
+  // The standings are collected as the users are settled.
+  closingWeek = activeWeek;
+  unsettledUsers = usersDB.size();
+  closingStandings.clear();
+  revenueHistogram.reset();
+  usersVersion++;
+  // the top list of the closed week isn't served as an approximate one
+  rankSnapshot.reset();
+  activeWeek = week;
+  if (!unsettledUsers)
+    finishClosedWeek();
+}
+
+void UserManager::settleWeek(UserInformation& u) {
+  if (u.revenueWeek == activeWeek)
+    return;
+  if (u.revenueWeek == closingWeek && closingWeek) {
+    // the leader owns the archive, followers close the week on their own clock
+    if (!follower && u.totalRev != 0 && getWeekKey(u.lastDeal) == closingWeek) {
+      ArchivedStanding s;
+      s.id = u.id;
+      s.revenue = u.totalRev;
+      closingStandings.push_back(std::move(s));
+    }
+    unsettledUsers--;
+  }
+  u.totalRev = 0;
+  u.revenueWeek = activeWeek;
+  if (closingWeek && !unsettledUsers)
+    finishClosedWeek();
+}
+
+void UserManager::finishClosedWeek() {
+  if (!closingWeek)
+    return;
+  if (unsettledUsers) {
+    for (auto& u : usersDB) {
+      settleWeek(u.second);
+      if (!closingWeek)
+        return;
+    }
+  }
+  int week = closingWeek;
+  closingWeek = 0;
+  unsettledUsers = 0;
+  // encoding and I/O are left to the archive worker
+  if (!follower)
+    archive.submit(week, std::move(closingStandings));
+  closingStandings = StandingList();
+}
+
+void UserManager::sweepClosedWeek() {
+  while (!timeToExit) {
+    std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("sweepWeek") };
+    // weeks close on time without requests too
+    rollOverWeek(Clock::now());
+    if (!closingWeek)
+      return;
+    size_t buckets = usersDB.bucket_count();
+    for (size_t n = 0; n < weekSweepBucketsPerPass && n < buckets && closingWeek; n++) {
+      size_t b = (weekSweepCursor + n) % buckets;
+      for (auto it = usersDB.begin(b); it != usersDB.end(b); ++it)
+        settleWeek(it->second);
+    }
+    weekSweepCursor = (weekSweepCursor + weekSweepBucketsPerPass) % buckets;
+  }
+}
+
+std::vector<int> UserManager::getArchivedWeeks() {
+  return archive.weeks();
+}
+
+std::vector<ArchivedEntry> UserManager::getArchivedTop(int week, size_t n) {
+  return archive.top(week, n);
+}
+
+std::vector<ArchivedEntry> UserManager::getArchivedRanks(const std::string& id) {
+  return archive.userRanks(id);
+}
+
+const RatingWindows& UserManager::getRatingWindows() const {
+  return ratingWindows;
+}
+
+cfx::LockProfile UserManager::getLockProfile(size_t topBlocking) {
+  return usersDBMutex.profile(topBlocking);
+}
+
+void UserManager::setLockProfiling(bool on) {
+  usersDBMutex.enable(on);
+}
+
+void UserManager::resetLockProfile() {
+  usersDBMutex.reset();
+}
+
+bool UserManager::getRetiredUser(const std::string& id, RetiredUser& res) {
+  return archive.findRetired(id, res);
+}
+
+void UserManager::replicate(MutationType type, const UserInformation& u, Rating amount, const TimePoint& dealAt) {
+  if (!leader)
+    return;
+  Mutation m;
+  m.type = type;
+  m.id = u.id;
+  if (type == MutationType::Upsert || type == MutationType::Rename)
+    m.name = u.name;
+  m.connected = u.connected;
+  m.revenue = weekRevenue(u);
+  m.lastDeal = u.lastDeal.time_since_epoch().count();
+  m.amount = amount;
+  m.dealAt = sinceEpochNs(dealAt);
+  leader->publish(std::move(m));
+}
+
+std::vector<Mutation> UserManager::snapshotMutations() {
+  std::vector<Mutation> res;
+  res.reserve(usersDB.size());
+  for (const auto& u : usersDB) {
+    Mutation m;
+    m.type = MutationType::Upsert;
+    m.id = u.second.id;
+    m.name = u.second.name;
+    m.connected = u.second.connected;
+    m.revenue = weekRevenue(u.second);
+    m.lastDeal = u.second.lastDeal.time_since_epoch().count();
+    res.push_back(m);
+    // the windows follow as one deal per bucket
+    m.type = MutationType::Deal;
+    m.name.clear();
+    for (const auto& b : u.second.windows.buckets()) {
+      m.amount = b.amount;
+      m.dealAt = ratingWindows.bucketStartNs(b.index);
+      res.push_back(m);
+    }
+  }
+  return res;
+}
+
+void UserManager::applyMutation(const Mutation& m) {
+  std::unique_lock<cfx::ProfiledMutex> lock { usersDBMutex.as("applyMutation") };
+  usersVersion++;
+  if (m.type == MutationType::SnapshotBegin) {
+    usersDB.clear();
+    revenueHistogram = RevenueHistogram();
+    closingWeek = 0;
+    unsettledUsers = 0;
+    closingStandings.clear();
+    return;
   }
-  if (isCurrentWeek(tp)) {
-    u->second.totalRev += val;
-    u->second.lastDeal = tp;
+
+  auto u = usersDB.find(m.id);
+  if (u == usersDB.end()) {
+    if (m.type != MutationType::Upsert)
+      return;
+    u = usersDB.insert(UserDatabaseItem(m.id, UserInformation(m.id, m.name))).first;
+    u->second.revenueWeek = activeWeek;
+    revenueHistogram.add(0);
+  }
+  settleWeek(u->second);
+
+  switch (m.type) {
+  case MutationType::Remove:
+    revenueHistogram.remove(u->second.totalRev);
+    usersDB.erase(u);
+    return;
+  case MutationType::Upsert:
+  case MutationType::Rename:
+    u->second.name = m.name;
+    break;
+  default:
+    break;
   }
+  revenueHistogram.move(u->second.totalRev, m.revenue);
+  u->second.totalRev = m.revenue;
+  u->second.lastDeal = TimePoint(std::chrono::nanoseconds(m.lastDeal));
+  u->second.connected = m.connected;
+  if (m.type == MutationType::Deal && m.amount != 0) {
+    // followers slide the windows on their own clock, like they close weeks
+    uint32_t bucket = ratingWindows.bucketOf(sinceEpochNs(Clock::now()));
+    u->second.windows.advance(ratingWindows, bucket);
+    u->second.windows.add(ratingWindows, bucket, ratingWindows.bucketOf(m.dealAt), m.amount);
+  }
+}
+
+ReplicationStatus UserManager::getReplicationStatus() {
+  if (leader)
+    return leader->status();
+  if (follower)
+    return follower->status();
+  ReplicationStatus s;
+  s.role = "standalone";
+  return s;
 }
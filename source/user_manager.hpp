@@ -7,6 +7,11 @@
 
 #include <std_micro_service.hpp>
 
+#include "leaderboard_archive.hpp"
+#include "rating_windows.hpp"
+#include "replication.hpp"
+#include "user_import.hpp"
+
 using Clock = std::chrono::system_clock;
 using TimePoint = std::chrono::time_point<Clock, std::chrono::nanoseconds>;
 using Rating = float;
@@ -21,6 +26,11 @@ struct UserInformation {
   TimePoint lastDeal;
   Rating totalRev;
   bool connected;
+  uint32_t session = 0;     // incremented on every connect, tells stale session wheel entries apart
+  uint64_t lastActive = 0;  // session wheel tick of the registration, last connect or deal
+  int64_t lastSeen = 0;     // the same in wall time (ns since epoch), kept across restarts
+  int revenueWeek = 0;      // week totalRev counts for, until a closed one is settled
+  WindowedRevenue windows;  // deals of the rolling rating windows
 };
 
 
@@ -29,15 +39,88 @@ using UserDatabaseItem = std::pair<std::string, UserInformation>;
 using UserList = std::vector<UserDatabaseItem>;
 
 
+// One row of the rating
+struct RankEntry {
+  std::string id;
+  std::string name;
+  Rating totalRev;
+};
+
+// Immutable, sorted copy of the rating shared by all requests until the
+// users database changes
+struct RankSnapshot {
+  uint64_t version = 0;        // users database version the snapshot was taken at
+  uint32_t bucket = 0;         // time bucket a rolling window's snapshot was taken in
+  std::vector<RankEntry> ranks;
+};
+
+// View of consecutive rows of a RankSnapshot
+class RankRange {
+public:
+  RankRange() : first(nullptr), last(nullptr) {}
+  RankRange(const RankEntry* first, const RankEntry* last) : first(first), last(last) {}
+
+  const RankEntry* begin() const { return first; }
+  const RankEntry* end() const { return last; }
+  size_t size() const { return last - first; }
+  bool empty() const { return first == last; }
+  const RankEntry& operator[](size_t i) const { return first[i]; }
+
+private:
+  const RankEntry* first;
+  const RankEntry* last;
+};
+
 struct RatingRequest {
-  UserList topRated;           // OUT: first [topNum] users in the rating 
-  UserList neighbours;         // OUT: [userId] and +/- [nearNum] users in the rating  
+  std::shared_ptr<const RankSnapshot> snapshot; // OUT: rating the lists below point into
+  RankRange topRated;          // OUT: first [topNum] users in the rating 
+  RankRange neighbours;        // OUT: [userId] and +/- [nearNum] users in the rating  
   std::string userId;          // IN: ID of the user to get rating for
+  std::string window;          // IN: rolling window (one of RATING_WINDOWS), empty for the calendar week
   size_t userPos = 0;          // OUT: [userId] position in the rating
   size_t bestNeigbourPos = 0;  // OUT: position of the user with the highest rating from +/- [nearNum] group
   size_t topNum = 10;          // IN: number of users in the top list
   size_t nearNum = 10;         // IN: number of users with higher and lower rating than [userId] to be included in the list
   size_t totalUsers = 0;       // OUT: number of users in the database
+  bool approximate = false;    // IN/OUT: allow an estimated [userPos] for users far from the top,
+                               //   stays set only if the estimate was used (lists are left empty then)
+  double topPercent = 0;       // OUT: [userPos] as a percentage of [totalUsers]
+  Rating userRating = 0;       // OUT: revenue of [userId] in the week or [window]
+};
+
+// Share of one partition in a rating merged across the cluster
+struct PartialRatingRequest {
+  UserList topRated;           // OUT: first [topNum] users of this partition
+  UserList higher;             // OUT: up to [nearNum] users right above [pivot], highest first
+  UserList lower;              // OUT: up to [nearNum] users right at or below [pivot] except [userId], highest first
+  std::string userId;          // IN: user the neighbours are collected for (may live in another partition)
+  Rating pivot = 0;            // IN: revenue of [userId]
+  bool withPivot = false;      // IN: fill [above], [higher] and [lower]
+  size_t topNum = 10;          // IN: number of users in the top list
+  size_t nearNum = 10;         // IN: number of neighbours on each side of [pivot]
+  size_t above = 0;            // OUT: number of users with revenue above [pivot]
+  size_t totalUsers = 0;       // OUT: number of users in this partition
+};
+
+class LeaderboardSegment;
+
+struct MemoryMetrics {
+  size_t users = 0;            // users in the live table
+  uint64_t rssBytes = 0;       // resident memory of the process
+  uint64_t evicted = 0;        // users evicted for inactivity since start
+  uint64_t deregistered = 0;   // users deregistered since start
+};
+
+// Deal ingestion counters since start
+struct DealMetrics {
+  size_t buffered = 0;         // deals waiting in the reorder buffer
+  uint64_t applied = 0;        // deals counted in the week or a window
+  uint64_t late = 0;           // applied behind a deal with a later event time
+  uint64_t dropped = 0;        // deals counted nowhere: week closed and out of
+                               //   every window, or user gone
+  uint64_t forced = 0;         // applied right away as the buffer was full
+  uint64_t merged = 0;         // next week deals merged per user as the buffer
+                               //   was full
 };
 
 class UserManagerException : public std::exception {
@@ -60,6 +143,17 @@ public:
   void registerUser(const std::string& id,
 		    const std::string& name);
 
+  // Registers the rows of one import chunk under a single lock, rows that
+  // can't be registered are appended to [errors]. Returns the number of
+  // registered users.
+  size_t importUsers(std::vector<ImportRow>& rows, std::vector<ImportError>& errors);
+
+  // Grows the user table for [expected] more users at once
+  void reserveUsers(size_t expected);
+
+  // Removes the user from the live table (archived weeks keep it)
+  void deregisterUser(const std::string& id);
+
   void hadnleUserConnected(const std::string& id);
 
   void hadnleUserDisconnected(const std::string& id);
@@ -73,12 +167,106 @@ public:
 
   void getRating(RatingRequest& req);
 
+  void getPartialRating(PartialRatingRequest& req);
+
+  // Estimated revenue at percentile [p] of all users
+  Rating getRevenuePercentile(double p);
+
+  std::vector<int> getArchivedWeeks();
+
+  std::vector<ArchivedEntry> getArchivedTop(int week, size_t n);
+
+  std::vector<ArchivedEntry> getArchivedRanks(const std::string& id);
+
+  const RatingWindows& getRatingWindows() const;
+
+  // Last state of [id] when it was evicted, false if it never was
+  bool getRetiredUser(const std::string& id, RetiredUser& res);
+
+  // Followers only apply the leader's log and must not be written to directly
+  bool isReplica() const { return follower != nullptr; }
+
+  ReplicationStatus getReplicationStatus();
+
+  MemoryMetrics getMemoryMetrics();
+
+  DealMetrics getDealMetrics();
+
+  // Contention profile of the users database lock, with the [topBlocking]
+  // worst waiter/holder pairs
+  cfx::LockProfile getLockProfile(size_t topBlocking);
+
+  void setLockProfiling(bool on);
+
+  void resetLockProfile();
+
+  // Builds the rank snapshots of the week and of every window (and
+  // publishes the leaderboard segment), so first requests find them ready
+  void prepareRatings();
+
+  // Writes the live users and the deals waiting for the next week into
+  // STATE_FILE for the next start
+  void saveState();
+
 private:
 
   UserManager();
   ~UserManager();
 
+  // Closes the active week once [now] is past it by the grace period
+  // (usersDBMutex must be held)
+  void rollOverWeek(const TimePoint& now);
+
+  // Moves the revenue [u] still holds from the closed week into its
+  // standings (usersDBMutex must be held)
+  void settleWeek(UserInformation& u);
+
+  // Settles the closed week slice by slice, letting other requests in
+  // between, and hands its standings to the archive
+  void sweepClosedWeek();
+
+  // Settles whatever is left of the closed week in one pass
+  // (usersDBMutex must be held)
+  void finishClosedWeek();
+
+  // Counts a deal of [u] made at [at] in the week and the windows
+  // (usersDBMutex must be held)
+  void applyDeal(UserInformation& u, const TimePoint& at, Rating val, const TimePoint& now);
+
+  // Applies the buffered deals the watermark passed
+  void drainDeals();
+
+  // Loads STATE_FILE, decoding its shards side by side while the user
+  // table takes them in order
+  void loadState();
+
+  // Disconnects users idle for longer than SESSION_TTL
+  void expireSessions();
+
+  // One incremental pass of evicting users inactive for EVICT_AFTER_WEEKS
+  void evictInactive();
+
+  // Ships a change of [u] to the followers (usersDBMutex must be held),
+  // a Deal with its [amount] made at [dealAt]
+  void replicate(MutationType type, const UserInformation& u, Rating amount = 0, const TimePoint& dealAt = TimePoint());
+
+  // Full user records for a new follower (usersDBMutex must be held)
+  std::vector<Mutation> snapshotMutations();
+
+  void applyMutation(const Mutation& m);
+
+  // Refreshes the shared-memory leaderboard if the rating changed
+  void publishLeaderboard();
+
+  LeaderboardArchive archive;
+  std::unique_ptr<ReplicationLeader> leader;
+  std::unique_ptr<ReplicationFollower> follower;
+  std::unique_ptr<LeaderboardSegment> leaderboardShm;
   std::thread timerThread;
+  std::thread sessionThread;
+  std::thread evictionThread;
+  std::thread dealThread;
+  std::thread weekThread;
 
 
 };
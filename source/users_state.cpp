@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "leaderboard_archive.hpp"
+#include "users_state.hpp"
+
+namespace {
+    const uint8_t magic[4] = {'M', 'S', 'S', 'T'};
+    const uint8_t version = 3;
+    const size_t headerSize = 48;
+    const size_t dealsFieldOffset = 32;
+    const size_t shardEntrySize = 16;
+    const size_t recordFixedSize = 26;
+    const size_t bucketSize = 8;
+    const size_t dealFixedSize = 14;
+
+    template <typename T>
+    void put(std::string& buf, T v) {
+        buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    template <typename T>
+    T get(const uint8_t* p) {
+        T v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+}
+
+void saveUsersState(const std::string& path, int week, const UserDatabase& users,
+                    const RatingWindows& w, size_t shards,
+                    const std::vector<PendingDeal>& deals) {
+    shards = std::max<size_t>(1, std::min(shards, users.size()));
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw UsersStateException("cannot write users state " + tmp + "!");
+    }
+
+    // the deals offset and the shard table are filled in once the shards
+    // are written
+    std::string header;
+    header.append(reinterpret_cast<const char*>(magic), sizeof(magic));
+    header.append(1, char(version));
+    header.append(3, '\0');
+    put(header, int32_t(week));
+    put(header, uint32_t(shards));
+    put(header, uint64_t(users.size()));
+    put(header, int64_t(w.bucketSec));
+    put(header, uint64_t(0));
+    put(header, uint64_t(deals.size()));
+    header.append(shards * shardEntrySize, '\0');
+    out.write(header.data(), header.size());
+
+    std::vector<uint64_t> offsets, counts;
+    size_t perShard = (users.size() + shards - 1) / shards;
+    uint64_t offset = header.size();
+    std::string buf;
+    auto u = users.begin();
+    for (size_t s = 0; s < shards; s++) {
+        offsets.push_back(offset);
+        uint64_t n = 0;
+        buf.clear();
+        for (; u != users.end() && n < perShard; ++u, ++n) {
+            const UserInformation& ui = u->second;
+            const auto& buckets = ui.windows.buckets();
+            uint16_t idLength = static_cast<uint16_t>(std::min<size_t>(ui.id.size(), 0xFFFF));
+            uint16_t nameLength = static_cast<uint16_t>(std::min<size_t>(ui.name.size(), 0xFFFF));
+            put(buf, idLength);
+            put(buf, nameLength);
+            put(buf, ui.totalRev);
+            put(buf, int64_t(ui.lastDeal.time_since_epoch().count()));
+            put(buf, ui.lastSeen);
+            put(buf, uint16_t(buckets.size()));
+            buf.append(ui.id, 0, idLength);
+            buf.append(ui.name, 0, nameLength);
+            for (const auto& b : buckets) {
+                put(buf, b.index);
+                put(buf, b.amount);
+            }
+            // written in pieces so a shard is never held in memory as a whole
+            if (buf.size() >= (1 << 20)) {
+                out.write(buf.data(), buf.size());
+                offset += buf.size();
+                buf.clear();
+            }
+        }
+        out.write(buf.data(), buf.size());
+        offset += buf.size();
+        counts.push_back(n);
+    }
+
+    uint64_t dealsOffset = offset;
+    buf.clear();
+    for (const auto& d : deals) {
+        uint16_t idLength = static_cast<uint16_t>(std::min<size_t>(d.id.size(), 0xFFFF));
+        put(buf, idLength);
+        put(buf, d.amount);
+        put(buf, d.at);
+        buf.append(d.id, 0, idLength);
+    }
+    out.write(buf.data(), buf.size());
+
+    std::string table;
+    put(table, dealsOffset);
+    put(table, uint64_t(deals.size()));
+    for (size_t s = 0; s < shards; s++) {
+        put(table, offsets[s]);
+        put(table, counts[s]);
+    }
+    out.seekp(dealsFieldOffset);
+    out.write(table.data(), table.size());
+    out.close();
+    if (!out || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        throw UsersStateException("cannot write users state " + path + "!");
+    }
+}
+
+UsersStateReader::UsersStateReader(const std::string& path) : _path(path) {
+    try {
+        _file.reset(new MappedFile(path));
+    }
+    catch (LeaderboardArchiveException& e) {
+        throw UsersStateException("cannot read users state " + path + "!");
+    }
+    const uint8_t* p = _file->data();
+    size_t size = _file->size();
+    if (size < headerSize || std::memcmp(p, magic, sizeof(magic)) != 0 || p[4] != version) {
+        throw UsersStateException(path + " is not a users state file!");
+    }
+    _week = get<int32_t>(p + 8);
+    uint32_t shards = get<uint32_t>(p + 12);
+    _users = get<uint64_t>(p + 16);
+    _bucketSec = get<int64_t>(p + 24);
+    _dealsOffset = get<uint64_t>(p + dealsFieldOffset);
+    _deals = get<uint64_t>(p + dealsFieldOffset + 8);
+    if (_dealsOffset > size) {
+        throw UsersStateException("bad deals offset in " + path + "!");
+    }
+    if (shards > (size - headerSize) / shardEntrySize) {
+        throw UsersStateException("bad shard table in " + path + "!");
+    }
+    uint64_t total = 0;
+    for (uint32_t s = 0; s < shards; s++) {
+        Shard sh;
+        sh.offset = get<uint64_t>(p + headerSize + s * shardEntrySize);
+        sh.users = get<uint64_t>(p + headerSize + s * shardEntrySize + 8);
+        if (sh.offset > size) {
+            throw UsersStateException("bad shard table in " + path + "!");
+        }
+        total += sh.users;
+        _shards.push_back(sh);
+    }
+    if (total != _users) {
+        throw UsersStateException("bad shard table in " + path + "!");
+    }
+}
+
+UsersStateReader::~UsersStateReader() {
+}
+
+std::vector<UserInformation> UsersStateReader::shard(size_t i, const RatingWindows& w, uint32_t now) const {
+    const uint8_t* p = _file->data() + _shards[i].offset;
+    const uint8_t* end = _file->data() + _file->size();
+    // bucket indices are only meaningful with the bucket length they were taken with
+    bool windows = _bucketSec == w.bucketSec && w.horizon;
+    auto bad = [&] {
+        return UsersStateException("truncated shard " + std::to_string(i) + " in " + _path + "!");
+    };
+
+    std::vector<UserInformation> users(_shards[i].users);
+    for (auto& u : users) {
+        if (size_t(end - p) < recordFixedSize)
+            throw bad();
+        uint16_t idLength = get<uint16_t>(p);
+        uint16_t nameLength = get<uint16_t>(p + 2);
+        u.totalRev = get<float>(p + 4);
+        u.lastDeal = TimePoint(std::chrono::nanoseconds(get<int64_t>(p + 8)));
+        u.lastSeen = get<int64_t>(p + 16);
+        uint16_t buckets = get<uint16_t>(p + 24);
+        p += recordFixedSize;
+        if (size_t(end - p) < size_t(idLength) + nameLength + size_t(buckets) * bucketSize)
+            throw bad();
+        u.id.assign(reinterpret_cast<const char*>(p), idLength);
+        p += idLength;
+        u.name.assign(reinterpret_cast<const char*>(p), nameLength);
+        p += nameLength;
+        if (windows && buckets)
+            u.windows.advance(w, now);
+        for (uint16_t b = 0; b < buckets; b++, p += bucketSize) {
+            if (windows)
+                u.windows.add(w, now, get<uint32_t>(p), get<float>(p + 4));
+        }
+    }
+    return users;
+}
+
+std::vector<PendingDeal> UsersStateReader::deals() const {
+    const uint8_t* p = _file->data() + _dealsOffset;
+    const uint8_t* end = _file->data() + _file->size();
+    std::vector<PendingDeal> deals;
+    for (uint64_t n = 0; n < _deals; n++) {
+        if (size_t(end - p) < dealFixedSize)
+            throw UsersStateException("truncated deals in " + _path + "!");
+        uint16_t idLength = get<uint16_t>(p);
+        PendingDeal d;
+        d.amount = get<float>(p + 2);
+        d.at = get<int64_t>(p + 6);
+        p += dealFixedSize;
+        if (size_t(end - p) < idLength)
+            throw UsersStateException("truncated deals in " + _path + "!");
+        d.id.assign(reinterpret_cast<const char*>(p), idLength);
+        p += idLength;
+        deals.push_back(std::move(d));
+    }
+    return deals;
+}
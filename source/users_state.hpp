@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "deal_reorder.hpp"
+#include "user_manager.hpp"
+
+class MappedFile;
+
+// Live users of the active week and the deals still waiting for their
+// week, saved on shutdown (STATE_FILE) and loaded on the next start.
+//
+//   header   u32 magic 'M' 'S' 'S' 'T', u8 version, u8 pad[3], i32 week,
+//            u32 shards, u64 users, i64 bucket length of the rating
+//            windows (s), u64 deals offset, u64 deals, then per shard
+//            u64 offset and u64 users
+//   shard    one record per user
+//              u16 id length, u16 name length, f32 revenue, i64 last deal
+//              and i64 last activity (ns since epoch), u16 window buckets,
+//              id, name, then per bucket u32 index and f32 amount, oldest
+//              first
+//   deals    one record per deal
+//              u16 id length, f32 amount, i64 event time (ns since
+//              epoch), id
+//
+// Shards are independent runs of records so they are decoded side by
+// side; the user table still takes them one at a time. Sessions don't
+// survive a restart, users come back disconnected; their last activity
+// does, so eviction goes on where it stopped.
+class UsersStateException : public std::exception {
+  std::string _message;
+public:
+  UsersStateException(const std::string & message) :
+    _message(message) { }
+  const char * what() const throw() {
+    return _message.c_str();
+  }
+};
+
+// Writes [users] and the waiting [deals] into [path] through a temporary
+// file renamed over it
+void saveUsersState(const std::string& path, int week, const UserDatabase& users,
+                    const RatingWindows& w, size_t shards,
+                    const std::vector<PendingDeal>& deals);
+
+class UsersStateReader {
+public:
+  explicit UsersStateReader(const std::string& path);
+  ~UsersStateReader();
+
+  int week() const { return _week; }
+  size_t users() const { return _users; }
+  size_t shards() const { return _shards.size(); }
+
+  // Users of shard [i] with their windows caught up to bucket [now];
+  // different shards may be decoded at the same time
+  std::vector<UserInformation> shard(size_t i, const RatingWindows& w, uint32_t now) const;
+
+  // Deals that were waiting for their week
+  std::vector<PendingDeal> deals() const;
+
+private:
+  struct Shard {
+    uint64_t offset;
+    uint64_t users;
+  };
+
+  std::string _path;
+  std::unique_ptr<MappedFile> _file;
+  int _week = 0;
+  size_t _users = 0;
+  int64_t _bucketSec = 0;
+  uint64_t _dealsOffset = 0;
+  uint64_t _deals = 0;
+  std::vector<Shard> _shards;
+};
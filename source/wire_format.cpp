@@ -0,0 +1,119 @@
+#include <algorithm>
+
+#include "wire_format.hpp"
+
+namespace wire {
+
+namespace {
+    const uint8_t magic[2] = {'M', 'S'};
+    const uint8_t version = 1;
+}
+
+WireReader::WireReader(const uint8_t * data, size_t size) : _data(data), _size(size) {
+  if (size < headerSize || data[4] != magic[0] || data[5] != magic[1]) {
+    throw WireFormatException("not a binary message!");
+  }
+  if (data[6] != version) {
+    throw WireFormatException("unsupported binary message version!");
+  }
+  uint32_t length;
+  std::memcpy(&length, data, sizeof(length));
+  length = littleEndian(length);
+  if (length > size) {
+    throw WireFormatException("truncated binary message!");
+  }
+  _size = length;
+}
+
+void WireReader::check(size_t offset, size_t size) const {
+  if (offset > _size || size > _size - offset) {
+    throw WireFormatException("field out of binary message bounds!");
+  }
+}
+
+std::string WireReader::text(size_t offset) const {
+  uint32_t at = scalar<uint32_t>(offset);
+  uint32_t len = scalar<uint32_t>(offset + sizeof(uint32_t));
+  check(at, len);
+  return std::string(reinterpret_cast<const char *>(_data + at), len);
+}
+
+size_t WireReader::row(size_t offset, uint32_t i, size_t rowSize) const {
+  uint32_t count = scalar<uint32_t>(offset);
+  uint32_t at = scalar<uint32_t>(offset + sizeof(uint32_t));
+  if (i >= count) {
+    throw WireFormatException("row out of binary table bounds!");
+  }
+  size_t pos = at + size_t(i) * rowSize;
+  check(pos, rowSize);
+  return pos;
+}
+
+WireWriter::WireWriter(WireKind kind, size_t fixedSize, size_t sizeHint) {
+  _buf.reserve(std::max(fixedSize, sizeHint));
+  _buf.resize(fixedSize, 0);
+  _buf[4] = magic[0];
+  _buf[5] = magic[1];
+  _buf[6] = version;
+  _buf[7] = static_cast<uint8_t>(kind);
+}
+
+void WireWriter::text(size_t offset, const std::string & s) {
+  scalar(offset, static_cast<uint32_t>(_buf.size()));
+  scalar(offset + sizeof(uint32_t), static_cast<uint32_t>(s.size()));
+  _buf.insert(_buf.end(), s.begin(), s.end());
+}
+
+size_t WireWriter::table(size_t offset, uint32_t count, size_t rowSize) {
+  size_t at = _buf.size();
+  scalar(offset, count);
+  scalar(offset + sizeof(uint32_t), static_cast<uint32_t>(at));
+  _buf.resize(at + count * rowSize, 0);
+  return at;
+}
+
+std::vector<unsigned char> WireWriter::finish() {
+  scalar(0, static_cast<uint32_t>(_buf.size()));
+  return std::move(_buf);
+}
+
+std::vector<unsigned char> encodeRating(const RatingRequest & req) {
+  size_t size = rating::fixedSize +
+    (req.topRated.size() + req.neighbours.size()) * rating::entry::size;
+  for (const auto & u : req.topRated)
+    size += u.name.size();
+  for (const auto & u : req.neighbours)
+    size += u.name.size();
+
+  WireWriter w(WireKind::Rating, rating::fixedSize, size);
+  w.scalar<uint64_t>(rating::totalUsers, req.totalUsers);
+  w.scalar<uint64_t>(rating::position, req.userPos);
+  w.scalar<uint64_t>(rating::bestNeighbourPos, req.bestNeigbourPos);
+  w.scalar<float>(rating::userRating, req.userRating);
+  w.scalar<float>(rating::topPercent, req.topPercent);
+  w.scalar<uint8_t>(rating::approximate, req.approximate);
+
+  // all rows are reserved before the names get appended behind them
+  size_t top = w.table(rating::topRated, req.topRated.size(), rating::entry::size);
+  size_t near = w.table(rating::neighbours, req.neighbours.size(), rating::entry::size);
+  for (size_t i = 0; i < req.topRated.size(); i++) {
+    size_t row = top + i * rating::entry::size;
+    w.scalar<float>(row + rating::entry::rating, req.topRated[i].totalRev);
+    w.text(row + rating::entry::name, req.topRated[i].name);
+  }
+  for (size_t i = 0; i < req.neighbours.size(); i++) {
+    size_t row = near + i * rating::entry::size;
+    w.scalar<float>(row + rating::entry::rating, req.neighbours[i].totalRev);
+    w.scalar<uint8_t>(row + rating::entry::isCurrent, req.neighbours[i].id == req.userId);
+    w.text(row + rating::entry::name, req.neighbours[i].name);
+  }
+  return w.finish();
+}
+
+std::vector<unsigned char> encodeAck(const std::string & message) {
+  WireWriter w(WireKind::Ack, ack::fixedSize);
+  w.text(ack::message, message);
+  return w.finish();
+}
+
+}
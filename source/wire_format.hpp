@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "user_manager.hpp"
+
+// Compact binary encoding offered next to form-encoded requests and JSON
+// responses (negotiated through Content-Type and Accept).
+//
+// Every message is
+//
+//   u32 length   size of the whole message, this field included
+//   u16 magic    'M' 'S'
+//   u8  version
+//   u8  kind     WireKind
+//   ...          fixed part of the kind, scalars at fixed offsets
+//   ...          variable data (strings, tables)
+//
+// Strings are (u32 offset, u32 length) references from the fixed part into
+// the variable data, tables are (u32 count, u32 offset) to fixed-size rows.
+// Any field is read straight from its offset, nothing is decoded up front.
+// All values are little-endian, on any host.
+namespace wire {
+
+const char * const contentType = "application/x-microsvc";
+
+// [v] turned from or into little-endian byte order
+template <typename T>
+T littleEndian(T v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  unsigned char * b = reinterpret_cast<unsigned char *>(&v);
+  std::reverse(b, b + sizeof(v));
+#endif
+  return v;
+}
+
+enum class WireKind : uint8_t {
+  Deal = 1,
+  User = 2,    // registration, rename, connect and disconnect
+  Rating = 3,
+  Ack = 4
+};
+
+const size_t headerSize = 8;
+
+// Byte offsets of the fields of every kind
+namespace deal {
+  const size_t amount = 8;     // f32
+  const size_t time = 12;      // u64, ns since epoch, 0 for "now"
+  const size_t id = 20;        // string
+  const size_t fixedSize = 28;
+}
+
+namespace user {
+  const size_t id = 8;         // string
+  const size_t name = 16;      // string
+  const size_t flags = 24;     // u8, bit 0: approximate rating
+  const size_t fixedSize = 25;
+  const uint8_t approximate = 1;
+}
+
+namespace rating {
+  const size_t totalUsers = 8;       // u64
+  const size_t position = 16;        // u64
+  const size_t bestNeighbourPos = 24;// u64, position of the first neighbours row
+  const size_t userRating = 32;      // f32
+  const size_t topPercent = 36;      // f32
+  const size_t approximate = 40;     // u8
+  const size_t topRated = 41;        // table of entry rows
+  const size_t neighbours = 49;      // table of entry rows
+  const size_t fixedSize = 57;
+
+  // row of both tables
+  namespace entry {
+    const size_t rating = 0;         // f32
+    const size_t isCurrent = 4;      // u8
+    const size_t name = 8;           // string
+    const size_t size = 16;
+  }
+}
+
+namespace ack {
+  const size_t message = 8;    // string
+  const size_t fixedSize = 16;
+}
+
+class WireFormatException : public std::exception {
+  std::string _message;
+public:
+  WireFormatException(const std::string & message) :
+    _message(message) { }
+  const char * what() const throw() {
+    return _message.c_str();
+  }
+};
+
+// Bounds-checked view over one encoded message
+class WireReader {
+public:
+  WireReader(const uint8_t * data, size_t size);
+
+  WireKind kind() const { return static_cast<WireKind>(_data[7]); }
+
+  template <typename T>
+  T scalar(size_t offset) const {
+    check(offset, sizeof(T));
+    T v;
+    std::memcpy(&v, _data + offset, sizeof(v));
+    return littleEndian(v);
+  }
+
+  std::string text(size_t offset) const;
+
+  // Offset of row [i] of the table referenced at [offset]
+  size_t row(size_t offset, uint32_t i, size_t rowSize) const;
+
+  uint32_t rows(size_t offset) const { return scalar<uint32_t>(offset); }
+
+private:
+  void check(size_t offset, size_t size) const;
+
+  const uint8_t * _data;
+  size_t _size;
+};
+
+// Builds one message: the fixed part starts zeroed, variable data is
+// appended behind it as references are filled in. With an exact
+// [sizeHint] the message takes a single allocation.
+class WireWriter {
+public:
+  WireWriter(WireKind kind, size_t fixedSize, size_t sizeHint = 0);
+
+  template <typename T>
+  void scalar(size_t offset, T v) {
+    v = littleEndian(v);
+    std::memcpy(&_buf[offset], &v, sizeof(v));
+  }
+
+  void text(size_t offset, const std::string & s);
+
+  // Reserves [count] zeroed rows and references them at [offset],
+  // returns the offset of the first row
+  size_t table(size_t offset, uint32_t count, size_t rowSize);
+
+  std::vector<unsigned char> finish();
+
+private:
+  std::vector<unsigned char> _buf;
+};
+
+std::vector<unsigned char> encodeRating(const RatingRequest & req);
+
+std::vector<unsigned char> encodeAck(const std::string & message);
+
+}
@@ -0,0 +1,79 @@
+// Users loaded from STATE_FILE keep the time of their last activity, so a
+// restart doesn't start their inactivity over: one idle for longer than
+// EVICT_AFTER_WEEKS before the restart is evicted right after it.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+
+#include <stdlib.h>
+
+#include "user_manager.hpp"
+#include "users_state.hpp"
+
+namespace {
+    int failures = 0;
+
+    void expect(bool ok, const std::string & what) {
+        if (!ok) {
+            std::cout << "FAILED: " << what << std::endl;
+            failures++;
+        }
+    }
+
+    bool registered(UserManager & users, const std::string & id) {
+        try {
+            users.hadnleUserConnected(id);
+        }
+        catch (UserManagerException & e) {
+            return std::string(e.what()) != "user not registered!";
+        }
+        return true;
+    }
+}
+
+int main() {
+    char dir[] = "/tmp/eviction-restart-XXXXXX";
+    if (!mkdtemp(dir)) {
+        std::cout << "FAILED: no temporary directory" << std::endl;
+        return 1;
+    }
+    std::string state = std::string(dir) + "/users.state";
+
+    // the state an earlier run left behind
+    auto now = Clock::now();
+    auto ns = [](const TimePoint & tp) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+    };
+    UserDatabase saved;
+    UserInformation idle("idle", "Idle");
+    idle.lastSeen = ns(now - std::chrono::hours(2 * 7 * 24));
+    saved.emplace(idle.id, idle);
+    UserInformation recent("recent", "Recent");
+    recent.lastSeen = ns(now - std::chrono::hours(1));
+    saved.emplace(recent.id, recent);
+    // saved in a week not behind the open one, so there is none to archive
+    int week = std::numeric_limits<int>::max();
+    saveUsersState(state, week, saved, RatingWindows(), 1, std::vector<PendingDeal>());
+
+    setenv("STATE_FILE", state.c_str(), 1);
+    setenv("ARCHIVE_DIR", dir, 1);
+    setenv("EVICT_AFTER_WEEKS", "1", 1);
+    auto & users = UserManager::getInstance();
+
+    // eviction looks through the table once a second
+    for (int i = 0; i < 50 && users.getMemoryMetrics().evicted == 0; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    MemoryMetrics m = users.getMemoryMetrics();
+    expect(m.evicted == 1, "evicted " + std::to_string(m.evicted) + " users after the restart, not 1");
+    expect(!registered(users, "idle"), "the user idle for two weeks was kept");
+    expect(registered(users, "recent"), "the user active an hour ago was evicted");
+
+    if (failures)
+        return 1;
+    std::cout << "eviction after restart: ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Ratings of an unchanged users database are served as views into the
+// shared rank snapshot: once it is built, getRating() must not touch the
+// heap, and the binary encoding of a rating takes a single allocation.
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "user_manager.hpp"
+#include "wire_format.hpp"
+
+namespace {
+    // counted per thread, the background threads of UserManager allocate too
+    thread_local size_t allocations = 0;
+
+    int failures = 0;
+
+    void expect(bool ok, const std::string & what) {
+        if (!ok) {
+            std::cout << "FAILED: " << what << std::endl;
+            failures++;
+        }
+    }
+}
+
+void * operator new(std::size_t size) {
+    allocations++;
+    if (void * p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept {
+    std::free(p);
+}
+
+int main() {
+    auto & users = UserManager::getInstance();
+    for (int i = 0; i < 1000; i++) {
+        std::string id = "user" + std::to_string(i);
+        users.registerUser(id, "name" + std::to_string(i));
+        users.hadnleUserConnected(id);
+        users.hadnleUserDial(id, Clock::now(), 10.0f * (i % 100));
+    }
+
+    // the first requests build the snapshot
+    RatingRequest warm;
+    warm.userId = "user500";
+    users.getRating(warm);
+
+    std::vector<std::string> ids;
+    for (int i = 0; i < 100; i++)
+        ids.push_back("user" + std::to_string(i * 7));
+    allocations = 0;
+    for (const auto & id : ids) {
+        RatingRequest top;
+        users.getRating(top);
+        RatingRequest own;
+        own.userId = id;
+        users.getRating(own);
+        RatingRequest approx;
+        approx.userId = "user1";
+        approx.approximate = true;
+        users.getRating(approx);
+    }
+    size_t counted = allocations;
+    expect(counted == 0, "getRating() on an unchanged database allocated " +
+           std::to_string(counted) + " times");
+
+    RatingRequest req;
+    req.userId = "user500";
+    users.getRating(req);
+    allocations = 0;
+    std::vector<unsigned char> encoded = wire::encodeRating(req);
+    counted = allocations;
+    expect(counted == 1, "encodeRating() allocated " + std::to_string(counted) + " times");
+
+    // a change moves the version, the next request builds a new snapshot
+    users.hadnleUserDial("user1", Clock::now(), 1);
+    RatingRequest changed;
+    changed.userId = "user1";
+    allocations = 0;
+    users.getRating(changed);
+    counted = allocations;
+    expect(counted > 0, "getRating() after a deal reused the old snapshot");
+    expect(changed.userRating == 11, "getRating() after a deal missed it");
+
+    if (failures)
+        return 1;
+    std::cout << "rating allocations: ok" << std::endl;
+    return 0;
+}
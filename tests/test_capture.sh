@@ -0,0 +1,29 @@
+#!/bin/bash
+# Captures a short game played against the service, then replays it with
+# traffic-replay at the captured pace and as fast as possible.
+#   $1 - directory with the micro-service and traffic-replay binaries (default: .)
+DIR=${1:-.}
+HOST=`hostname -I | awk '{print $1}'`
+URL=http://$HOST:6502/api
+
+mkdir -p capture
+(cd capture && CAPTURE_FILE=game.cap exec ../$DIR/micro-service) &
+PID=$!
+sleep 1
+
+curl -s -X POST -d "action=start" $URL/admin/capture; echo
+COUNTER=0
+while [ $COUNTER -lt 100 ]; do
+curl -s -X POST -d "id=$COUNTER&name=$COUNTER" $URL/user/registered > /dev/null
+curl -s -X POST -d "id=$COUNTER" $URL/user/connected > /dev/null
+curl -s -X POST -d "id=$COUNTER&amount=$COUNTER.5" $URL/user/deal > /dev/null
+curl -s "$URL/rating/user?id=$COUNTER" > /dev/null
+let COUNTER=COUNTER+1
+done
+curl -s $URL/admin/capture | jq .
+curl -s -X POST -d "action=stop" $URL/admin/capture; echo
+kill -INT $PID
+wait $PID
+
+$DIR/traffic-replay capture/game.cap 1 | grep -v "^[0-9*]"
+$DIR/traffic-replay capture/game.cap 0 4 | grep -v "^[0-9*]"
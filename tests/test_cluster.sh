@@ -0,0 +1,32 @@
+#!/bin/bash
+# Runs three partitions and a router in front of them on this host,
+# registers users through the router and reads the merged rating back.
+#   $1 - path to the micro-service binary (default: ./micro-service)
+BIN=${1:-./micro-service}
+HOST=`hostname -I | awk '{print $1}'`
+ROUTER=http://$HOST:6502/api
+PARTITIONS=http://$HOST:6601/api,http://$HOST:6602/api,http://$HOST:6603/api
+
+PIDS=""
+for PORT in 6601 6602 6603; do
+mkdir -p partition-$PORT
+(cd partition-$PORT && SERVICE_PORT=$PORT exec ../$BIN) &
+PIDS="$PIDS $!"
+done
+sleep 1
+CLUSTER_PARTITIONS=$PARTITIONS SERVICE_PORT=6502 $BIN &
+PIDS="$PIDS $!"
+sleep 1
+
+COUNTER=0
+while [ $COUNTER -lt 30 ]; do
+curl -s -X POST -d "id=$COUNTER&name=$COUNTER" $ROUTER/user/registered > /dev/null
+curl -s -X POST -d "id=$COUNTER&name=$COUNTER" $ROUTER/user/connected > /dev/null
+curl -s -X POST -d "id=$COUNTER&amount=$COUNTER.5" $ROUTER/user/deal > /dev/null
+let COUNTER=COUNTER+1
+done
+
+curl -s "$ROUTER/rating/top?n=5" | jq .
+curl -s "$ROUTER/rating/user?id=12" | jq .
+
+kill -INT $PIDS
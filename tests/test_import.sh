@@ -0,0 +1,18 @@
+#!/bin/bash
+# Bulk registration through /user/import, streamed with chunked encoding.
+#   $1 - number of rows (default: 1000000)
+ROWS=${1:-1000000}
+URL=http://127.0.0.1:6502/api/user/import
+
+# CSV with a header, a revenue column and one bad row
+( echo "id,name,revenue"
+  seq 1 $ROWS | awk '{ print "user" $1 ",Name " $1 "," ($1 % 100) }'
+  echo "broken row" ) |
+curl -s -X POST -H "Transfer-Encoding: chunked" -H "Content-Type: text/csv" \
+  --data-binary @- "$URL?rows=$ROWS" | jq .
+
+# NDJSON, the first row is a duplicate of the CSV import
+( echo '{"id": "user1", "name": "again"}'
+  echo '{"id": "json1", "name": "Json \"One\"", "revenue": 12.5}' ) |
+curl -s -X POST -H "Transfer-Encoding: chunked" -H "Content-Type: application/x-ndjson" \
+  --data-binary @- $URL | jq .
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Runs a replication leader and a follower side by side on this host,
+# feeds the leader and reads the rating back from the follower.
+#   $1 - path to the micro-service binary (default: ./micro-service)
+BIN=${1:-./micro-service}
+HOST=`hostname -I | awk '{print $1}'`
+LEADER=http://$HOST:6502/api
+FOLLOWER=http://$HOST:6503/api
+
+mkdir -p leader follower
+(cd leader && SERVICE_PORT=6502 REPLICATION_PORT=7502 exec ../$BIN) &
+LEADER_PID=$!
+sleep 1
+(cd follower && SERVICE_PORT=6503 REPLICA_OF=127.0.0.1:7502 exec ../$BIN) &
+FOLLOWER_PID=$!
+sleep 1
+
+COUNTER=0
+while [ $COUNTER -lt 20 ]; do
+curl -s -X POST -d "id=$COUNTER&name=$COUNTER" $LEADER/user/registered > /dev/null
+curl -s -X POST -d "id=$COUNTER&name=$COUNTER" $LEADER/user/connected > /dev/null
+curl -s -X POST -d "id=$COUNTER&amount=$COUNTER.5" $LEADER/user/deal > /dev/null
+let COUNTER=COUNTER+1
+done
+sleep 1
+
+curl -s "$FOLLOWER/rating/user?id=7" | jq .
+curl -s $FOLLOWER/replication/status | jq .
+curl -s -X POST -d "id=1&amount=1" $FOLLOWER/user/deal; echo
+
+kill -INT $FOLLOWER_PID $LEADER_PID
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Plays a short game, restarts the service and checks that the users and
+# their ratings come back from the saved state; /service/ready shows how
+# long each startup stage took.
+#   $1 - directory with the micro-service binary (default: .)
+DIR=${1:-.}
+HOST=`hostname -I | awk '{print $1}'`
+URL=http://$HOST:6502/api
+
+mkdir -p restart
+rm -f restart/users.state
+
+start() {
+(cd restart && STATE_FILE=users.state exec ../$DIR/micro-service) &
+PID=$!
+until curl -s -o /dev/null $URL/service/ready; do sleep 0.1; done
+}
+
+start
+COUNTER=0
+while [ $COUNTER -lt 100 ]; do
+curl -s -X POST -d "id=$COUNTER&name=$COUNTER" $URL/user/registered > /dev/null
+curl -s -X POST -d "id=$COUNTER" $URL/user/connected > /dev/null
+curl -s -X POST -d "id=$COUNTER&amount=$COUNTER.5" $URL/user/deal > /dev/null
+let COUNTER=COUNTER+1
+done
+curl -s "$URL/rating/user?id=50" > restart/before.json
+kill -INT $PID
+wait $PID
+
+start
+curl -s $URL/service/ready | jq .
+curl -s "$URL/rating/user?id=50" > restart/after.json
+kill -INT $PID
+wait $PID
+
+diff restart/before.json restart/after.json && echo "ratings kept"
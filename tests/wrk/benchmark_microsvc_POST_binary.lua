@@ -0,0 +1,57 @@
+-- MIT License
+--
+-- Copyright (c) 2016 ivmeroLabs.
+--
+-- Permission is hereby granted, free of charge, to any person obtaining a copy
+-- of this software and associated documentation files (the "Software"), to deal
+-- in the Software without restriction, including without limitation the rights
+-- to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+-- copies of the Software, and to permit persons to whom the Software is
+-- furnished to do so, subject to the following conditions:
+--
+-- The above copyright notice and this permission notice shall be included in all
+-- copies or substantial portions of the Software.
+--
+-- THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+-- IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+-- FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+-- AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+-- LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+-- OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+-- SOFTWARE.
+
+
+-- Same deal as benchmark_microsvc_POST.lua in the binary encoding
+-- (see source/wire_format.hpp for the layout).
+local ffi = require("ffi")
+
+local function u32(v)
+   return string.char(v % 256, math.floor(v / 256) % 256,
+                      math.floor(v / 65536) % 256, math.floor(v / 16777216) % 256)
+end
+
+local function f32(v)
+   local f = ffi.new("float[1]", v)
+   return ffi.string(f, 4)
+end
+
+local function deal(id, amount)
+   local fixed = 28
+   return u32(fixed + #id) .. "MS" .. string.char(1, 1) ..
+      f32(amount) .. u32(0) .. u32(0) ..  -- amount, time (0: now)
+      u32(fixed) .. u32(#id) .. id         -- id reference and data
+end
+
+local body = deal("777", 0.001)
+
+request = function()
+   headers = {}
+   headers["Content-Type"] = "application/x-microsvc"
+   headers["Accept"] = "application/x-microsvc"
+   return wrk.format("POST", "/api/user/deal", headers, body)
+end
+
+response = function(status, headers, body)
+   -- comment the following line to avoid server's excesive I/O to console on heavy load
+   io.write("response: " .. status .. " " .. #body .. " bytes\n")
+end
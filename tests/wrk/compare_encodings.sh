@@ -0,0 +1,33 @@
+#!/bin/bash
+# Runs every benchmark pair in both encodings against a running service and
+# reports bytes on the wire and service CPU time per request.
+#   $1 - service URL (default: http://127.0.0.1:6502)
+#   $2 - PID of the service (default: the running micro-service)
+URL=${1:-http://127.0.0.1:6502}
+PID=${2:-`pgrep -n micro-service`}
+TICKS=`getconf CLK_TCK`
+
+# users the scripts deal and ask for
+curl -s -X POST -d "id=777&name=777" $URL/api/user/registered > /dev/null
+curl -s -X POST -d "id=777&name=777" $URL/api/user/connected > /dev/null
+
+cpu_ticks() {
+   awk '{print $14 + $15}' /proc/$PID/stat
+}
+
+run() {
+   before=`cpu_ticks`
+   out=`wrk -c50 -t4 -d20s -s $1 $URL --rate 5000 2>&1`
+   after=`cpu_ticks`
+   requests=`echo "$out" | awk '/requests in/ {print $1}'`
+   read=`echo "$out" | awk '/requests in/ {print $5}'`
+   cpu=`echo "($after - $before) * 1000000 / $TICKS / $requests" | bc`
+   printf "%-40s %10s requests %10s read %6s us CPU/request\n" $1 $requests $read $cpu
+}
+
+for pair in "benchmark_microsvc_POST.lua benchmark_microsvc_POST_binary.lua" \
+            "benchmark_microsvc_rating.lua benchmark_microsvc_rating_binary.lua"; do
+   for script in $pair; do
+      run $script
+   done
+done